@@ -53,7 +53,7 @@ static int parse_args(int argc, char** argv, const parse_args_t* args)
                                 if (argv[i][k + 2] == 0 || args->multi_char_ext[j][k] == 0 || argv[i][k + 2] != args->multi_char_ext[j][k])
                                     break;
 
-                            if (argv[i][k + 2] != '=' || args->multi_char_ext[j][k] == 0)
+                            if (argv[i][k + 2] != '=' || args->multi_char_ext[j][k] != 0)
                                 continue;
 
                             PARSE_ARGS_ARG(ARG_MULTI_CHAR_EXT, argv[i], argv[i] + k + 3)
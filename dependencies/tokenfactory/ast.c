@@ -1,6 +1,67 @@
 
 #include "tokenfactory.h"
 
+/*
+ *  Node arenas
+ *
+ *  A parsed script allocates all of its nodes, texts and children arrays from one arena instead of one malloc
+ *  each. Nodes are kept in fixed-size blocks so that releasing the arena can run their on_release hooks in a
+ *  linear sweep; everything else is bump-allocated from byte blocks. Once the script node has been made the
+ *  root of its arena, releasing it releases the whole arena. Releasing any other arena node only runs the hooks
+ *  of its subtree, its memory is reclaimed with the arena.
+ *
+ *  Source locations are kept beside the nodes rather than in them: the arena numbers its nodes in allocation
+ *  order and appends the line (as the difference to the previous one) and column of each to a byte stream of
+ *  varints. Every AST_LOCATION_CHECKPOINT-th entry holds an absolute line and its offset is recorded, so finding a
+ *  location decodes at most that many entries. A node made without a token is located at its left (or right)
+ *  operand, or else at the position last given to ast_arena_locate.
+ */
+
+#define AST_ARENA_NODES         256
+#define AST_ARENA_BYTES         16384
+#define AST_ARENA_ALIGN         8
+#define AST_LOCATION_CHECKPOINT 64
+
+typedef struct AstArenaNodes
+{
+    struct AstArenaNodes* next;
+    size_t first, num_nodes;
+
+    AstNode_t nodes[AST_ARENA_NODES];
+}
+AstArenaNodes_t;
+
+typedef struct AstArenaBytes
+{
+    struct AstArenaBytes* next;
+    size_t used, capacity;
+}
+AstArenaBytes_t;
+
+typedef struct
+{
+    uint8_t* data;
+    size_t length, capacity;
+
+    /* offset of every AST_LOCATION_CHECKPOINT-th entry */
+    size_t* checkpoints;
+
+    size_t count;
+    int last_line;
+}
+AstLocations_t;
+
+struct AstArena
+{
+    AstArenaNodes_t* nodes;
+    AstArenaBytes_t* bytes;
+
+    AstNode_t* root;
+
+    AstLocations_t locations;
+    int line, column;
+};
+
 static void ast_indent(int indent)
 {
     int i;
@@ -9,22 +70,280 @@ static void ast_indent(int indent)
         printf("  ");
 }
 
+TFFUNC AstArena_t* ast_arena()
+{
+    AstArena_t* arena;
+
+    arena = (AstArena_t*) malloc(sizeof(AstArena_t));
+    arena->nodes = NULL;
+    arena->bytes = NULL;
+    arena->root = NULL;
+
+    memset(&arena->locations, 0, sizeof(arena->locations));
+    arena->line = 0;
+    arena->column = 0;
+
+    return arena;
+}
+
+TFFUNC void ast_arena_release(AstArena_t** arena_p)
+{
+    AstArenaNodes_t *nodes, *next_nodes;
+    AstArenaBytes_t *bytes, *next_bytes;
+    size_t i;
+
+    if ((*arena_p) == NULL)
+        return;
+
+    for (nodes = (*arena_p)->nodes; nodes != NULL; nodes = nodes->next)
+        for (i = 0; i < nodes->num_nodes; i++)
+            if (nodes->nodes[i].on_release != NULL)
+                nodes->nodes[i].on_release(&nodes->nodes[i]);
+
+    for (nodes = (*arena_p)->nodes; nodes != NULL; nodes = next_nodes)
+    {
+        next_nodes = nodes->next;
+        free(nodes);
+    }
+
+    for (bytes = (*arena_p)->bytes; bytes != NULL; bytes = next_bytes)
+    {
+        next_bytes = bytes->next;
+        free(bytes);
+    }
+
+    free((*arena_p)->locations.data);
+    free((*arena_p)->locations.checkpoints);
+
+    free(*arena_p);
+    *arena_p = NULL;
+}
+
+static void ast_locations_put(AstLocations_t* locations, uint32_t value)
+{
+    do
+    {
+        if (locations->length == locations->capacity)
+        {
+            locations->capacity = (locations->capacity == 0) ? 256 : (locations->capacity * 2);
+            locations->data = (uint8_t*) realloc(locations->data, locations->capacity);
+        }
+
+        locations->data[locations->length++] = (uint8_t) ((value & 0x7F) | ((value > 0x7F) ? 0x80 : 0));
+        value >>= 7;
+    }
+    while (value > 0);
+}
+
+static uint32_t ast_locations_get(const AstLocations_t* locations, size_t* offset)
+{
+    uint32_t value;
+    int shift;
+
+    value = 0;
+    shift = 0;
+
+    do
+        value |= (uint32_t) (locations->data[*offset] & 0x7F) << shift, shift += 7;
+    while (locations->data[(*offset)++] & 0x80);
+
+    return value;
+}
+
+static void ast_locations_add(AstLocations_t* locations, int line, int column)
+{
+    int delta;
+
+    if (locations->count % AST_LOCATION_CHECKPOINT == 0)
+    {
+        locations->checkpoints = (size_t*) realloc(locations->checkpoints,
+                (locations->count / AST_LOCATION_CHECKPOINT + 1) * sizeof(size_t));
+        locations->checkpoints[locations->count / AST_LOCATION_CHECKPOINT] = locations->length;
+        locations->last_line = 0;
+    }
+
+    /* zigzag, so that small steps back are small too */
+    delta = line - locations->last_line;
+    ast_locations_put(locations, (delta >= 0) ? ((uint32_t) delta << 1) : (((uint32_t) -(delta + 1) << 1) | 1));
+    ast_locations_put(locations, (uint32_t) TFMAX(column, 0));
+
+    locations->last_line = line;
+    locations->count++;
+}
+
+/* the ordinal of an arena node, or -1 */
+static intptr_t ast_arena_ordinal(const AstNode_t* node)
+{
+    AstArenaNodes_t* nodes;
+
+    for (nodes = node->arena->nodes; nodes != NULL; nodes = nodes->next)
+        if (node >= nodes->nodes && node < nodes->nodes + nodes->num_nodes)
+            return (intptr_t) (nodes->first + (node - nodes->nodes));
+
+    return -1;
+}
+
+/* returns -1 if the node isn't in an arena */
+static int ast_arena_location(const AstNode_t* node, int* line_out, int* column_out)
+{
+    const AstLocations_t* locations;
+    intptr_t ordinal;
+    size_t offset, i;
+    uint32_t delta;
+    int line, column;
+
+    if (node->arena == NULL || (ordinal = ast_arena_ordinal(node)) < 0)
+        return -1;
+
+    locations = &node->arena->locations;
+    offset = locations->checkpoints[ordinal / AST_LOCATION_CHECKPOINT];
+    line = 0;
+    column = 0;
+
+    for (i = 0; i <= (size_t) ordinal % AST_LOCATION_CHECKPOINT; i++)
+    {
+        delta = ast_locations_get(locations, &offset);
+        line += (delta & 1) ? -(int) (delta >> 1) - 1 : (int) (delta >> 1);
+        column = (int) ast_locations_get(locations, &offset);
+    }
+
+    *line_out = line;
+    *column_out = column;
+
+    return 0;
+}
+
+TFFUNC AstNode_t* ast_location(const AstNode_t* node, int* line_out, int* column_out)
+{
+    if (ast_arena_location(node, line_out, column_out) != 0)
+    {
+        *line_out = node->token.line;
+        *column_out = 0;
+        return NULL;
+    }
+
+    return node->arena->root;
+}
+
+TFFUNC void ast_arena_locate(AstArena_t* arena, int line, int column)
+{
+    if (arena != NULL)
+    {
+        arena->line = line;
+        arena->column = column;
+    }
+}
+
+TFFUNC void ast_arena_set_root(AstNode_t* root)
+{
+    if (root->arena != NULL)
+        root->arena->root = root;
+}
+
+static void* ast_arena_alloc(AstArena_t* arena, size_t size)
+{
+    AstArenaBytes_t* bytes;
+    void* memory;
+
+    size = (size + AST_ARENA_ALIGN - 1) & ~((size_t) AST_ARENA_ALIGN - 1);
+
+    if (arena->bytes == NULL || arena->bytes->used + size > arena->bytes->capacity)
+    {
+        size_t capacity;
+
+        /* large allocations get a block of their own, so that they don't waste the rest of the current one */
+        capacity = TFMAX(size, AST_ARENA_BYTES);
+
+        bytes = (AstArenaBytes_t*) malloc(sizeof(AstArenaBytes_t) + capacity);
+        bytes->used = 0;
+        bytes->capacity = capacity;
+
+        if (arena->bytes != NULL && capacity > AST_ARENA_BYTES)
+        {
+            bytes->next = arena->bytes->next;
+            arena->bytes->next = bytes;
+        }
+        else
+        {
+            bytes->next = arena->bytes;
+            arena->bytes = bytes;
+        }
+    }
+    else
+        bytes = arena->bytes;
+
+    memory = (uint8_t*) (bytes + 1) + bytes->used;
+    bytes->used += size;
+
+    return memory;
+}
+
+TFFUNC uint8_t* ast_arena_text(AstArena_t* arena, const uint8_t* text, size_t length)
+{
+    uint8_t* copy;
+
+    if (arena != NULL)
+        copy = (uint8_t*) ast_arena_alloc(arena, length + 1);
+    else
+        copy = (uint8_t*) malloc(length + 1);
+
+    memcpy(copy, text, length);
+    copy[length] = 0;
+
+    return copy;
+}
+
 TFFUNC void ast_addchild(AstNode_t* node, AstNode_t* child)
 {
     if (node->children_num + 1 > node->children_max)
     {
         node->children_max = (node->children_max == 0) ? 4 : (node->children_max * 2);
-        node->children = (AstNode_t**) realloc(node->children, node->children_max * sizeof(AstNode_t*));
+
+        if (node->arena != NULL)
+        {
+            AstNode_t** children;
+
+            /* the old array stays in the arena, the doubling keeps that waste below the size of the new one */
+            children = (AstNode_t**) ast_arena_alloc(node->arena, node->children_max * sizeof(AstNode_t*));
+
+            if (node->children_num > 0)
+                memcpy(children, node->children, node->children_num * sizeof(AstNode_t*));
+
+            node->children = children;
+        }
+        else
+            node->children = (AstNode_t**) realloc(node->children, node->children_max * sizeof(AstNode_t*));
     }
 
     node->children[node->children_num++] = child;
 }
 
-TFFUNC AstNode_t* ast_node(int name, Token_t* token)
+TFFUNC AstNode_t* ast_arena_node(AstArena_t* arena, int name, Token_t* token)
 {
     AstNode_t* node;
 
-    node = (AstNode_t*) malloc( sizeof(struct AstNode) );
+    if (arena != NULL)
+    {
+        if (arena->nodes == NULL || arena->nodes->num_nodes == AST_ARENA_NODES)
+        {
+            AstArenaNodes_t* nodes;
+
+            nodes = (AstArenaNodes_t*) malloc(sizeof(AstArenaNodes_t));
+            nodes->next = arena->nodes;
+            nodes->first = (arena->nodes != NULL) ? (arena->nodes->first + AST_ARENA_NODES) : 0;
+            nodes->num_nodes = 0;
+            arena->nodes = nodes;
+        }
+
+        node = &arena->nodes->nodes[arena->nodes->num_nodes++];
+
+        if (token != NULL)
+            ast_locations_add(&arena->locations, token->line, token->pos_in_line);
+        else
+            ast_locations_add(&arena->locations, arena->line, arena->column);
+    }
+    else
+        node = (AstNode_t*) malloc( sizeof(struct AstNode) );
 
     node->name = name;
 
@@ -35,26 +354,54 @@ TFFUNC AstNode_t* ast_node(int name, Token_t* token)
     node->children_max = 0;
     node->cust_data = NULL;
     node->on_release = NULL;
+    node->arena = arena;
+
+    node->token.line = 0;
+    node->token.number = 0;
+    node->token.decimal = 0.0;
+    node->token.text = NULL;
 
     if (token != NULL)
-        tf_move_token(&node->token, token);
-    else
-        tf_clear_token(&node->token);
+    {
+        node->token.line = token->line;
+        node->token.number = token->number;
+        node->token.decimal = token->decimal;
+
+        /* token texts live only as long as their tokenfactory */
+        if (token->text != NULL)
+            node->token.text = ast_arena_text(arena, token->text, token->text_length);
+    }
 
     return node;
 }
 
-TFFUNC AstNode_t* ast_node_2(int name, AstNode_t* left, AstNode_t* right)
+TFFUNC AstNode_t* ast_arena_node_2(AstArena_t* arena, int name, AstNode_t* left, AstNode_t* right)
 {
     AstNode_t* node;
+    int line, column;
 
-    node = ast_node(name, NULL);
+    /* an operation is where its first operand is */
+    if (arena != NULL && (left != NULL || right != NULL)
+            && ast_arena_location((left != NULL) ? left : right, &line, &column) == 0)
+        ast_arena_locate(arena, line, column);
+
+    node = ast_arena_node(arena, name, NULL);
     node->left = left;
     node->right = right;
 
     return node;
 }
 
+TFFUNC AstNode_t* ast_node(int name, Token_t* token)
+{
+    return ast_arena_node(NULL, name, token);
+}
+
+TFFUNC AstNode_t* ast_node_2(int name, AstNode_t* left, AstNode_t* right)
+{
+    return ast_arena_node_2(NULL, name, left, right);
+}
+
 TFFUNC void ast_print(AstNode_t* node, int indent, const char** names, size_t num_names)
 {
     size_t i;
@@ -83,6 +430,26 @@ TFFUNC void ast_print(AstNode_t* node, int indent, const char** names, size_t nu
         ast_print(node->children[i], indent + 1, names, num_names);
 }
 
+static void ast_release_hooks(AstNode_t* node)
+{
+    size_t i;
+
+    if (node->on_release != NULL)
+    {
+        node->on_release(node);
+        node->on_release = NULL;
+    }
+
+    if (node->left != NULL)
+        ast_release_hooks(node->left);
+
+    if (node->right != NULL)
+        ast_release_hooks(node->right);
+
+    for (i = 0; i < node->children_num; i++)
+        ast_release_hooks(node->children[i]);
+}
+
 TFFUNC void ast_release_node(AstNode_t** node_p)
 {
     size_t i;
@@ -90,10 +457,25 @@ TFFUNC void ast_release_node(AstNode_t** node_p)
     if ((*node_p) == NULL)
         return;
 
+    if ((*node_p)->arena != NULL)
+    {
+        AstArena_t* arena;
+
+        arena = (*node_p)->arena;
+
+        if (arena->root == *node_p)
+            ast_arena_release(&arena);
+        else
+            ast_release_hooks(*node_p);
+
+        *node_p = NULL;
+        return;
+    }
+
     if ((*node_p)->on_release != NULL)
         (*node_p)->on_release(*node_p);
 
-    tf_release_token( &(*node_p)->token );
+    free( (*node_p)->token.text );
 
     if ((*node_p)->left != NULL)
         ast_release_node(&(*node_p)->left);
@@ -116,11 +498,12 @@ TFFUNC int ast_serialize_node(AstNode_t* node, FILE *f)
     int16_t name;
     uint16_t children_num;
 
-    int32_t token_c, token_number;
-    float token_dec;
-    uint16_t token_text_len;
+    int32_t token_number, token_line, token_column;
+    double token_dec;
+    uint32_t token_text_len;
 
     size_t i;
+    int line, column;
 
     flags = 0;
 
@@ -130,20 +513,28 @@ TFFUNC int ast_serialize_node(AstNode_t* node, FILE *f)
     if (node->right != NULL)
         flags |= 2;
 
+    /* the text is written either way, but an empty one and none at all look the same */
+    if (node->token.text != NULL)
+        flags |= 4;
+
     name = node->name;
     children_num = node->children_num;
 
-    token_c = node->token.c;
+    ast_location(node, &line, &column);
+
     token_number = node->token.number;
-    token_dec = (float) node->token.decimal;
+    token_line = line;
+    token_column = column;
+    token_dec = node->token.decimal;
 
     fwrite(&flags, 1, 1, f);
     fwrite(&name, 2, 1, f);
     fwrite(&children_num, 2, 1, f);
 
-    fwrite(&token_c, 4, 1, f);
     fwrite(&token_number, 4, 1, f);
-    fwrite(&token_dec, 4, 1, f);
+    fwrite(&token_line, 4, 1, f);
+    fwrite(&token_column, 4, 1, f);
+    fwrite(&token_dec, 8, 1, f);
 
     if (node->left != NULL)
         ast_serialize_node(node->left, f);
@@ -157,29 +548,124 @@ TFFUNC int ast_serialize_node(AstNode_t* node, FILE *f)
     if (node->token.text != NULL)
     {
         token_text_len = strlen((const char*) node->token.text);
-        fwrite(&token_text_len, 2, 1, f);
+        fwrite(&token_text_len, 4, 1, f);
         fwrite(node->token.text, 1, token_text_len, f);
     }
     else
     {
         token_text_len = 0;
-        fwrite(&token_text_len, 2, 1, f);
+        fwrite(&token_text_len, 4, 1, f);
     }
 
-    return 0;
+    return ferror(f) ? -1 : 0;
 }
 
 TFFUNC int ast_serialize(AstNode_t* node, const char* filename)
 {
     FILE *f;
+    int rc;
 
     f = fopen(filename, "wb");
 
     if (f == NULL)
         return -1;
 
-    ast_serialize_node(node, f);
+    rc = ast_serialize_node(node, f);
+
+    if (fclose(f) != 0)
+        rc = -1;
+
+    return rc;
+}
+
+TFFUNC AstNode_t* ast_deserialize_node(AstArena_t* arena, FILE *f)
+{
+    AstNode_t* node;
+
+    uint8_t flags;
+    int16_t name;
+    uint16_t children_num;
+
+    int32_t token_number, token_line, token_column;
+    double token_dec;
+    uint32_t token_text_len;
+
+    size_t i;
+
+    if (fread(&flags, 1, 1, f) != 1 || fread(&name, 2, 1, f) != 1 || fread(&children_num, 2, 1, f) != 1
+            || fread(&token_number, 4, 1, f) != 1 || fread(&token_line, 4, 1, f) != 1
+            || fread(&token_column, 4, 1, f) != 1 || fread(&token_dec, 8, 1, f) != 1)
+        return NULL;
+
+    ast_arena_locate(arena, token_line, token_column);
+
+    node = ast_arena_node(arena, name, NULL);
+    node->token.number = token_number;
+    node->token.line = token_line;
+    node->token.decimal = token_dec;
+
+    if ((flags & 1) && (node->left = ast_deserialize_node(arena, f)) == NULL)
+        goto error;
+
+    if ((flags & 2) && (node->right = ast_deserialize_node(arena, f)) == NULL)
+        goto error;
+
+    for (i = 0; i < children_num; i++)
+    {
+        AstNode_t* child;
+
+        if ((child = ast_deserialize_node(arena, f)) == NULL)
+            goto error;
+
+        ast_addchild(node, child);
+    }
+
+    if (fread(&token_text_len, 4, 1, f) != 1)
+        goto error;
+
+    if (flags & 4)
+    {
+        uint8_t* text;
+
+        /* read through a temporary buffer so that a damaged length can't grow the arena */
+        text = (uint8_t*) malloc((size_t) token_text_len + 1);
+
+        if (text == NULL || fread(text, 1, token_text_len, f) != token_text_len)
+        {
+            free(text);
+            goto error;
+        }
+
+        node->token.text = ast_arena_text(arena, text, token_text_len);
+        free(text);
+    }
+
+    return node;
+
+error:
+    ast_release_node(&node);
+    return NULL;
+}
+
+TFFUNC AstNode_t* ast_deserialize(const char* filename)
+{
+    FILE *f;
+    AstArena_t* arena;
+    AstNode_t* node;
+
+    f = fopen(filename, "rb");
+
+    if (f == NULL)
+        return NULL;
+
+    arena = ast_arena();
+    node = ast_deserialize_node(arena, f);
+
+    if (node != NULL)
+        ast_arena_set_root(node);
+    else
+        ast_arena_release(&arena);
 
     fclose(f);
-    return 0;
-}
\ No newline at end of file
+    return node;
+}
@@ -1,20 +1,39 @@
 
 #include "tokenfactory.h"
 
+#define TB_TOKENS 8
+
+#define TB_SLOT(tbuf_, i_) (((tbuf_)->first + (i_)) & ((tbuf_)->tokens_max - 1))
+
+/* only needed when looking further ahead than ever before; unwraps the ring into the new array */
+static void tb_grow(Tokenbuffer_t* tbuf)
+{
+    Token_t* tokens;
+    size_t i;
+
+    tokens = (Token_t*) malloc(tbuf->tokens_max * 2 * sizeof(struct Token));
+
+    for (i = 0; i < tbuf->tokens_num; i++)
+        tokens[i] = tbuf->tokens[TB_SLOT(tbuf, i)];
+
+    free(tbuf->tokens);
+
+    tbuf->tokens = tokens;
+    tbuf->first = 0;
+    tbuf->tokens_max *= 2;
+}
+
 static int tb_pump_tokens(Tokenbuffer_t* tbuf, size_t count)
 {
     while (count > 0)
     {
         if (tbuf->tokens_num + 1 > tbuf->tokens_max)
-        {
-            tbuf->tokens_max = (tbuf->tokens_max == 0) ? 4 : (tbuf->tokens_max * 2);
-            tbuf->tokens = (Token_t*) realloc(tbuf->tokens, tbuf->tokens_max * sizeof(struct Token));
-        }
+            tb_grow(tbuf);
 
         if (tf_parse_token(tbuf->tf) < 0)
             return -1;
 
-        tf_move_token(&tbuf->tokens[tbuf->tokens_num], &tbuf->tf->token);
+        tf_move_token(&tbuf->tokens[TB_SLOT(tbuf, tbuf->tokens_num)], &tbuf->tf->token);
         tbuf->tokens_num++;
 
         count--;
@@ -49,6 +68,17 @@ TFFUNC int tb_accept_sequence(Tokenbuffer_t* tbuf, int name, const char* text)
         return 0;
 }
 
+TFFUNC int tb_accept_keyword(Tokenbuffer_t* tbuf, int keyword)
+{
+    if (tb_check_keyword(tbuf, keyword) != NULL)
+    {
+        tb_drop(tbuf);
+        return 1;
+    }
+    else
+        return 0;
+}
+
 TFFUNC Token_t* tb_check(Tokenbuffer_t* tbuf, int name)
 {
     Token_t* current;
@@ -79,6 +109,21 @@ TFFUNC Token_t* tb_check_sequence(Tokenbuffer_t* tbuf, int name, const char* tex
         return NULL;
 }
 
+TFFUNC Token_t* tb_check_keyword(Tokenbuffer_t* tbuf, int keyword)
+{
+    Token_t* current;
+
+    current = tb_current(tbuf);
+
+    if (current == NULL)
+        return NULL;
+
+    if (current->type == TOKENCLASS_SEQUENCE && current->keyword == keyword)
+        return current;
+    else
+        return NULL;
+}
+
 TFFUNC Token_t* tb_current(Tokenbuffer_t* tbuf)
 {
     if (tbuf->tokens_num < 1)
@@ -87,17 +132,30 @@ TFFUNC Token_t* tb_current(Tokenbuffer_t* tbuf)
             return NULL;
     }
 
-    return &tbuf->tokens[0];
+    return &tbuf->tokens[tbuf->first];
 }
 
 TFFUNC void tb_drop(Tokenbuffer_t* tbuf)
 {
-    /*TODO: check num_tokens > 0 */
+    if (tbuf->tokens_num < 1)
+        return;
 
-    tf_release_token(&tbuf->tokens[0]);
+    tf_release_token(&tbuf->tokens[tbuf->first]);
 
+    tbuf->first = TB_SLOT(tbuf, 1);
     tbuf->tokens_num--;
-    memmove(&tbuf->tokens[0], &tbuf->tokens[1], tbuf->tokens_num * sizeof(struct Token));
+}
+
+/* the token 'ahead' tokens after the current one (0 is the current one), or NULL if the input ends before it */
+TFFUNC Token_t* tb_peek(Tokenbuffer_t* tbuf, size_t ahead)
+{
+    if (tbuf->tokens_num < ahead + 1)
+    {
+        if (tb_pump_tokens(tbuf, ahead + 1 - tbuf->tokens_num) < 0)
+            return NULL;
+    }
+
+    return &tbuf->tokens[TB_SLOT(tbuf, ahead)];
 }
 
 TFFUNC void tb_skip(Tokenbuffer_t *tbuf, int name)
@@ -114,13 +172,14 @@ TFFUNC Tokenbuffer_t* tokenbuffer(Tokenfactory_t* tf)
 
     tbuf = (Tokenbuffer_t*) malloc( sizeof(Tokenbuffer_t) );
 
-    tbuf->tf = tf;
-
     if (tbuf != NULL)
     {
-        tbuf->tokens = NULL;
+        tbuf->tf = tf;
+
+        tbuf->tokens = (Token_t*) malloc(TB_TOKENS * sizeof(struct Token));
+        tbuf->first = 0;
         tbuf->tokens_num = 0;
-        tbuf->tokens_max = 0;
+        tbuf->tokens_max = TB_TOKENS;
     }
 
     return tbuf;
@@ -135,7 +194,7 @@ TFFUNC void tokenbuffer_del(Tokenbuffer_t** tbuf_p)
 
     for (i = 0; i < (*tbuf_p)->tokens_num; i++)
     {
-        tf_release_token(&(*tbuf_p)->tokens[i]);
+        tf_release_token(&(*tbuf_p)->tokens[TB_SLOT(*tbuf_p, i)]);
     }
 
     free( (*tbuf_p)->tokens );
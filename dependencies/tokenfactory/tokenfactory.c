@@ -3,8 +3,23 @@
 
 #include <limits.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TF_SSE2
+#include <emmintrin.h>
+#endif
+
 /*TODO: move me */
-enum { C_UNK, C_WS, C_TOKEN };
+enum { C_UNK, C_WS, C_TOKEN, C_COMMENT };
+
+#define TF_MAP_TEST(map_, c_) ((map_)[(c_) >> 3] & (1 << ((c_) & 7)))
+#define TF_MAP_SET(map_, c_) ((map_)[(c_) >> 3] |= (uint8_t) (1 << ((c_) & 7)))
 
 static int tf_fetch_byte(Tf_t* tf, uint8_t* byte)
 {
@@ -15,6 +30,340 @@ static int tf_fetch_byte(Tf_t* tf, uint8_t* byte)
     return 1;
 }
 
+/* builds a span from the ASCII part of a 256-bit map, leaving out '\n' so that bulk skips never cross a line */
+static void tf_build_span(Tfspan_t* span, const uint8_t* map)
+{
+    int c;
+
+    memcpy(span->map, map, 16);
+    span->map['\n' >> 3] &= (uint8_t) ~(1 << ('\n' & 7));
+
+    span->num_ranges = 0;
+
+    for (c = 0; c < 128; c++)
+    {
+        if (!TF_MAP_TEST(span->map, c))
+            continue;
+
+        if (span->num_ranges > 0 && span->hi[span->num_ranges - 1] == c - 1)
+            span->hi[span->num_ranges - 1] = (uint8_t) c;
+        else if (span->num_ranges < TF_SPAN_RANGES)
+        {
+            span->lo[span->num_ranges] = (uint8_t) c;
+            span->hi[span->num_ranges] = (uint8_t) c;
+            span->num_ranges++;
+        }
+        else
+        {
+            span->num_ranges = 0;
+            break;
+        }
+    }
+}
+
+/* the number of bytes at the current input position that belong to 'span'. the caller must have nothing
+   pushed back in tf->c, and advances the input by the result */
+static size_t tf_span(Tf_t* tf, const Tfspan_t* span)
+{
+    const uint8_t* p;
+    size_t i, n;
+
+    p = tf->input + tf->inputpos;
+    n = tf->inputlen - tf->inputpos;
+
+    /* most runs are short, so the first 16 bytes are checked one at a time */
+    for (i = 0; i < n && i < 16; i++)
+        if (p[i] >= 0x80 || !TF_MAP_TEST(span->map, p[i]))
+            return i;
+
+#ifdef TF_SSE2
+    /* then 16 bytes at a time: (byte - lo) < (hi - lo + 1) as an unsigned compare, done as a signed one on
+       values with the sign bit flipped. bytes >= 0x80 never fall into an ASCII range */
+    if (span->num_ranges > 0)
+    {
+        const __m128i sign = _mm_set1_epi8((char) 0x80);
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i bytes, in;
+            size_t r;
+
+            bytes = _mm_loadu_si128((const __m128i*) (p + i));
+            in = _mm_setzero_si128();
+
+            for (r = 0; r < span->num_ranges; r++)
+            {
+                __m128i offset, width;
+
+                offset = _mm_xor_si128(_mm_sub_epi8(bytes, _mm_set1_epi8((char) span->lo[r])), sign);
+                width = _mm_set1_epi8((char) (((span->hi[r] - span->lo[r]) + 1) ^ 0x80));
+                in = _mm_or_si128(in, _mm_cmplt_epi8(offset, width));
+            }
+
+            /* the scalar loop below finds the first byte that is not in the span */
+            if (_mm_movemask_epi8(in) != 0xFFFF)
+                break;
+        }
+    }
+#endif
+
+    while (i < n && p[i] < 0x80 && TF_MAP_TEST(span->map, p[i]))
+        i++;
+
+    return i;
+}
+
+/* skips 'n' bytes returned by tf_span; they are all on the current line */
+static void tf_advance(Tf_t* tf, size_t n)
+{
+    tf->inputpos += n;
+    tf->pos_in_line += (int) n;
+}
+
+/*
+ *  Token texts are assembled directly in a chunked arena owned by the tokenfactory, so a token costs no
+ *  allocation of its own and has no length limit. A text that outgrows its chunk moves to a new one large enough
+ *  for it; the texts stay valid until the tokenfactory is deleted.
+ */
+
+#define TF_TEXT_CHUNK 16384
+
+struct Tftext
+{
+    struct Tftext* next;
+    size_t used, capacity;
+};
+
+/* makes room for 'n' more bytes of the text being assembled, and its terminator */
+static void tf_text_reserve(Tf_t* tf, size_t n)
+{
+    Tftext_t* chunk;
+    size_t capacity;
+
+    if (tf->texts != NULL && tf->texts->used + tf->text_length + n + 1 <= tf->texts->capacity)
+        return;
+
+    capacity = TFMAX(TF_TEXT_CHUNK, 2 * (tf->text_length + n + 1));
+
+    chunk = (Tftext_t*) malloc(sizeof(Tftext_t) + capacity);
+    chunk->used = 0;
+    chunk->capacity = capacity;
+
+    if (tf->text_length > 0)
+        memcpy(chunk + 1, (uint8_t*) (tf->texts + 1) + tf->texts->used, tf->text_length);
+
+    chunk->next = tf->texts;
+    tf->texts = chunk;
+}
+
+static void tf_text_append(Tf_t* tf, const uint8_t* bytes, size_t n)
+{
+    tf_text_reserve(tf, n);
+
+    memcpy((uint8_t*) (tf->texts + 1) + tf->texts->used + tf->text_length, bytes, n);
+    tf->text_length += n;
+}
+
+static void tf_text_push(Tf_t* tf, uint8_t byte)
+{
+    tf_text_reserve(tf, 1);
+
+    ((uint8_t*) (tf->texts + 1))[tf->texts->used + tf->text_length] = byte;
+    tf->text_length++;
+}
+
+/* terminates the text being assembled and starts the next one; unless 'keep' is set, the text is only valid
+   until then */
+static uint8_t* tf_text_end(Tf_t* tf, int keep, size_t* length_out)
+{
+    uint8_t* text;
+
+    tf_text_reserve(tf, 0);
+
+    text = (uint8_t*) (tf->texts + 1) + tf->texts->used;
+    text[tf->text_length] = 0;
+
+    if (length_out != NULL)
+        *length_out = tf->text_length;
+
+    if (keep)
+        tf->texts->used += tf->text_length + 1;
+
+    tf->text_length = 0;
+    return text;
+}
+
+/*
+ *  Number literals are converted while they are read. The digits are accumulated into a 64-bit mantissa, which
+ *  makes integers exact (out of range values saturate and are then truncated to 32 bits, as they were with
+ *  strtol). A decimal whose mantissa fits into 53 bits and that has at most 22 digits after the point is the
+ *  quotient of two exactly representable doubles, which IEEE division rounds correctly; only longer ones are
+ *  written out as text and left to strtod. Like strtol and strtod, conversion stops at the first digit that is not
+ *  valid in the base and at a second decimal point, while the token still extends over them.
+ */
+
+#define TF_MAX_DIGITS 19
+
+typedef struct
+{
+    uint64_t mantissa;
+    int base, num_digits;
+
+    /* digits before and after the point, leading zeros included */
+    size_t int_digits, frac_digits;
+
+    /* 'point' is 1 after a decimal point; 'stopped' is set when the rest is ignored; 'in_text' when the number
+       is being written out for strtod */
+    int point, stopped, saturated, in_text;
+}
+Tfnumber_t;
+
+static const double tf_powers_of_10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static void tf_number_begin(Tfnumber_t* number, int base)
+{
+    number->mantissa = 0;
+    number->base = base;
+    number->num_digits = 0;
+    number->int_digits = 0;
+    number->frac_digits = 0;
+    number->point = 0;
+    number->stopped = 0;
+    number->saturated = 0;
+    number->in_text = 0;
+}
+
+/* writes the digits read so far into the text being assembled */
+static void tf_number_to_text(Tf_t* tf, Tfnumber_t* number)
+{
+    char digits[24];
+    size_t length, total, i;
+
+    length = (number->mantissa != 0) ? (size_t) sprintf(digits, "%llu", (unsigned long long) number->mantissa) : 0;
+    total = number->int_digits + number->frac_digits;
+
+    for (i = 0; i < total; i++)
+    {
+        if (number->point && i == number->int_digits)
+            tf_text_push(tf, '.');
+
+        tf_text_push(tf, (uint8_t) ((i + length < total) ? '0' : digits[i + length - total]));
+    }
+
+    if (number->point && number->frac_digits == 0)
+        tf_text_push(tf, '.');
+
+    number->in_text = 1;
+}
+
+static void tf_number_digit(Tf_t* tf, Tfnumber_t* number, uint32_t c)
+{
+    int digit;
+
+    if (number->stopped)
+        return;
+
+    if (c <= '9')
+        digit = c - '0';
+    else if (c >= 'a')
+        digit = c - 'a' + 10;
+    else
+        digit = c - 'A' + 10;
+
+    if (digit >= number->base)
+    {
+        number->stopped = 1;
+        return;
+    }
+
+    if (number->in_text)
+    {
+        tf_text_push(tf, (uint8_t) c);
+        return;
+    }
+
+    /* only base 10 numbers can turn out to be decimals, they are written out before the mantissa overflows */
+    if (number->base == 10 && number->num_digits == TF_MAX_DIGITS)
+    {
+        tf_number_to_text(tf, number);
+        tf_text_push(tf, (uint8_t) c);
+        return;
+    }
+
+    if (number->point)
+        number->frac_digits++;
+    else
+        number->int_digits++;
+
+    if (number->mantissa == 0 && digit == 0)
+        return;
+
+    /* TF_MAX_DIGITS base 10 digits always fit, other bases stop at the largest signed value */
+    if (number->base != 10
+            && (number->saturated || number->mantissa > (UINT64_C(0x7FFFFFFFFFFFFFFF) - digit) / number->base))
+        number->saturated = 1;
+    else
+        number->mantissa = number->mantissa * number->base + digit;
+
+    number->num_digits++;
+}
+
+static void tf_number_point(Tf_t* tf, Tfnumber_t* number)
+{
+    if (number->point || number->stopped)
+    {
+        number->stopped = 1;
+        return;
+    }
+
+    number->point = 1;
+
+    if (number->in_text)
+        tf_text_push(tf, '.');
+}
+
+static int32_t tf_number_int(Tf_t* tf, Tfnumber_t* number)
+{
+    uint64_t value;
+
+    /* too long to have been a decimal */
+    if (number->in_text)
+        tf_text_end(tf, 0, NULL);
+
+    if (number->saturated || number->in_text || number->mantissa > UINT64_C(0x7FFFFFFFFFFFFFFF))
+        value = UINT64_C(0x7FFFFFFFFFFFFFFF);
+    else
+        value = number->mantissa;
+
+    return (int32_t) (uint32_t) value;
+}
+
+static double tf_number_decimal(Tf_t* tf, Tfnumber_t* number)
+{
+    double value, scale;
+    size_t i;
+
+    if (number->base != 10)
+    {
+        for (value = (double) number->mantissa, scale = 1.0, i = 0; i < number->frac_digits; i++)
+            scale *= number->base;
+
+        return value / scale;
+    }
+
+    if (!number->in_text && number->mantissa <= (UINT64_C(1) << 53) && number->frac_digits <= 22)
+        return (double) number->mantissa / tf_powers_of_10[number->frac_digits];
+
+    if (!number->in_text)
+        tf_number_to_text(tf, number);
+
+    /* the text is only needed for the conversion, so it doesn't stay in the text arena */
+    return strtod((const char*) tf_text_end(tf, 0, NULL), NULL);
+}
+
 static int tf_is_in_ranges(int32_t c, Tokenclass_t* tc)
 {
     size_t i;
@@ -45,11 +394,154 @@ static int tf_is_in_ranges(int32_t c, Tokenclass_t* tc)
     return 0;
 }
 
+static int tf_is_in_class(Tf_t* tf, int32_t c, Tokenclass_t* tc)
+{
+    if (tc->type == TOKENCLASS_SEQUENCE && c >= 0 && c < 256)
+        return TF_MAP_TEST(tf->sequence_maps + (tc - tf->classes) * 32, c) ? 1 : 0;
+
+    return tf_is_in_ranges(c, tc);
+}
+
+static int tf_is_whitespace(Tf_t* tf, uint32_t c)
+{
+    size_t i;
+
+    if (c < 256)
+        return TF_MAP_TEST(tf->whitespace_map, c);
+
+    for (i = 0; i < tf->whitespaces_num; i++)
+        if (c == tf->whitespaces[i])
+            return 1;
+
+    return 0;
+}
+
+/* whether a token of class 'tc' may start with 'c'; used to build the dispatch table */
+static int tf_may_start(Tokenclass_t* tc, uint32_t c)
+{
+    switch (tc->type)
+    {
+        case TOKENCLASS_CHAR:
+            return c == (uint32_t) tc->c;
+
+        case TOKENCLASS_NUMBER:
+            return (tc->c > 0) ? (c == (uint32_t) tc->c) : (tf_is_in_ranges(c, tc) != 0);
+
+        case TOKENCLASS_SEQUENCE:
+            return tf_is_in_ranges(c, tc);
+
+        case TOKENCLASS_STRING:
+            return c == (uint32_t) tc->oq;
+
+        case TOKENCLASS_WORD:
+            return c == (uint32_t) tc->word[0];
+    }
+
+    return 0;
+}
+
+static void tf_build_dispatch(Tf_t* tf)
+{
+    size_t i, num;
+    uint32_t c;
+
+    free(tf->dispatch);
+    free(tf->sequence_maps);
+    free(tf->spans);
+
+    tf->sequence_maps = (uint8_t*) calloc(tf->classes_num, 32);
+    tf->spans = (Tfspan_t*) calloc(tf->classes_num, sizeof(Tfspan_t));
+
+    for (i = 0; i < tf->classes_num; i++)
+    {
+        Tokenclass_t* tc = &tf->classes[i];
+
+        if (tc->type == TOKENCLASS_SEQUENCE)
+        {
+            for (c = 0; c < 256; c++)
+                if (tf_is_in_ranges(c, tc))
+                    TF_MAP_SET(tf->sequence_maps + i * 32, c);
+
+            tf_build_span(&tf->spans[i], tf->sequence_maps + i * 32);
+        }
+        else if (tc->type == TOKENCLASS_STRING)
+        {
+            uint8_t body[32];
+
+            /* everything up to the closing quote or an escape */
+            memset(body, 0xFF, sizeof(body));
+
+            if (tc->cq >= 0 && tc->cq < 256)
+                body[tc->cq >> 3] &= (uint8_t) ~(1 << (tc->cq & 7));
+
+            if (tc->esc >= 0 && tc->esc < 256)
+                body[tc->esc >> 3] &= (uint8_t) ~(1 << (tc->esc & 7));
+
+            tf_build_span(&tf->spans[i], body);
+        }
+    }
+
+    num = 0;
+
+    for (c = 0; c < 256; c++)
+    {
+        tf->dispatch_begin[c] = num;
+
+        for (i = 0; i < tf->classes_num; i++)
+            if (tf_may_start(&tf->classes[i], c))
+                num++;
+    }
+
+    tf->dispatch_begin[256] = num;
+    tf->dispatch = (size_t*) malloc((num + 1) * sizeof(size_t));
+
+    num = 0;
+
+    for (c = 0; c < 256; c++)
+        for (i = 0; i < tf->classes_num; i++)
+            if (tf_may_start(&tf->classes[i], c))
+                tf->dispatch[num++] = i;
+}
+
+/*
+ *  Keywords are found with a perfect hash: tf_keywords_set searches for a seed under which no two keywords share
+ *  a slot, so a SEQUENCE token needs one hash and at most one comparison to know whether it is a keyword.
+ */
+
+static uint32_t tf_keyword_hash(uint32_t seed, const uint8_t* text, size_t length)
+{
+    uint32_t h;
+    size_t i;
+
+    h = 2166136261u ^ seed;
+
+    for (i = 0; i < length; i++)
+        h = (h ^ text[i]) * 16777619u;
+
+    return h ^ (h >> 15);
+}
+
+static int tf_keyword(Tf_t* tf, const uint8_t* text, size_t length)
+{
+    Tfkeyword_t* slot;
+
+    if (tf->keywords == NULL || length > tf->keyword_max_length)
+        return -1;
+
+    slot = &tf->keywords[tf_keyword_hash(tf->keywords_seed, text, length) & tf->keywords_mask];
+
+    if (slot->word != NULL && slot->length == length && memcmp(slot->word, text, length) == 0)
+        return slot->id;
+
+    return -1;
+}
+
 static int tf_is_token(Tf_t* tf, Tokenclass_t* tc)
 {
     tf->token.type = tc->type;
     tf->token.name = tc->name;
     tf->token.indent = tf->indent;
+    tf->token.keyword = -1;
 
     return C_TOKEN;
 }
@@ -145,10 +637,32 @@ static int tf_read_word(Tf_t* tf, const char* word)
 {
     uint32_t cache, c;
     size_t oldpos;
-    int old_pos_in_line;
+    int old_line, old_line_begin, old_indent, old_pos_in_line;
+
+    /* nothing pushed back and a plain ASCII word: compare against the input in place */
+    if (tf->c <= 0)
+    {
+        size_t length;
+
+        for (length = 0; word[length] != 0 && (uint8_t) word[length] < 0x80 && word[length] != '\n'; length++)
+            ;
+
+        if (word[length] == 0)
+        {
+            if (length > tf->inputlen - tf->inputpos || memcmp(tf->input + tf->inputpos, word, length) != 0)
+                return -1;
+
+            tf->inputpos += length;
+            tf->pos_in_line += (int) length;
+            return 0;
+        }
+    }
 
     cache = tf->c;
     oldpos = tf->inputpos;
+    old_line = tf->line;
+    old_line_begin = tf->line_begin;
+    old_indent = tf->indent;
     old_pos_in_line = tf->pos_in_line;
 
     while (*word)
@@ -157,6 +671,9 @@ static int tf_read_word(Tf_t* tf, const char* word)
         {
             tf->c = cache;
             tf->inputpos = oldpos;
+            tf->line = old_line;
+            tf->line_begin = old_line_begin;
+            tf->indent = old_indent;
             tf->pos_in_line = old_pos_in_line;
             return -1;
         }
@@ -174,6 +691,8 @@ TFFUNC void tf_clear_token(Token_t* token)
     token->type = -1;
     token->name = -1;
     token->text = NULL;
+    token->text_length = 0;
+    token->keyword = -1;
 }
 
 /*TFFUNC void tf_copy_token(Token_t* token, const Token_t* src)
@@ -257,220 +776,394 @@ TFFUNC char* tf_load_file(const char *filename, size_t *size_out)
     return buffer;
 }
 
-TFFUNC void tf_move_token(Token_t* token, Token_t* src)
-{
-    memcpy(token, src, sizeof(struct Token));
-    tf_clear_token(src);
-}
+#define TF_READ_CHUNK 65536
 
-TFFUNC void tf_on_token(Tf_t* tf, TF_TOKEN_CB on_token)
+/* reads until the end of the stream, for pipes and other inputs of unknown size */
+static char* tf_read_stream(FILE* f, size_t* size_out)
 {
-    tf->on_token = on_token;
+    char* buffer;
+    size_t size, capacity, n;
+
+    size = 0;
+    capacity = TF_READ_CHUNK;
+    buffer = (char*) malloc(capacity + 1);
+
+    while (buffer != NULL && (n = fread(buffer + size, 1, capacity - size, f)) > 0)
+    {
+        size += n;
+
+        if (size == capacity)
+        {
+            capacity *= 2;
+            buffer = (char*) realloc(buffer, capacity + 1);
+        }
+    }
+
+    if (buffer == NULL || ferror(f))
+    {
+        free(buffer);
+        return NULL;
+    }
+
+    buffer[size] = 0;
+    *size_out = size;
+    return buffer;
 }
 
-TFFUNC int tf_parse_token(Tf_t* tf)
+/*
+ *  Regular files are mapped instead of copied, as long as the mapping ends within a page: the rest of the page
+ *  reads as zeros, so the text is NUL-terminated without a copy. Anything else, and "-" for stdin, is read in
+ *  chunks. returns 0 on success
+ */
+TFFUNC int tf_source_open(Tfsource_t* source, const char* filename)
 {
-    uint32_t c;
-    size_t i;
-    int type;
-    int token_line, token_pos;
+    FILE* f;
+    char* text;
+    size_t length;
 
-    tf_release_token(&tf->token);
+    source->text = NULL;
+    source->length = 0;
+    source->mapped = 0;
 
-    _restart:
+    if (strcmp(filename, "-") == 0)
+    {
+        if ((text = tf_read_stream(stdin, &length)) == NULL)
+            return -1;
 
-    do
+        source->text = text;
+        source->length = length;
+        return 0;
+    }
+
+#ifndef _WIN32
     {
-        token_line = tf->line;
-        token_pos = tf->pos_in_line;
+        struct stat st;
+        long page_size;
+        void* mapping;
+        int fd;
 
-        if (tf_read_char(tf, &c) < 0)
-            return -1;
+        fd = open(filename, O_RDONLY);
 
-        type = C_UNK;
+        if (fd < 0)
+            return -1;
 
-        /*printf("char: %c\n", c);*/
+        page_size = sysconf(_SC_PAGESIZE);
 
-        for (i = 0; i < tf->whitespaces_num; i++)
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && page_size > 0
+                && st.st_size % page_size != 0)
         {
-            if (c == tf->whitespaces[i])
+            mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (mapping != MAP_FAILED)
             {
-                tf->indent++;
-                type = C_WS;
-                break;
+                close(fd);
+
+                source->text = (const char*) mapping;
+                source->length = (size_t) st.st_size;
+                source->mapped = 1;
+                return 0;
             }
         }
+
+        close(fd);
     }
-    while (type == C_WS);
+#endif
+
+    f = fopen(filename, "rb");
+
+    if (f == NULL)
+        return -1;
+
+    text = tf_read_stream(f, &length);
+    fclose(f);
+
+    if (text == NULL)
+        return -1;
+
+    source->text = text;
+    source->length = length;
+    return 0;
+}
+
+TFFUNC void tf_source_close(Tfsource_t* source)
+{
+#ifndef _WIN32
+    if (source->mapped)
+        munmap((void*) source->text, source->length);
+    else
+#endif
+        free((void*) source->text);
+
+    source->text = NULL;
+    source->length = 0;
+    source->mapped = 0;
+}
+
+TFFUNC void tf_move_token(Token_t* token, Token_t* src)
+{
+    memcpy(token, src, sizeof(struct Token));
+    tf_clear_token(src);
+}
 
-    for (i = 0; type == C_UNK && i < tf->classes_num; i++)
+TFFUNC void tf_on_token(Tf_t* tf, TF_TOKEN_CB on_token)
+{
+    tf->on_token = on_token;
+}
+
+/* matches the token starting with '*c_p' against one class, which may consume further characters. a NUMBER
+   class with an opening character may replace '*c_p' with the character after it, even if it doesn't match */
+static int tf_match_class(Tf_t* tf, Tokenclass_t* tc, uint32_t* c_p)
+{
+    uint32_t c;
+    int type;
+
+    c = *c_p;
+    type = C_UNK;
+
+    switch (tc->type)
     {
-        Tokenclass_t* tc = &tf->classes[i];
+        case TOKENCLASS_CHAR:
+            if (c == tc->c)
+            {
+                type = tf_is_token(tf, tc);
+                tf->token.c = c;
+            }
+            break;
 
-        switch (tc->type)
+        case TOKENCLASS_NUMBER:
         {
-            case TOKENCLASS_CHAR:
-                if (c == tc->c)
-                {
-                    type = tf_is_token(tf, tc);
-                    tf->token.c = c;
-                }
-                break;
+            /* if there is an opening character required, check for it */
+            if (tc->c > 0)
+            {
+                if (c != tc->c || tf_read_char(tf, &c) < 0)
+                    break;
+            }
 
-            case TOKENCLASS_NUMBER:
+            if (tf_is_in_class(tf, c, tc))
             {
-                /* if there is an opening character required, check for it */
-                if (tc->c > 0)
+                Tfnumber_t number;
+                int is_in_range;
+
+                type = tf_is_token(tf, tc);
+                tf_number_begin(&number, tc->base);
+
+                /* push init char back to cache */
+                tf->c = c;
+
+                while (1)
                 {
-                    if (c != tc->c || tf_read_char(tf, &c) < 0)
+                    if (tf_read_char(tf, &c) < 0)
                         break;
-                }
 
-                if (tf_is_in_ranges(c, tc))
-                {
-                    char tmp[400];
-                    size_t j;
-                    int is_decimal, is_in_range;
+                    is_in_range = tf_is_in_class(tf, c, tc);
 
-                    type = tf_is_token(tf, tc);
-                    is_decimal = 0;
+                    if (!is_in_range)
+                        break;
+                    else if (is_in_range == 1)
+                    {
+                        tf_number_digit(tf, &number, c);
+                    }
+                    else
+                    {
+                        if (number.point)
+                            printf( "Error: double decimal ALSO FIXME\n");
 
-                    /* push init char back to cache */
-                    tf->c = c;
+                        tf_number_point(tf, &number);
+                    }
+                }
 
-                    j = 0;
-                    while (1)
-                    {
-                        if (tf_read_char(tf, &c) < 0)
-                            break;
+                tf->c = c;
 
-                        is_in_range = tf_is_in_ranges(c, tc);
+                if (number.point)
+                {
+                    if (tc->base != 10)
+                        printf( "Error: base incompatible with decimal number\n");
 
-                        if (!is_in_range)
-                            break;
-                        else if (is_in_range == 1)
-                        {
-                            tmp[j++] = c;
-                        }
-                        else
-                        {
-                            if (is_decimal)
-                                printf( "Error: double decimal ALSO FIXME\n");
+                    tf->token.name = tc->decimal_name;
+                    tf->token.decimal = tf_number_decimal(tf, &number);
+                }
+                else
+                    tf->token.number = tf_number_int(tf, &number);
+            }
+            break;
+        }
 
-                            is_decimal = 1;
-                            tmp[j++] = '.';
-                        }
-                    }
+        case TOKENCLASS_SEQUENCE:
+            if (tf_is_in_class(tf, c, tc))
+            {
+                type = tf_is_token(tf, tc);
 
-                    tf->c = c;
-                    tmp[j++] = 0;
+                tf_text_push(tf, (uint8_t) c);
 
-                    if (is_decimal)
+                while (1)
+                {
+                    /* ASCII runs are copied in bulk, anything else goes through tf_read_char */
+                    if (tf->c <= 0)
                     {
-                        if (tc->base != 10)
-                            printf( "Error: base incompatible with decimal number\n");
+                        size_t n;
 
-                        tf->token.name = tc->decimal_name;
-                        tf->token.decimal = strtod(tmp, NULL);
+                        n = tf_span(tf, &tf->spans[tc - tf->classes]);
+                        tf_text_append(tf, tf->input + tf->inputpos, n);
+                        tf_advance(tf, n);
                     }
+
+                    if (tf_read_char(tf, &c) < 0)
+                        break;
+
+                    if (!tf_is_in_class(tf, c, tc))
+                        break;
                     else
                     {
-                        tf->token.number = strtol(tmp, NULL, tc->base);
-
-                        if (tf->token.number == INT_MAX)
-                            tf->token.number = strtoul(tmp, NULL,tc->base);
+                        tf_text_push(tf, (uint8_t) c);
                     }
                 }
-                break;
-            }
 
-            case TOKENCLASS_SEQUENCE:
-                if (tf_is_in_ranges(c, tc))
-                {
-                    char tmp[400];
-                    size_t j;
+                tf->c = c;
+                tf->token.text = tf_text_end(tf, 1, &tf->token.text_length);
+                tf->token.keyword = tf_keyword(tf, tf->token.text, tf->token.text_length);
+            }
+            break;
 
-                    type = tf_is_token(tf, tc);
+        case TOKENCLASS_STRING:
+            if (c == tc->oq)
+            {
+                int escape;
 
-                    j = 0;
-                    tmp[j++] = c;
-                    while (1)
+                escape = 0;
+                while (1)
+                {
+                    /* the body up to the next quote, escape, line break or non-ASCII character in bulk;
+                       comments are skipped without being copied */
+                    if (!escape && tf->c <= 0)
                     {
-                        if (tf_read_char(tf, &c) < 0)
-                            break;
+                        size_t n;
 
-                        if (!tf_is_in_ranges(c, tc))
-                            break;
-                        else
-                        {
-                            tmp[j++] = c;
-                        }
-                    }
+                        n = tf_span(tf, &tf->spans[tc - tf->classes]);
 
-                    tf->c = c;
-                    tmp[j++] = 0;
+                        if (tc->purpose != CLASS_COMMENT)
+                            tf_text_append(tf, tf->input + tf->inputpos, n);
 
-                    tf->token.text = (uint8_t*) malloc(j);
-                    memcpy(tf->token.text, tmp, j);
-                }
-                break;
+                        tf_advance(tf, n);
+                    }
 
-            case TOKENCLASS_STRING:
-                if (c == tc->oq)
-                {
-                    char tmp[400];
-                    size_t j;
-                    int escape;
+                    if (tf_read_char(tf, &c) < 0)
+                        /* error actually */
+                        break;
 
-                    j = 0;
-                    escape = 0;
-                    while (1)
+                    if (!escape && c == tc->esc)
+                        escape = 1;
+                    else if (!escape && c == tc->cq)
+                        break;
+                    else
                     {
-                        if (tf_read_char(tf, &c) < 0)
-                            /* error actually */
-                            break;
-
-                        if (!escape && c == tc->esc)
-                            escape = 1;
-                        else if (!escape && c == tc->cq)
-                            break;
-                        else
+                        if(escape && tc->fmtclass == TF_FMTCLASS_C)
                         {
-                            if(escape && tc->fmtclass == TF_FMTCLASS_C)
-                            {
-                                if (c == 'n')
-                                    c = '\n';
-                                else if (c == 't')
-                                    c = '\t';
-                            }
-
-                            tmp[j++] = c;
-                            escape = 0;
+                            if (c == 'n')
+                                c = '\n';
+                            else if (c == 't')
+                                c = '\t';
                         }
-                    }
 
-                    tmp[j++] = 0;
+                        if (tc->purpose != CLASS_COMMENT)
+                            tf_text_push(tf, (uint8_t) c);
 
-                    if (tc->purpose == CLASS_COMMENT)
-                        goto _restart;
+                        escape = 0;
+                    }
+                }
 
+                if (tc->purpose == CLASS_COMMENT)
+                    type = C_COMMENT;
+                else
+                {
                     type = tf_is_token(tf, tc);
-                    tf->token.text = (uint8_t*) malloc(j);
-                    memcpy(tf->token.text, tmp, j);
+                    tf->token.text = tf_text_end(tf, 1, &tf->token.text_length);
                 }
+            }
+            break;
+
+        case TOKENCLASS_WORD:
+            if (c != tc->word[0])
                 break;
 
-            case TOKENCLASS_WORD:
-                if (c != tc->word[0])
-                    break;
+            if (tf_read_word(tf, tc->word + 1) != 0)
+                break;
 
-                if (tf_read_word(tf, tc->word + 1) != 0)
-                    break;
+            type = tf_is_token(tf, tc);
+            break;
+    }
 
-                type = tf_is_token(tf, tc);
+    *c_p = c;
+    return type;
+}
+
+TFFUNC int tf_parse_token(Tf_t* tf)
+{
+    uint32_t c, old_c;
+    size_t i, k, first;
+    int type;
+    int token_line, token_pos;
+
+    tf_release_token(&tf->token);
+
+    _restart:
+
+    do
+    {
+        /* runs of whitespace within a line are skipped in bulk */
+        if (tf->c <= 0)
+        {
+            size_t n;
+
+            n = tf_span(tf, &tf->whitespace_span);
+            tf_advance(tf, n);
+            tf->indent += (int) n;
+        }
+
+        token_line = tf->line;
+        token_pos = tf->pos_in_line;
+
+        if (tf_read_char(tf, &c) < 0)
+            return -1;
+
+        type = C_UNK;
+
+        /*printf("char: %c\n", c);*/
+
+        if (tf_is_whitespace(tf, c))
+        {
+            tf->indent++;
+            type = C_WS;
+        }
+    }
+    while (type == C_WS);
+
+    /* only the classes that may start with 'c' are tried; if a class consumed 'c' without matching, the
+       remaining ones are tried in order against the character it left */
+    first = tf->classes_num;
+
+    if (c < 256)
+    {
+        for (k = tf->dispatch_begin[c]; type == C_UNK && k < tf->dispatch_begin[c + 1]; k++)
+        {
+            i = tf->dispatch[k];
+            old_c = c;
+            type = tf_match_class(tf, &tf->classes[i], &c);
+
+            if (type == C_UNK && c != old_c)
+            {
+                first = i + 1;
                 break;
+            }
         }
     }
+    else
+        first = 0;
+
+    for (i = first; type == C_UNK && i < tf->classes_num; i++)
+        type = tf_match_class(tf, &tf->classes[i], &c);
+
+    if (type == C_COMMENT)
+        goto _restart;
 
     if (type == C_TOKEN)
     {
@@ -501,8 +1194,9 @@ TFFUNC void tf_parse(Tf_t* tf)
 
 TFFUNC void tf_release_token(Token_t* token)
 {
-    free(token->text);
+    /* the text belongs to the tokenfactory's text arena */
     token->text = NULL;
+    token->text_length = 0;
 }
 
 TFFUNC void tf_stop_parse(Tf_t* tf)
@@ -520,6 +1214,12 @@ TFFUNC void tf_whitespace_add(Tf_t* tf, const uint32_t* chars_in, size_t count)
 
     memcpy(tf->whitespaces + tf->whitespaces_num, chars_in, count * sizeof(uint32_t) );
     tf->whitespaces_num += count;
+
+    for (; count > 0; count--, chars_in++)
+        if (*chars_in < 256)
+            TF_MAP_SET(tf->whitespace_map, *chars_in);
+
+    tf_build_span(&tf->whitespace_span, tf->whitespace_map);
 }
 
 TFFUNC void tf_whitespace_common(Tf_t* tf)
@@ -529,6 +1229,63 @@ TFFUNC void tf_whitespace_common(Tf_t* tf)
     tf_whitespace_add(tf, chars, 4);
 }
 
+/* words[i] becomes keyword i; the words are not copied and must stay valid as long as the tokenfactory */
+TFFUNC void tf_keywords_set(Tf_t* tf, const char* const* words, size_t count)
+{
+    size_t size, i;
+    uint32_t seed;
+
+    free(tf->keywords);
+    tf->keywords = NULL;
+    tf->keyword_max_length = 0;
+
+    if (count == 0)
+        return;
+
+    for (i = 0; i < count; i++)
+        tf->keyword_max_length = TFMAX(tf->keyword_max_length, strlen(words[i]));
+
+    for (size = 2; size < 2 * count; size *= 2)
+        ;
+
+    tf->keywords = (Tfkeyword_t*) malloc(size * sizeof(Tfkeyword_t));
+
+    /* tries a number of seeds per table size; a table twice the number of keywords rarely needs many */
+    for (seed = 0; ; seed++)
+    {
+        if (seed == 256)
+        {
+            size *= 2;
+            seed = 0;
+            tf->keywords = (Tfkeyword_t*) realloc(tf->keywords, size * sizeof(Tfkeyword_t));
+        }
+
+        memset(tf->keywords, 0, size * sizeof(Tfkeyword_t));
+
+        for (i = 0; i < count; i++)
+        {
+            Tfkeyword_t* slot;
+            size_t length;
+
+            length = strlen(words[i]);
+            slot = &tf->keywords[tf_keyword_hash(seed, (const uint8_t*) words[i], length) & (size - 1)];
+
+            if (slot->word != NULL)
+                break;
+
+            slot->word = words[i];
+            slot->length = length;
+            slot->id = (int) i;
+        }
+
+        if (i == count)
+            break;
+    }
+
+    tf->keywords_mask = size - 1;
+    tf->keywords_seed = seed;
+}
+
 TFFUNC void tokenclass_add(Tf_t* tf, const Tokenclass_t* classes_in, size_t count)
 {
     if (tf->classes_num + count >= tf->classes_max)
@@ -539,6 +1296,8 @@ TFFUNC void tokenclass_add(Tf_t* tf, const Tokenclass_t* classes_in, size_t coun
 
     memcpy(tf->classes + tf->classes_num, classes_in, count * sizeof(Tokenclass_t) );
     tf->classes_num += count;
+
+    tf_build_dispatch(tf);
 }
 
 TFFUNC Tf_t* tokenfactory()
@@ -557,6 +1316,19 @@ TFFUNC Tf_t* tokenfactory()
         tf->whitespaces_num = 0;
         tf->whitespaces_max = 0;
 
+        memset(tf->dispatch_begin, 0, sizeof(tf->dispatch_begin));
+        tf->dispatch = NULL;
+        memset(tf->whitespace_map, 0, sizeof(tf->whitespace_map));
+        tf->sequence_maps = NULL;
+
+        memset(&tf->whitespace_span, 0, sizeof(tf->whitespace_span));
+        tf->spans = NULL;
+
+        tf->keywords = NULL;
+        tf->keywords_mask = 0;
+        tf->keyword_max_length = 0;
+        tf->keywords_seed = 0;
+
         tf->ownsinput = 0;
         tf->input = NULL;
         tf->inputlen = 0;
@@ -565,6 +1337,9 @@ TFFUNC Tf_t* tokenfactory()
         tf->line = -1;
         tf->indent = -1;
 
+        tf->texts = NULL;
+        tf->text_length = 0;
+
         tf_clear_token(&tf->token);
 
         tf->stop_parse = -1;
@@ -582,8 +1357,21 @@ TFFUNC void tokenfactory_del(Tf_t** tf_p)
 
     tf_release_token(&(*tf_p)->token);
 
+    while ((*tf_p)->texts != NULL)
+    {
+        Tftext_t* next;
+
+        next = (*tf_p)->texts->next;
+        free((*tf_p)->texts);
+        (*tf_p)->texts = next;
+    }
+
     free( (*tf_p)->classes );
     free( (*tf_p)->whitespaces );
+    free( (*tf_p)->dispatch );
+    free( (*tf_p)->sequence_maps );
+    free( (*tf_p)->spans );
+    free( (*tf_p)->keywords );
 
     if( (*tf_p)->ownsinput )
         free( (*tf_p)->input );
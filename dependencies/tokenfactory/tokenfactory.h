@@ -68,11 +68,44 @@ enum {
     CLASS_TOKEN
 };
 
+typedef struct AstArena AstArena_t;
 typedef struct AstNode AstNode_t;
 typedef struct Token Token_t;
 typedef struct Tokenbuffer Tokenbuffer_t;
 typedef struct Tokenclass Tokenclass_t;
 typedef struct Tokenfactory Tokenfactory_t, Tf_t;
+typedef struct Tftext Tftext_t;
+
+/* a set of ASCII bytes (never including '\n') that the tokenizer can skip over in bulk; also kept as up to
+   TF_SPAN_RANGES inclusive ranges for the SIMD scanner, num_ranges is 0 if it needs more */
+#define TF_SPAN_RANGES 8
+
+/* the contents of a source file, always NUL-terminated; mapped in place where possible */
+typedef struct
+{
+    const char* text;
+    size_t length;
+    int mapped;
+}
+Tfsource_t;
+
+/* a slot of the keyword table; empty slots have word == NULL */
+typedef struct
+{
+    const char* word;
+    size_t length;
+    int id;
+}
+Tfkeyword_t;
+
+typedef struct
+{
+    uint8_t map[16];
+
+    uint8_t lo[TF_SPAN_RANGES], hi[TF_SPAN_RANGES];
+    size_t num_ranges;
+}
+Tfspan_t;
 
 typedef void (*TF_ERROR_CB)(Tf_t* tf, int err);
 typedef void (*TF_TOKEN_CB)(Tf_t* tf);
@@ -106,8 +139,12 @@ struct Token
     int32_t number;
     double decimal;
 
+    /* for SEQUENCE tokens, the index of the keyword they spell (see tf_keywords_set), otherwise -1 */
+    int keyword;
+
+    /* NUL-terminated, owned by the tokenfactory's text arena */
     uint8_t* text;
-    size_t text_capacity;
+    size_t text_length;
 };
 
 struct Tokenfactory
@@ -118,6 +155,24 @@ struct Tokenfactory
     uint32_t* whitespaces;
     size_t whitespaces_num, whitespaces_max;
 
+    /* first-character dispatch, rebuilt by tokenclass_add: the classes that a token starting with byte b may
+       belong to are dispatch[dispatch_begin[b]] to dispatch[dispatch_begin[b + 1] - 1], in declaration order */
+    size_t dispatch_begin[257];
+    size_t* dispatch;
+
+    /* bitmaps of the bytes that are whitespace, and that each SEQUENCE class accepts (32 bytes per class) */
+    uint8_t whitespace_map[32];
+    uint8_t* sequence_maps;
+
+    /* ASCII fast path: whitespace runs, and per class the bytes of a SEQUENCE or of the body of a STRING */
+    Tfspan_t whitespace_span;
+    Tfspan_t* spans;
+
+    /* keywords, in a table indexed by a perfect hash of their text (see tf_keyword) */
+    Tfkeyword_t* keywords;
+    size_t keywords_mask, keyword_max_length;
+    uint32_t keywords_seed;
+
     int ownsinput;
     uint8_t* input;
     size_t inputlen, inputpos;
@@ -126,35 +181,54 @@ struct Tokenfactory
 
     struct Token token;
 
+    /* token texts; 'text_length' bytes of the next one are being assembled at the end of the first chunk */
+    Tftext_t* texts;
+    size_t text_length;
+
     int stop_parse;
 
     TF_TOKEN_CB on_token;
 };
 
+/* the part of a token that is kept in the AST */
+struct AstToken
+{
+    int line;
+    int32_t number;
+    double decimal;
+
+    uint8_t* text;
+};
+
 struct AstNode
 {
     int name;
+    uint32_t children_num, children_max;
 
-    struct Token token;
+    struct AstToken token;
 
     struct AstNode *left, *right, **children;
-    size_t children_num, children_max;
 
     void* cust_data;
     void (*on_release)(AstNode_t* node);
+
+    /* where the node, its text and its children array live; NULL if they are on the heap */
+    AstArena_t* arena;
 };
 
+/* a ring of lookahead tokens; the current one is tokens[first], tokens_max is always a power of two */
 struct Tokenbuffer
 {
     Tokenfactory_t* tf;
 
     struct Token* tokens;
-    size_t tokens_num, tokens_max;
+    size_t first, tokens_num, tokens_max;
 };
 
 TFFUNC void tokenclass_add(Tf_t* tf, const Tokenclass_t* classes_in, size_t count);
 TFFUNC void tf_whitespace_add(Tf_t* tf, const uint32_t* chars_in, size_t count);
 TFFUNC void tf_whitespace_common(Tf_t* tf);
+TFFUNC void tf_keywords_set(Tf_t* tf, const char* const* words, size_t count);
 
 TFFUNC void tf_clear_token(Token_t* token);
 TFFUNC void tf_copy_token(Token_t* token, const Token_t* src);
@@ -167,6 +241,8 @@ TFFUNC void tf_release_token(Token_t* token);
 TFFUNC void tf_stop_parse(Tf_t* tf);
 
 TFFUNC char* tf_load_file(const char *filename, size_t *size_out);
+TFFUNC int tf_source_open(Tfsource_t* source, const char* filename);
+TFFUNC void tf_source_close(Tfsource_t* source);
 
 TFFUNC Tf_t* tokenfactory();
 TFFUNC void tokenfactory_del(Tf_t** tf_p);
@@ -177,8 +253,11 @@ TFFUNC int tb_accept(Tokenbuffer_t* tbuf, int name);
 TFFUNC int tb_accept_sequence(Tokenbuffer_t* tbuf, int name, const char* text);
 TFFUNC Token_t* tb_check(Tokenbuffer_t* tbuf, int name);
 TFFUNC Token_t* tb_check_sequence(Tokenbuffer_t* tbuf, int name, const char* text);
+TFFUNC int tb_accept_keyword(Tokenbuffer_t* tbuf, int keyword);
+TFFUNC Token_t* tb_check_keyword(Tokenbuffer_t* tbuf, int keyword);
 TFFUNC Token_t* tb_current(Tokenbuffer_t* tbuf);
 TFFUNC void tb_drop(Tokenbuffer_t* tbuf);
+TFFUNC Token_t* tb_peek(Tokenbuffer_t* tbuf, size_t ahead);
 TFFUNC void tb_skip(Tokenbuffer_t *tbuf, int name);
 
 TFFUNC Tokenbuffer_t* tokenbuffer(Tokenfactory_t* tf);
@@ -186,6 +265,18 @@ TFFUNC void tokenbuffer_del(Tokenbuffer_t** tbuf_p);
 
 /******************************************************************************/
 
+TFFUNC AstArena_t* ast_arena();
+TFFUNC void ast_arena_release(AstArena_t** arena_p);
+TFFUNC void ast_arena_set_root(AstNode_t* root);
+TFFUNC AstNode_t* ast_arena_node(AstArena_t* arena, int name, Token_t* token);
+TFFUNC AstNode_t* ast_arena_node_2(AstArena_t* arena, int name, AstNode_t* left, AstNode_t* right);
+TFFUNC uint8_t* ast_arena_text(AstArena_t* arena, const uint8_t* text, size_t length);
+TFFUNC void ast_arena_locate(AstArena_t* arena, int line, int column);
+
+/* the line and column (from 0) where a node was parsed, and the root of its arena; nodes outside of an arena
+   only have the line of their token, and NULL is returned */
+TFFUNC AstNode_t* ast_location(const AstNode_t* node, int* line_out, int* column_out);
+
 TFFUNC AstNode_t* ast_node(int name, Token_t* token);
 TFFUNC AstNode_t* ast_node_2(int name, AstNode_t* left, AstNode_t* right);
 TFFUNC void ast_release_node(AstNode_t** node_p);
@@ -193,3 +284,5 @@ TFFUNC void ast_addchild(AstNode_t* node, AstNode_t* child);
 TFFUNC void ast_print(AstNode_t* node, int indent, const char** names, size_t num_names);
 TFFUNC int ast_serialize_node(AstNode_t* node, FILE *f);
 TFFUNC int ast_serialize(AstNode_t* node, const char* filename);
+TFFUNC AstNode_t* ast_deserialize_node(AstArena_t* arena, FILE *f);
+TFFUNC AstNode_t* ast_deserialize(const char* filename);
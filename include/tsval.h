@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 enum { TS_NULL, TS_BOOL, TS_FLOAT, TS_INT, TS_LIST, TS_NATIVE, TS_NATIVEFUNC, TS_OBJECT, /*TS_STR_CONST,*/ TS_STRING };
@@ -76,9 +77,13 @@ struct TS_Native
 
     uint32_t (*get_hash)(TS_Val val);
     TS_Val (*get_member)(TS_Val val, const char* name);
-    TS_Val (*invoke)(TS_Val val, TS_Val globals, TS_Val* arguments, size_t num_arguments);
+    TS_Val (*invoke)(TS_Val val, TS_Val globals, TS_Val me, TS_Val* arguments, size_t num_arguments);
+    int (*next)(TS_Val val, TS_Val* item_out);
     void (*on_destroy)(TS_Val val);
     void (*printvalue)(TS_Val val);
+
+    /* writes the state of the native to a heap snapshot; returns 0 on success */
+    int (*serialize)(TS_Val val, FILE* f);
 };
 
 struct TS_Object
@@ -121,6 +126,7 @@ void TS_set_entry(TS_Val val, TS_Val key, TS_Val value);
 
 /* operations */
 TS_Val TS_add(TS_Val left, TS_Val right);
+TS_Val TS_append(TS_Val left, TS_Val right);
 TS_Val TS_bin_or(TS_Val left, TS_Val right);
 TS_Val TS_divide(TS_Val left, TS_Val right);
 int TS_equals(TS_Val left, TS_Val right);
@@ -139,6 +145,7 @@ TS_ObjectMember* TS_find_member_2(TS_Val val, TS_Val key);
 TS_Val TS_get_member(TS_Val val, const char* name);
 int TS_set_member(TS_Val val, const char* name, TS_Val new_val);
 
+TS_Val TS_invoke(TS_Val function, TS_Val globals, TS_Val me, TS_Val* arguments, size_t num_arguments);
 TS_Val TS_native_function(TS_NativeFunction_t invoke);
 
 /* string */
@@ -0,0 +1,694 @@
+/*
+ *  Compiled script images
+ *
+ *  An image is a flat, pointer-free form of a parsed script: a pre-order array of fixed-size node records that refer
+ *  to each other by index, an array of child indices, an interned string table and a constant pool for numeric
+ *  literals. It is mapped read-only and the AST is built on top of the mapping: all nodes and child arrays live in a
+ *  single allocation and token texts point straight into the string table, so loading costs two allocations and
+ *  one pass over the node array, and the pages of the image are shared by every process running it.
+ *
+ *  Nodes stay mutable (ast_finalize and ast_specialize rewrite them in place), which is why the node array itself
+ *  can't be executed from the mapping. Lazy bodies are never written to an image.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define IMAGE_MAGIC     0x4d495354      /* "TSIM" */
+#define IMAGE_VERSION   2
+
+#define NO_INDEX        0xFFFFFFFF
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version, num_node_kinds;
+
+    uint32_t num_nodes, num_children, num_strings, num_constants, num_globals;
+    uint32_t strings_size;
+
+    /* byte offsets from the start of the image */
+    uint32_t nodes, children, string_offsets, strings, constants, globals;
+
+    /* string index of the source file name */
+    uint32_t file_name;
+}
+image_header_t;
+
+typedef struct
+{
+    int16_t name;
+    uint16_t children_num;
+    int32_t line;
+
+    /* node indices, NO_INDEX if absent */
+    uint32_t left, right;
+
+    /* index of the first entry in the child index array */
+    uint32_t children;
+
+    /* string and constant pool indices, NO_INDEX if absent */
+    uint32_t text, constant;
+}
+image_node_t;
+
+typedef struct
+{
+    double decimal;
+    int32_t number;
+}
+image_constant_t;
+
+/* the script node's cust_data; the properties come first so that it can be used as ast_properties_t */
+typedef struct
+{
+    ast_properties_t properties;
+
+    const uint8_t* mapping;
+    size_t size;
+
+    /* every node except the script node, followed by all child arrays */
+    AstNode_t* nodes;
+    size_t num_nodes;
+}
+image_t;
+
+/******************************************************************************/
+
+/* append-only byte pool that stores each distinct entry once */
+typedef struct
+{
+    uint8_t* data;
+    size_t size, capacity;
+
+    uint32_t* offsets;
+    size_t count;
+
+    uint32_t* slots;
+    size_t num_slots;
+}
+pool_t;
+
+static uint32_t hash_bytes(const void* bytes, size_t size)
+{
+    const uint8_t* p;
+    uint32_t hash;
+    size_t i;
+
+    p = (const uint8_t*) bytes;
+    hash = 2166136261u;
+
+    for (i = 0; i < size; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+
+    return hash;
+}
+
+static size_t pool_entry_size(const pool_t* pool, uint32_t index)
+{
+    return ((index + 1 < pool->count) ? pool->offsets[index + 1] : pool->size) - pool->offsets[index];
+}
+
+static void pool_rehash(pool_t* pool)
+{
+    size_t i, slot;
+
+    free(pool->slots);
+
+    pool->num_slots = (pool->num_slots == 0) ? 64 : pool->num_slots * 2;
+    pool->slots = (uint32_t*) malloc(pool->num_slots * sizeof(uint32_t));
+    memset(pool->slots, 0xFF, pool->num_slots * sizeof(uint32_t));
+
+    for (i = 0; i < pool->count; i++)
+    {
+        slot = hash_bytes(pool->data + pool->offsets[i], pool_entry_size(pool, i)) & (pool->num_slots - 1);
+
+        while (pool->slots[slot] != NO_INDEX)
+            slot = (slot + 1) & (pool->num_slots - 1);
+
+        pool->slots[slot] = i;
+    }
+}
+
+static uint32_t pool_intern(pool_t* pool, const void* bytes, size_t size)
+{
+    size_t slot;
+    uint32_t index;
+
+    if ((pool->count + 1) * 2 > pool->num_slots)
+        pool_rehash(pool);
+
+    slot = hash_bytes(bytes, size) & (pool->num_slots - 1);
+
+    while ((index = pool->slots[slot]) != NO_INDEX)
+    {
+        if (pool_entry_size(pool, index) == size && memcmp(pool->data + pool->offsets[index], bytes, size) == 0)
+            return index;
+
+        slot = (slot + 1) & (pool->num_slots - 1);
+    }
+
+    if (pool->size + size > pool->capacity)
+    {
+        while (pool->size + size > pool->capacity)
+            pool->capacity = (pool->capacity == 0) ? 4096 : pool->capacity * 2;
+
+        pool->data = (uint8_t*) realloc(pool->data, pool->capacity);
+    }
+
+    memcpy(pool->data + pool->size, bytes, size);
+
+    pool->offsets = (uint32_t*) realloc(pool->offsets, (pool->count + 1) * sizeof(uint32_t));
+    pool->offsets[pool->count] = pool->size;
+    pool->size += size;
+
+    pool->slots[slot] = pool->count;
+    return pool->count++;
+}
+
+static uint32_t pool_intern_string(pool_t* pool, const char* string)
+{
+    return pool_intern(pool, string, strlen(string) + 1);
+}
+
+static void pool_release(pool_t* pool)
+{
+    free(pool->data);
+    free(pool->offsets);
+    free(pool->slots);
+}
+
+typedef struct
+{
+    image_node_t* nodes;
+    size_t num_nodes, max_nodes;
+
+    uint32_t* children;
+    size_t num_children;
+
+    pool_t strings, constants;
+}
+image_writer_t;
+
+static uint32_t flatten(image_writer_t* w, AstNode_t* node)
+{
+    image_node_t record;
+    image_constant_t constant;
+    uint32_t index, first_child;
+    size_t i;
+
+    if (node == NULL)
+        return NO_INDEX;
+
+    if (w->num_nodes == w->max_nodes)
+    {
+        w->max_nodes = (w->max_nodes == 0) ? 256 : w->max_nodes * 2;
+        w->nodes = (image_node_t*) realloc(w->nodes, w->max_nodes * sizeof(image_node_t));
+    }
+
+    index = w->num_nodes++;
+
+    memset(&record, 0, sizeof(record));
+    record.name = node->name;
+    record.children_num = node->children_num;
+    record.line = node->token.line;
+    record.text = (node->token.text != NULL) ? pool_intern_string(&w->strings, (const char*) node->token.text) : NO_INDEX;
+    record.constant = NO_INDEX;
+
+    if (node->name == SN_INT || node->name == SN_REAL)
+    {
+        memset(&constant, 0, sizeof(constant));
+        constant.decimal = node->token.decimal;
+        constant.number = node->token.number;
+
+        record.constant = pool_intern(&w->constants, &constant, sizeof(constant));
+    }
+
+    /* reserve the child index slots first, the subtrees are appended after this node */
+    first_child = w->num_children;
+    w->num_children += node->children_num;
+    w->children = (uint32_t*) realloc(w->children, (w->num_children + 1) * sizeof(uint32_t));
+
+    record.children = first_child;
+    record.left = flatten(w, node->left);
+    record.right = flatten(w, node->right);
+
+    for (i = 0; i < node->children_num; i++)
+    {
+        /* not assigned directly: flatten() may move w->children */
+        uint32_t child = flatten(w, node->children[i]);
+        w->children[first_child + i] = child;
+    }
+
+    w->nodes[index] = record;
+    return index;
+}
+
+int image_write(AstNode_t* script, const char* filename)
+{
+    image_writer_t w;
+    image_header_t header;
+    ast_properties_t* properties;
+    uint32_t* globals;
+    size_t i;
+    FILE* f;
+    int rc;
+
+    memset(&w, 0, sizeof(w));
+    flatten(&w, script);
+
+    properties = (ast_properties_t*) script->cust_data;
+    globals = (uint32_t*) malloc((properties->num_globals + 1) * sizeof(uint32_t));
+
+    for (i = 0; i < properties->num_globals; i++)
+        globals[i] = pool_intern_string(&w.strings, properties->globals[i]);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = IMAGE_MAGIC;
+    header.version = IMAGE_VERSION;
+    header.num_node_kinds = SN_NUM_KINDS;
+    header.file_name = pool_intern_string(&w.strings, properties->file_name);
+
+    header.num_nodes = w.num_nodes;
+    header.num_children = w.num_children;
+    header.num_strings = w.strings.count;
+    header.num_constants = w.constants.count;
+    header.num_globals = properties->num_globals;
+    header.strings_size = w.strings.size;
+
+    /* the constant pool needs 8-byte alignment, everything else 4-byte */
+    header.nodes = sizeof(header);
+    header.constants = header.nodes + w.num_nodes * sizeof(image_node_t);
+    header.constants += (8 - header.constants % 8) % 8;
+    header.children = header.constants + w.constants.size;
+    header.globals = header.children + w.num_children * sizeof(uint32_t);
+    header.string_offsets = header.globals + properties->num_globals * sizeof(uint32_t);
+    header.strings = header.string_offsets + w.strings.count * sizeof(uint32_t);
+
+    rc = -1;
+    f = fopen(filename, "wb");
+
+    if (f != NULL)
+    {
+        static const uint8_t padding[8];
+
+        fwrite(&header, sizeof(header), 1, f);
+        fwrite(w.nodes, sizeof(image_node_t), w.num_nodes, f);
+        fwrite(padding, 1, header.constants - (header.nodes + w.num_nodes * sizeof(image_node_t)), f);
+        fwrite(w.constants.data, 1, w.constants.size, f);
+        fwrite(w.children, sizeof(uint32_t), w.num_children, f);
+        fwrite(globals, sizeof(uint32_t), properties->num_globals, f);
+        fwrite(w.strings.offsets, sizeof(uint32_t), w.strings.count, f);
+        fwrite(w.strings.data, 1, w.strings.size, f);
+
+        rc = ferror(f) ? -1 : 0;
+
+        if (fclose(f) != 0)
+            rc = -1;
+    }
+
+    free(globals);
+    free(w.nodes);
+    free(w.children);
+    pool_release(&w.strings);
+    pool_release(&w.constants);
+
+    return rc;
+}
+
+/******************************************************************************/
+
+static const uint8_t* map_file(const char* filename, size_t* size_out)
+{
+#ifdef _WIN32
+    return (const uint8_t*) tf_load_file(filename, size_out);
+#else
+    struct stat st;
+    void* mapping;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(image_header_t))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    *size_out = st.st_size;
+    return (const uint8_t*) mapping;
+#endif
+}
+
+static void unmap_file(const uint8_t* mapping, size_t size)
+{
+#ifdef _WIN32
+    free((void*) mapping);
+#else
+    munmap((void*) mapping, size);
+#endif
+}
+
+static int section_fits(size_t size, uint32_t offset, size_t count, size_t item_size)
+{
+    return offset <= size && count <= (size - offset) / item_size;
+}
+
+static int check_header(const image_header_t* header, size_t size)
+{
+    return header->magic == IMAGE_MAGIC && header->version == IMAGE_VERSION && header->num_node_kinds == SN_NUM_KINDS
+            && header->num_nodes > 0 && header->strings_size > 0
+            && header->nodes % 4 == 0 && header->constants % 8 == 0
+            && header->children % 4 == 0 && header->globals % 4 == 0 && header->string_offsets % 4 == 0
+            && section_fits(size, header->nodes, header->num_nodes, sizeof(image_node_t))
+            && section_fits(size, header->constants, header->num_constants, sizeof(image_constant_t))
+            && section_fits(size, header->children, header->num_children, sizeof(uint32_t))
+            && section_fits(size, header->globals, header->num_globals, sizeof(uint32_t))
+            && section_fits(size, header->string_offsets, header->num_strings, sizeof(uint32_t))
+            && section_fits(size, header->strings, header->strings_size, 1)
+            && header->file_name < header->num_strings;
+}
+
+static const char* image_string(const image_header_t* header, const uint8_t* mapping, uint32_t index)
+{
+    uint32_t offset;
+
+    if (index >= header->num_strings)
+        return NULL;
+
+    offset = ((const uint32_t*) (mapping + header->string_offsets))[index];
+
+    /* the string table ends with a NUL (checked on load), so every string in it is terminated */
+    return (offset < header->strings_size) ? (const char*) mapping + header->strings + offset : NULL;
+}
+
+static void image_on_release(AstNode_t* node)
+{
+    image_t* image;
+    size_t i;
+
+    image = (image_t*) node->cust_data;
+
+    /* nodes don't own their memory, so they are not released recursively; only their hooks run */
+    for (i = 1; i < image->num_nodes; i++)
+        if (image->nodes[i].on_release != NULL)
+            image->nodes[i].on_release(&image->nodes[i]);
+
+    node->left = NULL;
+    node->right = NULL;
+    node->children = NULL;
+    node->children_num = 0;
+
+    free(image->properties.globals);
+    free(image->properties.known_globals);
+    free(image->nodes);
+    unmap_file(image->mapping, image->size);
+    free(image);
+}
+
+/* the operands each node kind has coming out of the parser; an image is only loaded if all of its nodes have
+   them, because the interpreter, type inference and the compilers follow them without checking */
+enum { OPERAND_NONE, OPERAND_OPTIONAL, OPERAND_REQUIRED };
+
+typedef struct
+{
+    uint8_t left, right;
+    uint16_t min_children, max_children;
+}
+image_shape_t;
+
+#define ANY_CHILDREN    0xFFFF
+
+static const image_shape_t node_shapes[SN_ADD_CONST_STORE] = {
+    /* SN_ADD */        {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+    /* SN_APPEND */     {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+    /* SN_ASSIGN */     {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+    /* SN_BIN_AND */    {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+    /* SN_BIN_OR */     {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+    /* SN_BLOCK */      {OPERAND_NONE, OPERAND_NONE, 1, ANY_CHILDREN},
+    /* SN_BREAK */      {OPERAND_NONE, OPERAND_NONE, 0, 0},
+    /* SN_CALL */       {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+    /* SN_DIVIDE */     {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+    /* SN_EQUALS */     {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+    /* SN_FALSE */      {OPERAND_NONE, OPERAND_NONE, 0, 0},
+    /* SN_FUNCTION */   {OPERAND_NONE, OPERAND_OPTIONAL, 1, 1},
+    /* SN_IDENT */      {OPERAND_NONE, OPERAND_NONE, 0, 0},
+    /* SN_IF */         {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 1},
+    /* SN_INDEX */      {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+    /* SN_INT */        {OPERAND_NONE, OPERAND_NONE, 0, 0},
+    /* SN_ITERATE */    {OPERAND_REQUIRED, OPERAND_REQUIRED, 1, 1},
+    /* SN_LAZY */       {OPERAND_NONE, OPERAND_NONE, 0, 0},
+    /* SN_LIST */       {OPERAND_NONE, OPERAND_NONE, 0, ANY_CHILDREN},
+    /* SN_MEMBER */     {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+    /* SN_MULTIPLY */   {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+    /* SN_NOT */        {OPERAND_REQUIRED, OPERAND_NONE, 0, 0},
+    /* SN_NOT_EQUALS */ {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+    /* SN_NULL */       {OPERAND_NONE, OPERAND_NONE, 0, 0},
+    /* SN_OBJECT */     {OPERAND_NONE, OPERAND_NONE, 0, ANY_CHILDREN},
+    /* SN_REAL */       {OPERAND_NONE, OPERAND_NONE, 0, 0},
+    /* SN_RETURN */     {OPERAND_OPTIONAL, OPERAND_NONE, 0, 0},
+    /* SN_SCRIPT */     {OPERAND_NONE, OPERAND_NONE, 0, ANY_CHILDREN},
+    /* SN_STRING */     {OPERAND_NONE, OPERAND_NONE, 0, 0},
+    /* SN_SUBTRACT */   {OPERAND_OPTIONAL, OPERAND_REQUIRED, 0, 0},
+    /* SN_TRUE */       {OPERAND_NONE, OPERAND_NONE, 0, 0},
+    /* SN_WHILE */      {OPERAND_REQUIRED, OPERAND_REQUIRED, 0, 0},
+};
+
+static int has_operand(int shape, const AstNode_t* operand)
+{
+    return (shape == OPERAND_REQUIRED) ? (operand != NULL) : (shape == OPERAND_NONE) ? (operand == NULL) : 1;
+}
+
+static int is_name(const AstNode_t* node)
+{
+    return node != NULL && node->name == SN_IDENT;
+}
+
+/* whether a linked node has the operands of its kind (see node_shapes) */
+static int check_shape(const AstNode_t* node)
+{
+    const image_shape_t* shape;
+    size_t i;
+
+    shape = &node_shapes[node->name];
+
+    if (!has_operand(shape->left, node->left) || !has_operand(shape->right, node->right)
+            || node->children_num < shape->min_children || node->children_num > shape->max_children)
+        return 0;
+
+    for (i = 0; i < node->children_num; i++)
+        if (node->children[i] == NULL)
+            return 0;
+
+    switch (node->name)
+    {
+        case SN_IDENT:
+        case SN_STRING:
+            return node->token.text != NULL;
+
+        case SN_CALL:
+            return node->right->name == SN_LIST;
+
+        case SN_FUNCTION:
+            if (node->right != NULL)
+            {
+                if (node->right->name != SN_LIST)
+                    return 0;
+
+                for (i = 0; i < node->right->children_num; i++)
+                    if (!is_name(node->right->children[i]))
+                        return 0;
+            }
+
+            return 1;
+
+        case SN_ITERATE:
+            return is_name(node->left);
+
+        case SN_MEMBER:
+            return is_name(node->right);
+
+        case SN_OBJECT:
+            for (i = 0; i < node->children_num; i++)
+                if (node->children[i]->name != SN_ASSIGN || !is_name(node->children[i]->left))
+                    return 0;
+
+            return 1;
+
+        case SN_SCRIPT:
+            for (i = 0; i < node->children_num; i++)
+                if (node->children[i]->name != SN_BLOCK)
+                    return 0;
+
+            return 1;
+    }
+
+    return 1;
+}
+
+/* points 'node' at its record; child pointers are set by the caller. 'linked' flags nodes that already have a
+   parent, so that a damaged image can't turn the tree into a graph */
+static int link_node(AstNode_t* nodes, uint8_t* linked, uint32_t parent, uint32_t child, size_t num_nodes,
+        AstNode_t** child_out)
+{
+    if (child == NO_INDEX)
+    {
+        *child_out = NULL;
+        return 0;
+    }
+
+    if (child <= parent || child >= num_nodes || linked[child])
+        return -1;
+
+    linked[child] = 1;
+    *child_out = &nodes[child];
+    return 0;
+}
+
+AstNode_t* image_load(const char* filename)
+{
+    const uint8_t* mapping;
+    const image_header_t* header;
+    const image_node_t* records;
+    const image_constant_t* constants;
+    const uint32_t *children, *globals;
+    AstNode_t *nodes, **child_arrays, *script;
+    image_t* image;
+    uint8_t* linked;
+    size_t size;
+    uint32_t i, j;
+
+    mapping = map_file(filename, &size);
+
+    if (mapping == NULL)
+        return NULL;
+
+    header = (const image_header_t*) mapping;
+
+    if (size < sizeof(image_header_t) || !check_header(header, size) || mapping[header->strings + header->strings_size - 1] != 0)
+    {
+        unmap_file(mapping, size);
+        return NULL;
+    }
+
+    records = (const image_node_t*) (mapping + header->nodes);
+    constants = (const image_constant_t*) (mapping + header->constants);
+    children = (const uint32_t*) (mapping + header->children);
+    globals = (const uint32_t*) (mapping + header->globals);
+
+    nodes = (AstNode_t*) malloc(header->num_nodes * sizeof(AstNode_t) + header->num_children * sizeof(AstNode_t*));
+    child_arrays = (AstNode_t**) (nodes + header->num_nodes);
+    linked = (uint8_t*) calloc(header->num_nodes, 1);
+
+    for (i = 0; i < header->num_nodes; i++)
+    {
+        const image_node_t* record;
+        AstNode_t* node;
+
+        record = &records[i];
+        node = &nodes[i];
+
+        /* only what the parser produces */
+        if (record->name < 0 || record->name >= SN_ADD_CONST_STORE || record->name == SN_LAZY
+                || (i == 0) != (record->name == SN_SCRIPT) || (i == 0 && record->text != NO_INDEX)
+                || record->children > header->num_children || record->children_num > header->num_children - record->children)
+            goto error;
+
+        node->name = record->name;
+        node->token.line = record->line;
+        node->token.number = 0;
+        node->token.decimal = 0.0;
+        node->token.text = NULL;
+
+        if (record->text != NO_INDEX && (node->token.text = (uint8_t*) image_string(header, mapping, record->text)) == NULL)
+            goto error;
+
+        if (record->constant != NO_INDEX)
+        {
+            if (record->constant >= header->num_constants)
+                goto error;
+
+            node->token.number = constants[record->constant].number;
+            node->token.decimal = constants[record->constant].decimal;
+        }
+
+        if (link_node(nodes, linked, i, record->left, header->num_nodes, &node->left) != 0
+                || link_node(nodes, linked, i, record->right, header->num_nodes, &node->right) != 0)
+            goto error;
+
+        node->children = (record->children_num > 0) ? &child_arrays[record->children] : NULL;
+        node->children_num = record->children_num;
+        node->children_max = record->children_num;
+
+        for (j = 0; j < record->children_num; j++)
+            if (link_node(nodes, linked, i, children[record->children + j], header->num_nodes, &node->children[j]) != 0)
+                goto error;
+
+        node->cust_data = NULL;
+        node->on_release = NULL;
+        node->arena = NULL;
+    }
+
+    /* children come after their parent, so this can only be checked once every node is linked */
+    for (i = 0; i < header->num_nodes; i++)
+        if (!check_shape(&nodes[i]))
+            goto error;
+
+    free(linked);
+
+    image = (image_t*) malloc(sizeof(image_t));
+    image->mapping = mapping;
+    image->size = size;
+    image->nodes = nodes;
+    image->num_nodes = header->num_nodes;
+
+    image->properties.num_globals = header->num_globals;
+    image->properties.globals = (char**) malloc((header->num_globals + 1) * sizeof(char*));
+    image->properties.known_globals = NULL;
+    image->properties.num_known_globals = 0;
+    image->properties.file_name = (char*) image_string(header, mapping, header->file_name);
+
+    for (i = 0; i < header->num_globals; i++)
+        if ((image->properties.globals[i] = (char*) image_string(header, mapping, globals[i])) == NULL)
+        {
+            free(image->properties.globals);
+            free(image);
+            goto error_linked;
+        }
+
+    /* the script node is the only one that is allocated on its own, because ast_release_node frees it */
+    script = (AstNode_t*) malloc(sizeof(AstNode_t));
+    *script = nodes[0];
+    script->cust_data = image;
+    script->on_release = image_on_release;
+
+    return script;
+
+error:
+    free(linked);
+
+error_linked:
+    free(nodes);
+    unmap_file(mapping, size);
+    return NULL;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "parse.h"
+
+/* writes a freshly parsed (not finalized, not lazy) script as a compiled image; returns 0 on success */
+int image_write(AstNode_t* script, const char* filename);
+
+/* maps a compiled image and builds its AST; returns NULL if 'filename' is not a valid image of this build.
+   the image stays mapped until the script node is released */
+AstNode_t* image_load(const char* filename);
@@ -0,0 +1,444 @@
+/*
+ *  Type inference for script locals
+ *
+ *  A local is given a static type if every store to it (assignments and 'iterate') produces that type and every
+ *  read of it is preceded by a store on all paths through the function; a read that may happen before the first
+ *  store falls through to globals at run time, so such locals stay TY_ANY. Types are solved as a fixpoint over
+ *  the stores, starting optimistically from TY_UNKNOWN.
+ *
+ *  The analysis assumes that natives do not write to script locals and that names assigned by a function do not
+ *  collide with natives registered in globals. Names the script declares global, and names that were already
+ *  global when it was prepared (ast_properties_t::known_globals), are never locals. A name that becomes global
+ *  while the script runs (set by a module it loads) is not known, though, and a store to it goes to that global,
+ *  which other code can change to any type. The types are therefore what the operands will be in the common case,
+ *  and everything that uses them (the typed operators and the JIT) still checks the tags.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "infer.h"
+
+static int is_global_name(AstNode_t* script, const char* name)
+{
+    ast_properties_t* properties;
+    size_t i;
+
+    properties = (ast_properties_t*) script->cust_data;
+
+    for (i = 0; i < properties->num_globals; i++)
+        if (strcmp(properties->globals[i], name) == 0)
+            return 1;
+
+    for (i = 0; i < properties->num_known_globals; i++)
+        if (strcmp(properties->known_globals[i], name) == 0)
+            return 1;
+
+    return 0;
+}
+
+static int is_store(AstNode_t* node)
+{
+    return (node->name == SN_ASSIGN || node->name == SN_ADD_CONST_STORE || node->name == SN_ITERATE)
+            && node->left != NULL && node->left->name == SN_IDENT;
+}
+
+unsigned infer_count_stores(AstNode_t* node, const char* name)
+{
+    unsigned count;
+    size_t i;
+
+    if (node == NULL)
+        return 0;
+
+    count = 0;
+
+    if (node->name == SN_OBJECT)
+    {
+        for (i = 0; i < node->children_num; i++)
+            count += infer_count_stores(node->children[i]->right, name);
+
+        return count;
+    }
+
+    if (is_store(node) && strcmp((const char*) node->left->token.text, name) == 0)
+        count++;
+
+    /* an unparsed function body might store to it */
+    if (node->name == SN_LAZY && strstr((const char*) node->token.text, name) != NULL)
+        count++;
+
+    count += infer_count_stores(node->left, name);
+    count += infer_count_stores(node->right, name);
+
+    for (i = 0; i < node->children_num; i++)
+        count += infer_count_stores(node->children[i], name);
+
+    return count;
+}
+
+int infer_is_builtin_range(AstNode_t* script, AstNode_t* expr)
+{
+    return (expr->name == SN_CALL || expr->name == SN_CALL_NAME) && expr->left->name == SN_IDENT
+            && strcmp((const char*) expr->left->token.text, "range") == 0
+            && infer_count_stores(script, "range") == 0;
+}
+
+static int find_local(const infer_result_t* result, const char* name)
+{
+    size_t i;
+
+    for (i = 0; i < result->num_locals; i++)
+        if (strcmp(result->locals[i].name, name) == 0)
+            return (int) i;
+
+    return -1;
+}
+
+static void add_local(infer_result_t* result, const char* name, int type)
+{
+    if (find_local(result, name) >= 0)
+        return;
+
+    result->locals = (infer_local_t*) realloc(result->locals, (result->num_locals + 1) * sizeof(infer_local_t));
+    result->locals[result->num_locals].name = name;
+    result->locals[result->num_locals].type = type;
+    result->num_locals++;
+}
+
+static void collect_locals(AstNode_t* script, infer_result_t* result, AstNode_t* node)
+{
+    size_t i;
+
+    if (node == NULL || node->name == SN_FUNCTION)
+        return;
+
+    if (node->name == SN_OBJECT)
+    {
+        for (i = 0; i < node->children_num; i++)
+            collect_locals(script, result, node->children[i]->right);
+
+        return;
+    }
+
+    /* 'iterate' always binds a local, assignments only if the name is not declared global */
+    if (node->name == SN_ITERATE || (is_store(node) && !is_global_name(script, (const char*) node->left->token.text)))
+        add_local(result, (const char*) node->left->token.text, TY_UNKNOWN);
+
+    collect_locals(script, result, node->left);
+    collect_locals(script, result, node->right);
+
+    for (i = 0; i < node->children_num; i++)
+        collect_locals(script, result, node->children[i]);
+}
+
+static int join(int a, int b)
+{
+    if (a == TY_UNKNOWN)
+        return b;
+    else if (b == TY_UNKNOWN || a == b)
+        return a;
+
+    return TY_ANY;
+}
+
+/* result type of + - * on numbers */
+static int arithmetic(int left, int right)
+{
+    if (left == TY_ANY || right == TY_ANY)
+        return TY_ANY;
+    else if (left == TY_UNKNOWN || right == TY_UNKNOWN)
+        return TY_UNKNOWN;
+    else if (left == TY_INT && right == TY_INT)
+        return TY_INT;
+
+    return TY_FLOAT;
+}
+
+int infer_local_type(const infer_result_t* result, const char* name)
+{
+    int index;
+
+    index = find_local(result, name);
+
+    return (index >= 0) ? result->locals[index].type : TY_ANY;
+}
+
+int infer_expression_type(const infer_result_t* result, AstNode_t* expr)
+{
+    int left, right;
+
+    switch (expr->name)
+    {
+        case SN_INT:
+            return TY_INT;
+
+        case SN_REAL:
+            return TY_FLOAT;
+
+        case SN_IDENT:
+            return infer_local_type(result, (const char*) expr->token.text);
+
+        case SN_ASSIGN:
+            return infer_expression_type(result, expr->right);
+
+        case SN_ADD_CONST_STORE:
+            return arithmetic(infer_local_type(result, (const char*) expr->left->token.text), TY_INT);
+
+        case SN_LIST:
+            return (expr->children_num == 1) ? infer_expression_type(result, expr->children[0]) : TY_ANY;
+
+        case SN_SUBTRACT:
+            if (expr->left == NULL)
+                return infer_expression_type(result, expr->right);
+            /* fall through */
+
+        case SN_ADD:
+        case SN_MULTIPLY:
+            left = infer_expression_type(result, expr->left);
+            right = infer_expression_type(result, expr->right);
+            return arithmetic(left, right);
+
+        case SN_DIVIDE:
+            left = infer_expression_type(result, expr->left);
+            right = infer_expression_type(result, expr->right);
+            return (arithmetic(left, right) == TY_INT) ? TY_FLOAT : arithmetic(left, right);
+
+        case SN_ADD_INT:
+        case SN_MULTIPLY_INT:
+        case SN_SUBTRACT_INT:
+            return TY_INT;
+
+        case SN_ADD_FLOAT:
+        case SN_DIVIDE_FLOAT:
+        case SN_MULTIPLY_FLOAT:
+        case SN_SUBTRACT_FLOAT:
+            return TY_FLOAT;
+    }
+
+    return TY_ANY;
+}
+
+/* one round over all stores; returns non-zero if any local type changed */
+static int infer_stores(AstNode_t* script, infer_result_t* result, AstNode_t* node)
+{
+    int changed, index;
+    size_t i;
+
+    if (node == NULL || node->name == SN_FUNCTION)
+        return 0;
+
+    if (node->name == SN_OBJECT)
+    {
+        changed = 0;
+
+        for (i = 0; i < node->children_num; i++)
+            changed |= infer_stores(script, result, node->children[i]->right);
+
+        return changed;
+    }
+
+    changed = 0;
+
+    if (is_store(node) && (index = find_local(result, (const char*) node->left->token.text)) >= 0)
+    {
+        int type;
+
+        if (node->name == SN_ITERATE)
+            type = infer_is_builtin_range(script, node->right) ? TY_INT : TY_ANY;
+        else
+            type = infer_expression_type(result, node);
+
+        type = join(result->locals[index].type, type);
+
+        if (type != result->locals[index].type)
+        {
+            result->locals[index].type = type;
+            changed = 1;
+        }
+    }
+
+    changed |= infer_stores(script, result, node->left);
+    changed |= infer_stores(script, result, node->right);
+
+    for (i = 0; i < node->children_num; i++)
+        changed |= infer_stores(script, result, node->children[i]);
+
+    return changed;
+}
+
+static void assign(infer_result_t* result, uint8_t* assigned, AstNode_t* ident)
+{
+    int index;
+
+    index = find_local(result, (const char*) ident->token.text);
+
+    if (index >= 0)
+        assigned[index] = 1;
+}
+
+/* walks the statements in evaluation order, tracking which locals are definitely assigned;
+   locals read before that are demoted to TY_ANY. returns non-zero if any local was demoted */
+static int check_reads(infer_result_t* result, uint8_t* assigned, AstNode_t* node)
+{
+    uint8_t *branch, *other;
+    int demoted, index;
+    size_t i, size;
+
+    if (node == NULL || node->name == SN_FUNCTION)
+        return 0;
+
+    demoted = 0;
+    size = result->num_locals + 1;
+
+    switch (node->name)
+    {
+        case SN_IDENT:
+            index = find_local(result, (const char*) node->token.text);
+
+            if (index >= 0 && !assigned[index] && result->locals[index].type != TY_ANY)
+            {
+                result->locals[index].type = TY_ANY;
+                demoted = 1;
+            }
+
+            break;
+
+        case SN_ASSIGN:
+        case SN_MEMBER_STORE:
+            demoted |= check_reads(result, assigned, node->right);
+
+            if (node->left->name == SN_IDENT)
+                assign(result, assigned, node->left);
+            else
+            {
+                demoted |= check_reads(result, assigned, node->left->left);
+
+                if (node->left->name == SN_INDEX)
+                    demoted |= check_reads(result, assigned, node->left->right);
+            }
+
+            break;
+
+        case SN_ADD_CONST_STORE:
+            demoted |= check_reads(result, assigned, node->right);
+            assign(result, assigned, node->left);
+            break;
+
+        case SN_MEMBER:
+            demoted |= check_reads(result, assigned, node->left);
+            break;
+
+        case SN_OBJECT:
+            for (i = 0; i < node->children_num; i++)
+                demoted |= check_reads(result, assigned, node->children[i]->right);
+
+            break;
+
+        case SN_SUBTRACT:
+            demoted |= check_reads(result, assigned, node->right);
+            demoted |= check_reads(result, assigned, node->left);
+            break;
+
+        case SN_IF:
+        case SN_IF_EQUALS:
+            demoted |= check_reads(result, assigned, node->left);
+
+            branch = (uint8_t*) malloc(size);
+            memcpy(branch, assigned, size);
+            demoted |= check_reads(result, branch, node->right);
+
+            if (node->children_num > 0)
+            {
+                other = (uint8_t*) malloc(size);
+                memcpy(other, assigned, size);
+                demoted |= check_reads(result, other, node->children[0]);
+
+                /* assigned after the 'if' only if assigned in both branches */
+                for (i = 0; i < result->num_locals; i++)
+                    assigned[i] = branch[i] && other[i];
+
+                free(other);
+            }
+
+            free(branch);
+            break;
+
+        case SN_WHILE:
+            demoted |= check_reads(result, assigned, node->left);
+
+            branch = (uint8_t*) malloc(size);
+            memcpy(branch, assigned, size);
+            demoted |= check_reads(result, branch, node->right);
+            free(branch);
+            break;
+
+        case SN_ITERATE:
+            demoted |= check_reads(result, assigned, node->right);
+
+            branch = (uint8_t*) malloc(size);
+            memcpy(branch, assigned, size);
+            assign(result, branch, node->left);
+            demoted |= check_reads(result, branch, node->children[0]);
+            free(branch);
+            break;
+
+        default:
+            demoted |= check_reads(result, assigned, node->left);
+            demoted |= check_reads(result, assigned, node->right);
+
+            for (i = 0; i < node->children_num; i++)
+                demoted |= check_reads(result, assigned, node->children[i]);
+    }
+
+    return demoted;
+}
+
+void infer_types(AstNode_t* script, AstNode_t* func, infer_result_t* result)
+{
+    AstNode_t* body;
+    uint8_t* assigned;
+    size_t i;
+
+    result->locals = NULL;
+    result->num_locals = 0;
+
+    /* arguments and 'me' are bound by the caller */
+    if (func != NULL && func->right != NULL)
+        for (i = 0; i < func->right->children_num; i++)
+            add_local(result, (const char*) func->right->children[i]->token.text, TY_ANY);
+
+    if (func != NULL)
+        add_local(result, "me", TY_ANY);
+
+    body = (func != NULL) ? func->children[0] : script;
+    collect_locals(script, result, body);
+
+    assigned = (uint8_t*) malloc(result->num_locals + 1);
+
+    do
+    {
+        while (infer_stores(script, result, body))
+            ;
+
+        /* arguments and 'me' start out as TY_ANY, so they need no tracking */
+        memset(assigned, 0, result->num_locals + 1);
+    }
+    while (check_reads(result, assigned, body));
+
+    free(assigned);
+
+    /* never stored to (or only from each other) */
+    for (i = 0; i < result->num_locals; i++)
+        if (result->locals[i].type == TY_UNKNOWN)
+            result->locals[i].type = TY_ANY;
+}
+
+void infer_release(infer_result_t* result)
+{
+    free(result->locals);
+
+    result->locals = NULL;
+    result->num_locals = 0;
+}
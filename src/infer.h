@@ -0,0 +1,41 @@
+#pragma once
+
+#include "parse.h"
+
+/* static types; TY_UNKNOWN is "no value seen yet", TY_ANY is "not monomorphic" */
+enum {
+    TY_UNKNOWN,
+    TY_INT,
+    TY_FLOAT,
+    TY_ANY
+};
+
+typedef struct
+{
+    const char* name;
+    int type;
+}
+infer_local_t;
+
+typedef struct
+{
+    infer_local_t* locals;
+    size_t num_locals;
+}
+infer_result_t;
+
+/* infers the types of the locals of 'func' (an SN_FUNCTION node), or of the top-level code if 'func' is NULL.
+   works on the raw as well as on the finalized AST; 'script' must be the SN_SCRIPT root */
+void infer_types(AstNode_t* script, AstNode_t* func, infer_result_t* result);
+void infer_release(infer_result_t* result);
+
+/* TY_ANY for names that are not locals */
+int infer_local_type(const infer_result_t* result, const char* name);
+int infer_expression_type(const infer_result_t* result, AstNode_t* expr);
+
+/* counts stores to 'name' anywhere below 'node' (an unparsed function body counts if it mentions the name); object
+   literal members are not variables */
+unsigned infer_count_stores(AstNode_t* node, const char* name);
+
+/* 'range(...)' call with 'range' never reassigned by the script: iterating it yields ints */
+int infer_is_builtin_range(AstNode_t* script, AstNode_t* expr);
@@ -0,0 +1,767 @@
+#include "jit.h"
+#include "parse.h"
+
+#include <stddef.h>
+#include <tsval.h>
+
+#ifdef TS_JIT_AVAILABLE
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Baseline template JIT for x86-64 (System V ABI).
+ *
+ * A statement is compiled by stitching fixed machine code templates: blocks, 'if' and 'while' become
+ * straight-line code with real jumps, and int arithmetic on local variables is computed inline; everything
+ * else is a call back into the interpreter (jit_helpers_t). The generated function has the signature
+ * int (*)(void* context) and keeps the context in rbx.
+ *
+ * Int locals are accessed in place through their member slot. The slot indices are resolved on entry into a
+ * stack buffer (r12). Every access is behind a type guard; a failed guard (also one on a local that did not
+ * exist yet) is a side exit that runs the statement in the interpreter and re-resolves the slots before
+ * continuing. Inline code is emitted for:
+ *   - typed operators (SN_ADD_INT etc., proven by type inference) on int literals and locals, in stores to a
+ *     local and in conditions
+ *   - with a live context as type feedback (hot loops, see jit_compile): the untyped operators +, -, * and
+ *     ==, != on locals observed as ints, in the same places, and 'x = x + <int>'
+ *
+ * A loop trace that would get no inline code at all is not compiled, so that it does not replace the
+ * interpreter with a sequence of calls back into it.
+ *
+ * There are no templates for the generic operations: member access, calls, strings, floats and operators on
+ * values that are not known to be ints all go through helpers->exec/test, one call per statement, and run at
+ * interpreter speed. Only int-heavy code gains (about 2x over --no-jit on an int while loop); a loop of member
+ * stores and string appends gains next to nothing, far from what a template JIT that inlines TS_add,
+ * TS_get_member and calls would give.
+ */
+
+int jit_perf_map = 0;
+
+#ifdef TS_JIT_AVAILABLE
+
+enum { JIT_JMP, JIT_JZ, JIT_JNZ, JIT_JS };
+
+typedef struct
+{
+    size_t offset;
+    size_t label;
+}
+jit_fixup_t;
+
+struct jit_code
+{
+    void* memory;
+    size_t size;
+
+    int (*entry)(void* context);
+
+    const jit_helpers_t* helpers;
+
+    /* variables with specialized slots */
+    AstNode_t** vars;
+    size_t num_vars, max_vars;
+};
+
+typedef struct
+{
+    const jit_helpers_t* helpers;
+    void* context;
+    jit_code_t* target;
+
+    uint8_t* code;
+    size_t length, capacity;
+
+    size_t* labels;
+    size_t num_labels, max_labels;
+
+    jit_fixup_t* fixups;
+    size_t num_fixups, max_fixups;
+
+    /* statements and conditions compiled to inline code */
+    size_t num_inline;
+}
+jit_emitter_t;
+
+static void emit_bytes(jit_emitter_t* e, const uint8_t* bytes, size_t count)
+{
+    if (e->length + count > e->capacity)
+    {
+        while (e->length + count > e->capacity)
+            e->capacity = (e->capacity == 0) ? 256 : (e->capacity * 2);
+
+        e->code = (uint8_t*) realloc(e->code, e->capacity);
+    }
+
+    memcpy(e->code + e->length, bytes, count);
+    e->length += count;
+}
+
+static void emit_imm32(jit_emitter_t* e, int32_t value)
+{
+    emit_bytes(e, (const uint8_t*) &value, 4);
+}
+
+static void emit_imm64(jit_emitter_t* e, const void* value)
+{
+    uint64_t imm;
+
+    imm = (uint64_t) (uintptr_t) value;
+    emit_bytes(e, (const uint8_t*) &imm, 8);
+}
+
+static size_t new_label(jit_emitter_t* e)
+{
+    if (e->num_labels + 1 > e->max_labels)
+    {
+        e->max_labels = (e->max_labels == 0) ? 16 : (e->max_labels * 2);
+        e->labels = (size_t*) realloc(e->labels, e->max_labels * sizeof(size_t));
+    }
+
+    e->labels[e->num_labels] = (size_t) -1;
+    return e->num_labels++;
+}
+
+static void bind_label(jit_emitter_t* e, size_t label)
+{
+    e->labels[label] = e->length;
+}
+
+/* call helper(node, context) or helper(context) if node is NULL; result in eax */
+static void emit_call(jit_emitter_t* e, const void* helper, AstNode_t* node)
+{
+    static const uint8_t mov_rdi_imm64[] = {0x48, 0xBF};
+    static const uint8_t mov_rsi_rbx[] = {0x48, 0x89, 0xDE};
+    static const uint8_t mov_rdi_rbx[] = {0x48, 0x89, 0xDF};
+    static const uint8_t mov_rax_imm64[] = {0x48, 0xB8};
+    static const uint8_t call_rax[] = {0xFF, 0xD0};
+
+    if (node != NULL)
+    {
+        emit_bytes(e, mov_rdi_imm64, sizeof(mov_rdi_imm64));
+        emit_imm64(e, node);
+        emit_bytes(e, mov_rsi_rbx, sizeof(mov_rsi_rbx));
+    }
+    else
+        emit_bytes(e, mov_rdi_rbx, sizeof(mov_rdi_rbx));
+
+    emit_bytes(e, mov_rax_imm64, sizeof(mov_rax_imm64));
+    emit_imm64(e, helper);
+    emit_bytes(e, call_rax, sizeof(call_rax));
+}
+
+static void emit_test_eax(jit_emitter_t* e)
+{
+    static const uint8_t test_eax_eax[] = {0x85, 0xC0};
+
+    emit_bytes(e, test_eax_eax, sizeof(test_eax_eax));
+}
+
+static void emit_jump(jit_emitter_t* e, int type, size_t label)
+{
+    static const uint8_t jmp[] = {0xE9};
+    static const uint8_t jz[] = {0x0F, 0x84};
+    static const uint8_t jnz[] = {0x0F, 0x85};
+    static const uint8_t js[] = {0x0F, 0x88};
+
+    if (type == JIT_JMP)
+        emit_bytes(e, jmp, sizeof(jmp));
+    else if (type == JIT_JZ)
+        emit_bytes(e, jz, sizeof(jz));
+    else if (type == JIT_JNZ)
+        emit_bytes(e, jnz, sizeof(jnz));
+    else
+        emit_bytes(e, js, sizeof(js));
+
+    if (e->num_fixups + 1 > e->max_fixups)
+    {
+        e->max_fixups = (e->max_fixups == 0) ? 16 : (e->max_fixups * 2);
+        e->fixups = (jit_fixup_t*) realloc(e->fixups, e->max_fixups * sizeof(jit_fixup_t));
+    }
+
+    e->fixups[e->num_fixups].offset = e->length;
+    e->fixups[e->num_fixups].label = label;
+    e->num_fixups++;
+
+    emit_imm32(e, 0);
+}
+
+static void jit_resolve_slots(jit_code_t* code, void* context, intptr_t* slots)
+{
+    size_t i;
+
+    for (i = 0; i < code->num_vars; i++)
+        slots[i] = code->helpers->find_local(code->vars[i], context);
+}
+
+/* refresh the slot buffer after a side exit (the interpreter may have created new locals) */
+static void emit_resolve(jit_emitter_t* e)
+{
+    static const uint8_t mov_rdi_imm64[] = {0x48, 0xBF};
+    static const uint8_t mov_rsi_rbx[] = {0x48, 0x89, 0xDE};
+    static const uint8_t mov_rdx_r12[] = {0x4C, 0x89, 0xE2};
+    static const uint8_t mov_rax_imm64[] = {0x48, 0xB8};
+    static const uint8_t call_rax[] = {0xFF, 0xD0};
+
+    emit_bytes(e, mov_rdi_imm64, sizeof(mov_rdi_imm64));
+    emit_imm64(e, e->target);
+    emit_bytes(e, mov_rsi_rbx, sizeof(mov_rsi_rbx));
+    emit_bytes(e, mov_rdx_r12, sizeof(mov_rdx_r12));
+    emit_bytes(e, mov_rax_imm64, sizeof(mov_rax_imm64));
+    emit_imm64(e, (const void*) jit_resolve_slots);
+    emit_bytes(e, call_rax, sizeof(call_rax));
+}
+
+/* returns the slot of a variable, adding one if it has none yet */
+static int local_slot(jit_emitter_t* e, AstNode_t* ident)
+{
+    jit_code_t* code;
+    size_t i;
+
+    code = e->target;
+
+    for (i = 0; i < code->num_vars; i++)
+        if (strcmp((const char*) code->vars[i]->token.text, (const char*) ident->token.text) == 0)
+            return (int) i;
+
+    if (code->num_vars + 1 > code->max_vars)
+    {
+        code->max_vars = (code->max_vars == 0) ? 4 : (code->max_vars * 2);
+        code->vars = (AstNode_t**) realloc(code->vars, code->max_vars * sizeof(AstNode_t*));
+    }
+
+    code->vars[code->num_vars] = ident;
+    return (int) code->num_vars++;
+}
+
+/* returns the slot of an identifier that currently holds an int local in the feedback context, or -1 */
+static int int_local_slot(jit_emitter_t* e, AstNode_t* ident)
+{
+    TS_Val* locals;
+    intptr_t index;
+
+    if (e->context == NULL || ident->name != SN_IDENT)
+        return -1;
+
+    index = e->helpers->find_local(ident, e->context);
+
+    if (index < 0)
+        return -1;
+
+    locals = (TS_Val*) ((uint8_t*) e->context + e->helpers->locals_offset);
+
+    if (locals->object->members[index].val.type != TS_INT)
+        return -1;
+
+    return local_slot(e, ident);
+}
+
+/* rcx = slots[slot] */
+static void emit_load_slot(jit_emitter_t* e, int slot)
+{
+    static const uint8_t mov_rcx_r12_disp32[] = {0x49, 0x8B, 0x8C, 0x24};
+    static const uint8_t test_rcx_rcx[] = {0x48, 0x85, 0xC9};
+
+    emit_bytes(e, mov_rcx_r12_disp32, sizeof(mov_rcx_r12_disp32));
+    emit_imm32(e, slot * (int32_t) sizeof(intptr_t));
+    emit_bytes(e, test_rcx_rcx, sizeof(test_rcx_rcx));
+}
+
+/* rax = &members[rcx] */
+static void emit_member_address(jit_emitter_t* e)
+{
+    static const uint8_t mov_rax_rbx_disp32[] = {0x48, 0x8B, 0x83};
+    static const uint8_t mov_rax_rax_disp32[] = {0x48, 0x8B, 0x80};
+    static const uint8_t imul_rcx_rcx_imm32[] = {0x48, 0x69, 0xC9};
+    static const uint8_t add_rax_rcx[] = {0x48, 0x01, 0xC8};
+
+    emit_bytes(e, mov_rax_rbx_disp32, sizeof(mov_rax_rbx_disp32));
+    emit_imm32(e, (int32_t) (e->helpers->locals_offset + offsetof(TS_Val, object)));
+    emit_bytes(e, mov_rax_rax_disp32, sizeof(mov_rax_rax_disp32));
+    emit_imm32(e, (int32_t) offsetof(TS_Object, members));
+    emit_bytes(e, imul_rcx_rcx_imm32, sizeof(imul_rcx_rcx_imm32));
+    emit_imm32(e, (int32_t) sizeof(TS_ObjectMember));
+    emit_bytes(e, add_rax_rcx, sizeof(add_rax_rcx));
+}
+
+/* rax = &members[slots[slot]]; jumps to 'side_exit' unless that member is a resolved int */
+static void emit_slot_guard(jit_emitter_t* e, int slot, size_t side_exit)
+{
+    static const uint8_t cmp_rax_disp32_imm32[] = {0x81, 0xB8};
+
+    emit_load_slot(e, slot);
+    emit_jump(e, JIT_JS, side_exit);
+    emit_member_address(e);
+
+    emit_bytes(e, cmp_rax_disp32_imm32, sizeof(cmp_rax_disp32_imm32));
+    emit_imm32(e, (int32_t) (offsetof(TS_ObjectMember, val) + offsetof(TS_Val, type)));
+    emit_imm32(e, TS_INT);
+    emit_jump(e, JIT_JNZ, side_exit);
+}
+
+/* whether 'node' can be computed inline: int literals, int locals and +, -, * on them. Operands of the typed
+   operators are proven ints, anything else needs type feedback (with which the untyped operators on ints give
+   ints as well). */
+static int is_int_expression(jit_emitter_t* e, AstNode_t* node, int proven)
+{
+    switch (node->name)
+    {
+        case SN_INT:
+            return 1;
+
+        case SN_IDENT:
+            return proven ? (local_slot(e, node) >= 0) : (int_local_slot(e, node) >= 0);
+
+        case SN_ADD_INT:
+        case SN_MULTIPLY_INT:
+        case SN_SUBTRACT_INT:
+            return node->left != NULL && is_int_expression(e, node->left, 1) && is_int_expression(e, node->right, 1);
+
+        case SN_ADD:
+        case SN_MULTIPLY:
+            return is_int_expression(e, node->left, 0) && is_int_expression(e, node->right, 0);
+
+        case SN_SUBTRACT:
+            return (node->left == NULL || is_int_expression(e, node->left, 0)) && is_int_expression(e, node->right, 0);
+    }
+
+    return 0;
+}
+
+/* guards every local read by an int expression */
+static void emit_int_guards(jit_emitter_t* e, AstNode_t* node, size_t side_exit)
+{
+    if (node->name == SN_IDENT)
+        emit_slot_guard(e, local_slot(e, node), side_exit);
+    else if (node->name != SN_INT)
+    {
+        if (node->left != NULL)
+            emit_int_guards(e, node->left, side_exit);
+
+        emit_int_guards(e, node->right, side_exit);
+    }
+}
+
+/* eax = the value of an int expression, after emit_int_guards */
+static void emit_int_expression(jit_emitter_t* e, AstNode_t* node)
+{
+    static const uint8_t mov_eax_imm32[] = {0xB8};
+    static const uint8_t mov_eax_rax_disp32[] = {0x8B, 0x80};
+    static const uint8_t push_rax[] = {0x50};
+    static const uint8_t pop_rcx[] = {0x59};
+    static const uint8_t add_eax_ecx[] = {0x01, 0xC8};
+    static const uint8_t sub_eax_ecx[] = {0x29, 0xC8};
+    static const uint8_t imul_eax_ecx[] = {0x0F, 0xAF, 0xC1};
+    static const uint8_t neg_eax[] = {0xF7, 0xD8};
+
+    switch (node->name)
+    {
+        case SN_INT:
+            emit_bytes(e, mov_eax_imm32, sizeof(mov_eax_imm32));
+            emit_imm32(e, node->token.number);
+            return;
+
+        case SN_IDENT:
+            emit_load_slot(e, local_slot(e, node));
+            emit_member_address(e);
+            emit_bytes(e, mov_eax_rax_disp32, sizeof(mov_eax_rax_disp32));
+            emit_imm32(e, (int32_t) (offsetof(TS_ObjectMember, val) + offsetof(TS_Val, intval)));
+            return;
+    }
+
+    if (node->left == NULL)
+    {
+        emit_int_expression(e, node->right);
+        emit_bytes(e, neg_eax, sizeof(neg_eax));
+        return;
+    }
+
+    /* the right operand waits on the stack; there are no calls in between to care about its alignment */
+    emit_int_expression(e, node->right);
+    emit_bytes(e, push_rax, sizeof(push_rax));
+    emit_int_expression(e, node->left);
+    emit_bytes(e, pop_rcx, sizeof(pop_rcx));
+
+    if (node->name == SN_ADD_INT || node->name == SN_ADD)
+        emit_bytes(e, add_eax_ecx, sizeof(add_eax_ecx));
+    else if (node->name == SN_SUBTRACT_INT || node->name == SN_SUBTRACT)
+        emit_bytes(e, sub_eax_ecx, sizeof(sub_eax_ecx));
+    else
+        emit_bytes(e, imul_eax_ecx, sizeof(imul_eax_ecx));
+}
+
+/* jumps to 'false_label' if the condition does not hold */
+static void compile_condition(jit_emitter_t* e, AstNode_t* cond, int is_fused_if, size_t false_label)
+{
+    static const uint8_t push_rax[] = {0x50};
+    static const uint8_t pop_rcx[] = {0x59};
+    static const uint8_t cmp_eax_ecx[] = {0x39, 0xC8};
+    static const uint8_t mov_r13d_eax[] = {0x41, 0x89, 0xC5};
+    static const uint8_t test_r13d_r13d[] = {0x45, 0x85, 0xED};
+
+    const void* helper;
+    int proven;
+
+    helper = is_fused_if ? (const void*) e->helpers->test_equals : (const void*) e->helpers->test;
+    proven = (cond->name == SN_EQUALS_INT || cond->name == SN_NOT_EQUALS_INT);
+
+    if ((proven || cond->name == SN_EQUALS || cond->name == SN_NOT_EQUALS)
+            && is_int_expression(e, cond->left, proven) && is_int_expression(e, cond->right, proven))
+    {
+        size_t side_exit, true_label;
+
+        side_exit = new_label(e);
+        true_label = new_label(e);
+
+        e->num_inline++;
+
+        emit_int_guards(e, cond->left, side_exit);
+        emit_int_guards(e, cond->right, side_exit);
+
+        emit_int_expression(e, cond->right);
+        emit_bytes(e, push_rax, sizeof(push_rax));
+        emit_int_expression(e, cond->left);
+        emit_bytes(e, pop_rcx, sizeof(pop_rcx));
+        emit_bytes(e, cmp_eax_ecx, sizeof(cmp_eax_ecx));
+        emit_jump(e, (cond->name == SN_EQUALS || cond->name == SN_EQUALS_INT) ? JIT_JNZ : JIT_JZ, false_label);
+        emit_jump(e, JIT_JMP, true_label);
+
+        bind_label(e, side_exit);
+        emit_call(e, helper, cond);
+        emit_bytes(e, mov_r13d_eax, sizeof(mov_r13d_eax));
+        emit_resolve(e);
+        emit_bytes(e, test_r13d_r13d, sizeof(test_r13d_r13d));
+        emit_jump(e, JIT_JZ, false_label);
+
+        bind_label(e, true_label);
+    }
+    else
+    {
+        emit_call(e, helper, cond);
+        emit_test_eax(e);
+        emit_jump(e, JIT_JZ, false_label);
+    }
+}
+
+/* 'stop' is where control goes when a statement ends the enclosing block (break/return) */
+static void compile_statement(jit_emitter_t* e, AstNode_t* node, size_t stop)
+{
+    static const uint8_t add_rax_disp32_imm32[] = {0x81, 0x80};
+
+    size_t i;
+    int slot;
+
+    switch (node->name)
+    {
+        case SN_BLOCK:
+            for (i = 0; i < node->children_num; i++)
+                compile_statement(e, node->children[i], stop);
+            return;
+
+        case SN_IF:
+        case SN_IF_EQUALS:
+        {
+            size_t else_label, end_label;
+
+            else_label = new_label(e);
+            end_label = new_label(e);
+
+            compile_condition(e, node->left, node->name == SN_IF_EQUALS, else_label);
+
+            compile_statement(e, node->right, stop);
+            emit_jump(e, JIT_JMP, end_label);
+
+            bind_label(e, else_label);
+
+            if (node->children_num > 0)
+                compile_statement(e, node->children[0], stop);
+
+            bind_label(e, end_label);
+            return;
+        }
+
+        case SN_WHILE:
+        {
+            size_t loop_label, body_stop, end_label;
+
+            /* without type feedback, leave the loop to the interpreter so it can be traced on its own */
+            if (e->context == NULL)
+                break;
+
+            loop_label = new_label(e);
+            body_stop = new_label(e);
+            end_label = new_label(e);
+
+            bind_label(e, loop_label);
+            compile_condition(e, node->left, 0, end_label);
+
+            compile_statement(e, node->right, body_stop);
+            emit_jump(e, JIT_JMP, loop_label);
+
+            /* 'break' ends the loop, 'return' propagates */
+            bind_label(e, body_stop);
+            emit_call(e, (const void*) e->helpers->loop_stop, NULL);
+            emit_test_eax(e);
+            emit_jump(e, JIT_JNZ, stop);
+
+            bind_label(e, end_label);
+            return;
+        }
+
+        case SN_ASSIGN:
+        {
+            static const uint8_t push_rax[] = {0x50};
+            static const uint8_t pop_rcx[] = {0x59};
+            static const uint8_t mov_rax_disp32_ecx[] = {0x89, 0x88};
+
+            size_t side_exit, end_label;
+
+            /* an int stored into a local that already holds one: nothing to release, the value is replaced */
+            if (node->left->name != SN_IDENT || !is_int_expression(e, node->right, 0))
+                break;
+
+            side_exit = new_label(e);
+            end_label = new_label(e);
+
+            slot = local_slot(e, node->left);
+            e->num_inline++;
+
+            emit_int_guards(e, node->right, side_exit);
+            emit_slot_guard(e, slot, side_exit);
+
+            emit_int_expression(e, node->right);
+            emit_bytes(e, push_rax, sizeof(push_rax));
+            emit_load_slot(e, slot);
+            emit_member_address(e);
+            emit_bytes(e, pop_rcx, sizeof(pop_rcx));
+            emit_bytes(e, mov_rax_disp32_ecx, sizeof(mov_rax_disp32_ecx));
+            emit_imm32(e, (int32_t) (offsetof(TS_ObjectMember, val) + offsetof(TS_Val, intval)));
+            emit_jump(e, JIT_JMP, end_label);
+
+            bind_label(e, side_exit);
+            emit_call(e, (const void*) e->helpers->exec, node);
+            emit_test_eax(e);
+            emit_jump(e, JIT_JNZ, stop);
+            emit_resolve(e);
+
+            bind_label(e, end_label);
+            return;
+        }
+
+        case SN_ADD_CONST_STORE:
+        {
+            size_t side_exit, end_label;
+
+            if ((slot = int_local_slot(e, node->left)) < 0)
+                break;
+
+            side_exit = new_label(e);
+            end_label = new_label(e);
+            e->num_inline++;
+
+            emit_slot_guard(e, slot, side_exit);
+            emit_bytes(e, add_rax_disp32_imm32, sizeof(add_rax_disp32_imm32));
+            emit_imm32(e, (int32_t) (offsetof(TS_ObjectMember, val) + offsetof(TS_Val, intval)));
+            emit_imm32(e, node->right->right->token.number);
+            emit_jump(e, JIT_JMP, end_label);
+
+            bind_label(e, side_exit);
+            emit_call(e, (const void*) e->helpers->exec, node);
+            emit_test_eax(e);
+            emit_jump(e, JIT_JNZ, stop);
+            emit_resolve(e);
+
+            bind_label(e, end_label);
+            return;
+        }
+    }
+
+    emit_call(e, (const void*) e->helpers->exec, node);
+    emit_test_eax(e);
+    emit_jump(e, JIT_JNZ, stop);
+}
+
+static void jit_write_perf_map(const void* address, size_t size, const char* name)
+{
+    char path[64];
+    FILE* f;
+
+    snprintf(path, sizeof(path), "/tmp/perf-%i.map", (int) getpid());
+
+    f = fopen(path, "a");
+
+    if (f == NULL)
+        return;
+
+    fprintf(f, "%lx %lx tinyscript:%s\n", (unsigned long) (uintptr_t) address, (unsigned long) size, name);
+    fclose(f);
+}
+
+jit_code_t* jit_compile(AstNode_t* node, const char* name, const jit_helpers_t* helpers, void* context)
+{
+    static const uint8_t prologue[] = {
+        0x53,                   /* push rbx */
+        0x41, 0x54,             /* push r12 */
+        0x41, 0x55,             /* push r13 */
+        0x48, 0x81, 0xEC        /* sub rsp, imm32 */
+    };
+
+    static const uint8_t prologue_2[] = {
+        0x48, 0x89, 0xFB,       /* mov rbx, rdi */
+        0x49, 0x89, 0xE4        /* mov r12, rsp */
+    };
+
+    static const uint8_t return_0[] = {
+        0x31, 0xC0              /* xor eax, eax */
+    };
+
+    static const uint8_t return_1[] = {
+        0xB8, 1, 0, 0, 0        /* mov eax, 1 */
+    };
+
+    static const uint8_t epilogue[] = {
+        0x48, 0x81, 0xC4        /* add rsp, imm32 */
+    };
+
+    static const uint8_t epilogue_2[] = {
+        0x41, 0x5D,             /* pop r13 */
+        0x41, 0x5C,             /* pop r12 */
+        0x5B,                   /* pop rbx */
+        0xC3                    /* ret */
+    };
+
+    jit_emitter_t e;
+    jit_code_t* code;
+    size_t stop_label, return_label, frame_offset, frame_offset_2, i;
+    long page_size;
+    int32_t frame_size, rel;
+
+    code = (jit_code_t*) malloc(sizeof(jit_code_t));
+    code->helpers = helpers;
+    code->vars = NULL;
+    code->num_vars = 0;
+    code->max_vars = 0;
+
+    e.helpers = helpers;
+    e.context = context;
+    e.target = code;
+    e.code = NULL;
+    e.length = 0;
+    e.capacity = 0;
+    e.labels = NULL;
+    e.num_labels = 0;
+    e.max_labels = 0;
+    e.fixups = NULL;
+    e.num_fixups = 0;
+    e.max_fixups = 0;
+    e.num_inline = 0;
+
+    stop_label = new_label(&e);
+    return_label = new_label(&e);
+
+    /* the slot buffer size is only known at the end; patched below */
+    emit_bytes(&e, prologue, sizeof(prologue));
+    frame_offset = e.length;
+    emit_imm32(&e, 0);
+    emit_bytes(&e, prologue_2, sizeof(prologue_2));
+    emit_resolve(&e);
+
+    compile_statement(&e, node, stop_label);
+
+    emit_bytes(&e, return_0, sizeof(return_0));
+    emit_jump(&e, JIT_JMP, return_label);
+    bind_label(&e, stop_label);
+    emit_bytes(&e, return_1, sizeof(return_1));
+
+    bind_label(&e, return_label);
+    emit_bytes(&e, epilogue, sizeof(epilogue));
+    frame_offset_2 = e.length;
+    emit_imm32(&e, 0);
+    emit_bytes(&e, epilogue_2, sizeof(epilogue_2));
+
+    /* three pushes keep rsp 16-byte aligned; so must the buffer */
+    frame_size = (int32_t) ((code->num_vars * sizeof(intptr_t) + 15) & ~15);
+    memcpy(e.code + frame_offset, &frame_size, 4);
+    memcpy(e.code + frame_offset_2, &frame_size, 4);
+
+    for (i = 0; i < e.num_fixups; i++)
+    {
+        rel = (int32_t) (e.labels[e.fixups[i].label] - (e.fixups[i].offset + 4));
+        memcpy(e.code + e.fixups[i].offset, &rel, 4);
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+    code->size = (e.length + page_size - 1) / page_size * page_size;
+
+    /* a loop trace that is nothing but calls back into the interpreter stays interpreted */
+    if (context != NULL && e.num_inline == 0)
+        code->memory = MAP_FAILED;
+    else
+        code->memory = mmap(NULL, code->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (code->memory != MAP_FAILED)
+    {
+        memcpy(code->memory, e.code, e.length);
+
+        if (mprotect(code->memory, code->size, PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(code->memory, code->size);
+            code->memory = MAP_FAILED;
+        }
+    }
+
+    if (code->memory == MAP_FAILED)
+    {
+        free(code->vars);
+        free(code);
+        code = NULL;
+    }
+    else
+    {
+        code->entry = (int (*)(void*)) code->memory;
+
+        if (jit_perf_map)
+            jit_write_perf_map(code->memory, e.length, name);
+    }
+
+    free(e.code);
+    free(e.labels);
+    free(e.fixups);
+
+    return code;
+}
+
+void jit_release(jit_code_t* code)
+{
+    if (code == NULL)
+        return;
+
+    munmap(code->memory, code->size);
+    free(code->vars);
+    free(code);
+}
+
+int jit_run(jit_code_t* code, void* context)
+{
+    return code->entry(context);
+}
+
+#else
+
+/* JIT not available on this platform: everything stays in the interpreter */
+
+jit_code_t* jit_compile(AstNode_t* node, const char* name, const jit_helpers_t* helpers, void* context)
+{
+    return NULL;
+}
+
+void jit_release(jit_code_t* code)
+{
+}
+
+int jit_run(jit_code_t* code, void* context)
+{
+    return 0;
+}
+
+#endif
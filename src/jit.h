@@ -0,0 +1,46 @@
+#pragma once
+
+#include <tokenfactory.h>
+
+/* baseline template JIT: only built for x86-64 on Linux, see TINYSCRIPT_JIT in CMakeLists.txt */
+#if defined(TS_JIT) && defined(__x86_64__) && defined(__linux__)
+#define TS_JIT_AVAILABLE
+#endif
+
+#define JIT_CALL_THRESHOLD 50
+#define JIT_LOOP_THRESHOLD 1000
+
+typedef struct jit_code jit_code_t;
+
+/* interpreter entry points the generated code calls back into; each one receives the interpreter context */
+typedef struct
+{
+    /* evaluates a statement; returns non-zero if the enclosing block must stop (break/return) */
+    int (*exec)(AstNode_t* node, void* context);
+
+    /* evaluates a condition; returns non-zero if it is true */
+    int (*test)(AstNode_t* node, void* context);
+    int (*test_equals)(AstNode_t* node, void* context);
+
+    /* called when a loop body stopped; returns 0 if that was a 'break' for this loop */
+    int (*loop_stop)(void* context);
+
+    /* index of a variable in the context's locals object, or -1 if it is not a local */
+    intptr_t (*find_local)(AstNode_t* ident, void* context);
+
+    /* offset of the locals TS_Val inside the context */
+    size_t locals_offset;
+}
+jit_helpers_t;
+
+/* append an entry to /tmp/perf-<pid>.map for every compiled function */
+extern int jit_perf_map;
+
+/* compiles a statement (a function body or a loop); 'context' is a live interpreter context whose locals
+   serve as type feedback for specialization, or NULL to compile without it. Returns NULL if the statement is
+   better left to the interpreter: a loop trace without any inline code. */
+jit_code_t* jit_compile(AstNode_t* node, const char* name, const jit_helpers_t* helpers, void* context);
+void jit_release(jit_code_t* code);
+
+/* returns non-zero if the statement was stopped by break/return */
+int jit_run(jit_code_t* code, void* context);
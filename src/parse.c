@@ -3,14 +3,33 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
-enum { ST_APPEND, ST_ASSIGN, ST_BIN_AND, ST_BIN_OR, ST_COLON, ST_COMMA, ST_DIVIDE, ST_EQUALS, ST_GLOBAL, ST_IDENT, ST_INT, ST_LBRACKET, ST_LCURLY, ST_LSQUARE,
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+enum { ST_APPEND, ST_ASSIGN, ST_BIN_AND, ST_BIN_OR, ST_COLON, ST_COMMA, ST_DIVIDE, ST_EQUALS, ST_IDENT, ST_INT, ST_LBRACKET, ST_LCURLY, ST_LSQUARE,
         ST_NEWLINE, ST_NOT, ST_NOT_EQUALS, ST_MINUS, ST_MULTIPLY, ST_PERIOD, ST_PLUS, ST_RBRACKET, ST_RCURLY, ST_REAL, ST_RSQUARE, ST_STRINGLIT };
 
+/* identifiers that the parser treats specially; they are only keywords where a statement or value may begin, so
+   e.g. 'in' remains a valid variable name */
+enum { KW_BREAK, KW_ELSE, KW_FALSE, KW_FUNCTION, KW_GLOBAL, KW_IF, KW_IN, KW_ITERATE, KW_NULL, KW_RETURN, KW_TRUE, KW_WHILE };
+
+static const char* const keywords[] = { "break", "else", "false", "function", "global", "if", "in", "iterate", "null",
+    "return", "true", "while" };
+
 static const char* node_names[] = { "ADD", "APPEND", "ASSIGN", "BIN_AND", "BIN_OR", "BLOCK",
     "BREAK", "CALL", "DIVIDE", "EQUALS", "FALSE", "FUNCTION",
-    "IDENT", "IF", "INDEX", "INT", "ITERATE", "LIST", "MEMBER", "MULTIPLY", "NOT", "NOT_EQUALS", "NULL", "OBJECT",
-    "REAL", "RETURN", "SCRIPT", "STRING", "SUBTRACT", "TRUE", "WHILE" };
+    "IDENT", "IF", "INDEX", "INT", "ITERATE", "LAZY", "LIST", "MEMBER", "MULTIPLY", "NOT", "NOT_EQUALS", "NULL", "OBJECT",
+    "REAL", "RETURN", "SCRIPT", "STRING", "SUBTRACT", "TRUE", "WHILE",
+    "ADD_CONST_STORE", "CALL_NAME", "IF_EQUALS", "MEMBER_STORE",
+    "ADD_FLOAT", "ADD_INT", "DIVIDE_FLOAT", "EQUALS_INT", "MULTIPLY_FLOAT", "MULTIPLY_INT", "NOT_EQUALS_INT",
+    "SUBTRACT_FLOAT", "SUBTRACT_INT" };
 
 static const uint32_t ident_ranges[] = {
     'a', 'z',
@@ -23,7 +42,6 @@ static const Tokenclass_t script_tokens[] = {
     TOKEN_CLASS_STRING(CLASS_COMMENT, -1,           '#', '\n', -1, -1),
     TOKEN_CLASS_WORD(CLASS_TOKEN, ST_APPEND,        ".."),
     TOKEN_CLASS_WORD(CLASS_TOKEN, ST_EQUALS,        "=="),
-    TOKEN_CLASS_WORD(CLASS_TOKEN, ST_GLOBAL,        "global"),
     TOKEN_CLASS_WORD(CLASS_TOKEN, ST_NOT_EQUALS,    "!="),
     TOKEN_CLASS_CHAR(CLASS_TOKEN, ST_ASSIGN,        '='),
     TOKEN_CLASS_CHAR(CLASS_TOKEN, ST_BIN_AND,       '&'),
@@ -56,6 +74,15 @@ typedef struct
     Tokenbuffer_t* tokenbuffer;
     AstNode_t* script;
 
+    /* all nodes of the script are allocated from here */
+    AstArena_t* arena;
+
+    /* lazy mode: the input, and a cursor used to find the byte offsets of function bodies */
+    int flags;
+    const char* source;
+    size_t source_pos;
+    int source_line;
+
     char** globals;
     size_t num_globals, max_globals;
 
@@ -159,7 +186,17 @@ static void register_global(parsing_context_t *p, const char *name)
     p->num_globals++;
 }
 
+/* nodes made without a token from here on are located at the current token */
+static void parse_locate(parsing_context_t *p)
+{
+    Token_t* token;
+
+    if ((token = tb_current(tbuf)) != NULL)
+        ast_arena_locate(p->arena, token->line, token->pos_in_line);
+}
+
 AstNode_t* ast_block(parsing_context_t *p, int indent);
+static AstNode_t* ast_lazy_block(parsing_context_t *p);
 static AstNode_t* ast_list(parsing_context_t *p);
 AstNode_t* ast_logexpr(parsing_context_t *p);
 
@@ -172,7 +209,7 @@ static AstNode_t* ast_ident(parsing_context_t *p)
 
     if ((token = tb_check(tbuf, ST_IDENT)) != NULL)
     {
-        ident = ast_node(SN_IDENT, token);
+        ident = ast_arena_node(p->arena, SN_IDENT, token);
         tb_drop(tbuf);
         return ident;
     }
@@ -185,15 +222,17 @@ static AstNode_t* ast_atomic(parsing_context_t *p)
     AstNode_t* expr;
     Token_t* token;
 
-    if (tb_accept_sequence(tbuf, ST_IDENT, "null"))
-        return ast_node(SN_NULL, NULL);
-    else if (tb_accept_sequence(tbuf, ST_IDENT, "false"))
-        return ast_node(SN_FALSE, NULL);
-    else if (tb_accept_sequence(tbuf, ST_IDENT, "function"))
+    parse_locate(p);
+
+    if (tb_accept_keyword(tbuf, KW_NULL))
+        return ast_arena_node(p->arena, SN_NULL, NULL);
+    else if (tb_accept_keyword(tbuf, KW_FALSE))
+        return ast_arena_node(p->arena, SN_FALSE, NULL);
+    else if (tb_accept_keyword(tbuf, KW_FUNCTION))
     {
         AstNode_t *block, *func;
 
-        func = ast_node(SN_FUNCTION, NULL);
+        func = ast_arena_node(p->arena, SN_FUNCTION, NULL);
 
         /* name */
         func->left = ast_ident(p);
@@ -213,7 +252,10 @@ static AstNode_t* ast_atomic(parsing_context_t *p)
             return NULL;
         }
 
-        block = ast_block(p, -1);
+        if ((p->flags & PARSE_LAZY) && tb_check(tbuf, ST_NEWLINE) != NULL)
+            block = ast_lazy_block(p);
+        else
+            block = ast_block(p, -1);
 
         if (p->failed)
         {
@@ -224,26 +266,26 @@ static AstNode_t* ast_atomic(parsing_context_t *p)
         if (block != NULL)
             ast_addchild(func, block);
         else
-            ast_addchild(func, ast_node(SN_NULL, NULL));
+            ast_addchild(func, ast_arena_node(p->arena, SN_NULL, NULL));
 
         if (func->left != NULL)
         {
             register_global(p, (const char *) func->left->token.text);
 
-            func = ast_node_2(SN_ASSIGN, func->left, func);
+            func = ast_arena_node_2(p->arena, SN_ASSIGN, func->left, func);
             func->right->left = NULL;
         }
 
         return func;
     }
-    else if (tb_accept_sequence(tbuf, ST_IDENT, "true"))
-        return ast_node(SN_TRUE, NULL);
+    else if (tb_accept_keyword(tbuf, KW_TRUE))
+        return ast_arena_node(p->arena, SN_TRUE, NULL);
     else if (tb_accept(tbuf, ST_LCURLY))
     {
         AstNode_t *name, *value;
         int ignore_rcurly;
 
-        expr = ast_node(SN_OBJECT, NULL);
+        expr = ast_arena_node(p->arena, SN_OBJECT, NULL);
         ignore_rcurly = 0;
 
         while (1)
@@ -295,7 +337,7 @@ static AstNode_t* ast_atomic(parsing_context_t *p)
                 return NULL;
             }
 
-            ast_addchild(expr, ast_node_2(SN_ASSIGN, name, value));
+            ast_addchild(expr, ast_arena_node_2(p->arena, SN_ASSIGN, name, value));
 
             if (value->name == SN_FUNCTION)
             {
@@ -326,19 +368,19 @@ static AstNode_t* ast_atomic(parsing_context_t *p)
     }
     else if ((token = tb_check(tbuf, ST_INT)) != NULL)
     {
-        expr = ast_node(SN_INT, token);
+        expr = ast_arena_node(p->arena, SN_INT, token);
         tb_drop(tbuf);
         return expr;
     }
     else if ((token = tb_check(tbuf, ST_REAL)) != NULL)
     {
-        expr = ast_node(SN_REAL, token);
+        expr = ast_arena_node(p->arena, SN_REAL, token);
         tb_drop(tbuf);
         return expr;
     }
     else if ((token = tb_check(tbuf, ST_STRINGLIT)) != NULL)
     {
-        expr = ast_node(SN_STRING, token);
+        expr = ast_arena_node(p->arena, SN_STRING, token);
         tb_drop(tbuf);
         return expr;
     }
@@ -357,7 +399,7 @@ static AstNode_t* ast_list(parsing_context_t *p)
 
     skip_newlines(p);
 
-    list = ast_node(SN_LIST, NULL);
+    list = ast_arena_node(p->arena, SN_LIST, NULL);
 
     if (tb_accept(tbuf, ST_RBRACKET))
         return list;
@@ -367,7 +409,7 @@ static AstNode_t* ast_list(parsing_context_t *p)
         skip_newlines(p);
 
         if ( (next = ast_expression(p)) == NULL )
-            next = ast_node(SN_NULL, NULL);
+            next = ast_arena_node(p->arena, SN_NULL, NULL);
 
         ast_addchild(list, next);
 
@@ -428,7 +470,7 @@ AstNode_t* ast_nearbound(parsing_context_t *p)
                 return NULL;
             }
 
-            expr = ast_node_2(SN_INDEX, expr, right);
+            expr = ast_arena_node_2(p->arena, SN_INDEX, expr, right);
         }
         else if (tb_accept(tbuf, ST_PERIOD))
         {
@@ -448,10 +490,10 @@ AstNode_t* ast_nearbound(parsing_context_t *p)
                 return NULL;
             }
 
-            expr = ast_node_2(SN_MEMBER, expr, right);
+            expr = ast_arena_node_2(p->arena, SN_MEMBER, expr, right);
         }
         else if ((right = ast_list(p)) != NULL)
-            expr = ast_node_2(SN_CALL, expr, right);
+            expr = ast_arena_node_2(p->arena, SN_CALL, expr, right);
         else
             break;
     }
@@ -473,7 +515,7 @@ AstNode_t* ast_prefixednearbound(parsing_context_t *p)
             return NULL;
         }
 
-        return ast_node_2(SN_SUBTRACT, NULL, node);
+        return ast_arena_node_2(p->arena, SN_SUBTRACT, NULL, node);
     }
     else if (tb_accept(tbuf, ST_NOT))
     {
@@ -487,7 +529,7 @@ AstNode_t* ast_prefixednearbound(parsing_context_t *p)
             return NULL;
         }
 
-        return ast_node_2(SN_NOT, node, NULL);
+        return ast_arena_node_2(p->arena, SN_NOT, node, NULL);
     }
     else
         return ast_nearbound(p);
@@ -512,7 +554,7 @@ AstNode_t* ast_prefixednearbound(parsing_context_t *p)
             return NULL;\
         }\
 \
-        expr = ast_node_2(SN_##token_, expr, right);\
+        expr = ast_arena_node_2(p->arena, SN_##token_, expr, right);\
     }
 
 AstNode_t* ast_mulexpr(parsing_context_t *p)
@@ -555,7 +597,7 @@ AstNode_t* ast_mulexpr(parsing_context_t *p)
             return NULL;\
         }\
 \
-        expr = ast_node_2(SN_##rule_, expr, right);\
+        expr = ast_arena_node_2(p->arena, SN_##rule_, expr, right);\
     }
 
 AstNode_t* ast_addexpr(parsing_context_t *p)
@@ -608,7 +650,7 @@ AstNode_t* ast_assignexpr(parsing_context_t *p)
             return NULL;
         }
 
-        expr = ast_node_2(SN_ASSIGN, expr, right);
+        expr = ast_arena_node_2(p->arena, SN_ASSIGN, expr, right);
     }
 
     return expr;
@@ -633,7 +675,7 @@ AstNode_t* ast_assignexpr(parsing_context_t *p)
             return NULL;\
         }\
 \
-        expr = ast_node_2(SN_##rule_, expr, right);\
+        expr = ast_arena_node_2(p->arena, SN_##rule_, expr, right);\
     }
 
 AstNode_t* ast_cmpexpr(parsing_context_t *p)
@@ -676,7 +718,7 @@ AstNode_t* ast_cmpexpr(parsing_context_t *p)
             return NULL;\
         }\
 \
-        expr = ast_node_2(SN_##rule_, expr, right);\
+        expr = ast_arena_node_2(p->arena, SN_##rule_, expr, right);\
     }
 
 AstNode_t* ast_logexpr(parsing_context_t *p)
@@ -702,15 +744,17 @@ AstNode_t* ast_logexpr(parsing_context_t *p)
 
 AstNode_t* ast_statement(parsing_context_t *p)
 {
-    if (tb_accept_sequence(tbuf, ST_IDENT, "break"))
+    parse_locate(p);
+
+    if (tb_accept_keyword(tbuf, KW_BREAK))
     {
-        return ast_node(SN_BREAK, NULL);
+        return ast_arena_node(p->arena, SN_BREAK, NULL);
     }
-    else if (tb_accept_sequence(tbuf, ST_IDENT, "if"))
+    else if (tb_accept_keyword(tbuf, KW_IF))
     {
         AstNode_t *node;
 
-        node = ast_node_2(SN_IF, NULL, NULL);
+        node = ast_arena_node_2(p->arena, SN_IF, NULL, NULL);
 
         /* condition */
         skip_newlines(p);
@@ -746,7 +790,7 @@ AstNode_t* ast_statement(parsing_context_t *p)
         }
 
         skip_newlines(p);
-        if (tb_accept_sequence(tbuf, ST_IDENT, "else"))
+        if (tb_accept_keyword(tbuf, KW_ELSE))
         {
             AstNode_t* else_block;
 
@@ -770,11 +814,11 @@ AstNode_t* ast_statement(parsing_context_t *p)
 
         return node;
     }
-    else if (tb_accept_sequence(tbuf, ST_IDENT, "iterate"))
+    else if (tb_accept_keyword(tbuf, KW_ITERATE))
     {
         AstNode_t *node, *block;
 
-        node = ast_node_2(SN_ITERATE, NULL, NULL);
+        node = ast_arena_node_2(p->arena, SN_ITERATE, NULL, NULL);
 
         /* iterator name */
         skip_newlines(p);
@@ -795,7 +839,7 @@ AstNode_t* ast_statement(parsing_context_t *p)
 
         skip_newlines(p);
 
-        if (!tb_accept_sequence(tbuf, ST_IDENT, "in"))
+        if (!tb_accept_keyword(tbuf, KW_IN))
         {
             parse_error(p, "Expected 'in'");
             ast_release_node(&node);
@@ -837,7 +881,7 @@ AstNode_t* ast_statement(parsing_context_t *p)
         ast_addchild(node, block);
         return node;
     }
-    else if (tb_accept_sequence(tbuf, ST_IDENT, "return"))
+    else if (tb_accept_keyword(tbuf, KW_RETURN))
     {
         AstNode_t *value;
 
@@ -846,13 +890,13 @@ AstNode_t* ast_statement(parsing_context_t *p)
         if (p->failed)
             return NULL;
 
-        return ast_node_2(SN_RETURN, value, NULL);
+        return ast_arena_node_2(p->arena, SN_RETURN, value, NULL);
     }
-    else if (tb_accept_sequence(tbuf, ST_IDENT, "while"))
+    else if (tb_accept_keyword(tbuf, KW_WHILE))
     {
         AstNode_t *node;
 
-        node = ast_node_2(SN_WHILE, NULL, NULL);
+        node = ast_arena_node_2(p->arena, SN_WHILE, NULL, NULL);
 
         /* condition */
         skip_newlines(p);
@@ -897,7 +941,7 @@ AstNode_t* ast_block(parsing_context_t *p, int i)
 {
     AstNode_t *block;
     Token_t *tok;
-    int indent;
+    int indent, line, column;
 
     indent = -1;
     block = NULL;
@@ -918,13 +962,19 @@ AstNode_t* ast_block(parsing_context_t *p, int i)
         else if (tok->indent < indent)
             break;
 
+        line = tok->line;
+        column = tok->pos_in_line;
+
         statement = ast_statement(p);
         
         if (statement == NULL)
             break;
 
         if (block == NULL)
-            block = ast_node(SN_BLOCK, NULL);
+        {
+            ast_arena_locate(p->arena, line, column);
+            block = ast_arena_node(p->arena, SN_BLOCK, NULL);
+        }
 
         ast_addchild(block, statement);
 
@@ -948,9 +998,122 @@ AstNode_t* ast_block(parsing_context_t *p, int i)
     return block;
 }
 
+/* byte offset of a (line, column) token position in the source; columns count code points */
+static size_t source_offset(parsing_context_t *p, int line, int column)
+{
+    const char* source;
+    size_t pos;
+
+    source = p->source;
+
+    if (line < p->source_line)
+    {
+        p->source_pos = 0;
+        p->source_line = 1;
+    }
+
+    while (p->source_line < line && source[p->source_pos] != 0)
+    {
+        if (source[p->source_pos] == '\n')
+            p->source_line++;
+
+        p->source_pos++;
+    }
+
+    for (pos = p->source_pos; column > 0 && source[pos] != 0 && source[pos] != '\n'; column--)
+    {
+        pos++;
+
+        while ((source[pos] & 0xC0) == 0x80)
+            pos++;
+    }
+
+    return pos;
+}
+
+static int can_start_statement(int name)
+{
+    return name == ST_IDENT || name == ST_INT || name == ST_REAL || name == ST_STRINGLIT || name == ST_LBRACKET
+            || name == ST_LCURLY || name == ST_MINUS || name == ST_NOT;
+}
+
+/* lazy mode: instead of parsing a function body, only find where it ends (the same place ast_block would stop:
+   a statement indented less than the first one, or a token that can't continue the block) and keep its source.
+   named functions inside the body are registered as globals right away, as the parser would have done */
+static AstNode_t* ast_lazy_block(parsing_context_t *p)
+{
+    AstNode_t* lazy;
+    Token_t* tok;
+    int indent, first_line, first_column, depth, statement_start, after_function, num_tokens;
+    size_t begin, end;
+
+    skip_newlines(p);
+
+    tok = tb_current(tbuf);
+
+    if (tok == NULL)
+        return NULL;
+
+    indent = tok->indent;
+    first_line = tok->line;
+    first_column = tok->pos_in_line;
+
+    depth = 0;
+    statement_start = 1;
+    after_function = 0;
+    num_tokens = 0;
+
+    while ((tok = tb_current(tbuf)) != NULL)
+    {
+        /* blank lines don't end the body, the next statement decides */
+        if (statement_start && tok->name == ST_NEWLINE)
+        {
+            tb_drop(tbuf);
+            continue;
+        }
+
+        if (depth == 0 && statement_start && (tok->indent < indent || !can_start_statement(tok->name)))
+            break;
+
+        if (tok->name == ST_LBRACKET || tok->name == ST_LCURLY || tok->name == ST_LSQUARE)
+            depth++;
+        else if (tok->name == ST_RBRACKET || tok->name == ST_RCURLY || tok->name == ST_RSQUARE)
+        {
+            if (depth == 0)
+                break;
+
+            depth--;
+        }
+
+        if (after_function && tok->name == ST_IDENT)
+            register_global(p, (const char *) tok->text);
+
+        after_function = (tb_check_keyword(tbuf, KW_FUNCTION) != NULL);
+        statement_start = (tok->name == ST_NEWLINE);
+
+        tb_drop(tbuf);
+        num_tokens++;
+    }
+
+    p->dont_check_newline = 1;
+
+    if (num_tokens == 0)
+        return NULL;
+
+    begin = source_offset(p, first_line, 0);
+    end = (tok != NULL) ? source_offset(p, tok->line, tok->pos_in_line) : strlen(p->source);
+
+    ast_arena_locate(p->arena, first_line, first_column);
+    lazy = ast_arena_node(p->arena, SN_LAZY, NULL);
+    lazy->token.line = first_line;
+    lazy->token.text = ast_arena_text(p->arena, (const uint8_t *) p->source + begin, end - begin);
+
+    return lazy;
+}
+
 int ast_script(parsing_context_t *p)
 {
-    p->script = ast_node(SN_SCRIPT, NULL);
+    p->script = ast_arena_node(p->arena, SN_SCRIPT, NULL);
 
     while (!p->failed)
     {
@@ -958,7 +1121,7 @@ int ast_script(parsing_context_t *p)
 
         skip_newlines(p);
 
-        if (tb_accept(tbuf, ST_GLOBAL))
+        if (tb_accept_keyword(tbuf, KW_GLOBAL))
         {
             Token_t* token;
 
@@ -1005,38 +1168,117 @@ static void node_on_release_script(AstNode_t* node)
         free(ast_properties->globals[i]);
 
     free(ast_properties->globals);
+    free(ast_properties->known_globals);
+    free(ast_properties->file_name);
     free(ast_properties);
 }
 
-AstNode_t* parse(const char* filename, const char* script)
+static void set_properties(AstNode_t* script, char** globals, size_t num_globals, const char* filename)
 {
-    Tokenfactory_t *tf;
-    parsing_context_t p;
     ast_properties_t *ast_properties;
-    size_t i;
+
+    ast_properties = (ast_properties_t *) malloc(sizeof(ast_properties_t));
+    ast_properties->globals = globals;
+    ast_properties->num_globals = num_globals;
+    ast_properties->known_globals = NULL;
+    ast_properties->num_known_globals = 0;
+    ast_properties->file_name = (char *) malloc(strlen(filename) + 1);
+    strcpy(ast_properties->file_name, filename);
+
+    script->cust_data = ast_properties;
+    script->on_release = node_on_release_script;
+}
+
+static Tokenfactory_t* parse_begin(parsing_context_t *p, const char* filename, const char* script, int flags)
+{
+    Tokenfactory_t *tf;
 
     static const uint32_t chars[] = {' ', '\t', '\r'};
 
     tf = tokenfactory();
     tokenclass_add(tf, script_tokens, sizeof(script_tokens) / sizeof(script_tokens[0]));
+    tf_keywords_set(tf, keywords, sizeof(keywords) / sizeof(keywords[0]));
     tf_whitespace_add(tf, chars, 3);
     
     tf_input_string(tf, (uint8_t*) script, -1, 0);
 
-    p.file_name = filename;
+    p->file_name = (const uint8_t*) filename;
 
-    p.tokenbuffer = tokenbuffer(tf);
-    p.script = NULL;
+    p->tokenbuffer = tokenbuffer(tf);
+    p->script = NULL;
+    p->arena = NULL;
 
-    p.globals = NULL;
-    p.num_globals = 0;
-    p.max_globals = 0;
+    p->flags = flags;
+    p->source = script;
+    p->source_pos = 0;
+    p->source_line = 1;
 
-    p.failed = 0;
-    p.error_desc = NULL;
-    p.error_capacity = 0;
+    p->globals = NULL;
+    p->num_globals = 0;
+    p->max_globals = 0;
 
-    p.dont_check_newline = 0;
+    p->failed = 0;
+    p->error_desc = NULL;
+    p->error_capacity = 0;
+
+    p->dont_check_newline = 0;
+
+    return tf;
+}
+
+static void parse_end(parsing_context_t *p, Tokenfactory_t *tf)
+{
+    tokenbuffer_del(&p->tokenbuffer);
+    tokenfactory_del(&tf);
+
+    free(p->error_desc);
+}
+
+AstNode_t* parse_lazy_body(const char* filename, AstNode_t* lazy, int flags)
+{
+    Tokenfactory_t *tf;
+    parsing_context_t p;
+    AstNode_t* block;
+    size_t i;
+
+    tf = parse_begin(&p, filename, (const char*) lazy->token.text, flags);
+
+    /* the body becomes part of the script, so it goes into the same arena */
+    p.arena = lazy->arena;
+
+    /* keep line numbers in error messages relative to the whole file */
+    tf->line = lazy->token.line;
+    p.source_line = lazy->token.line;
+
+    block = ast_block(&p, -1);
+
+    if (!p.failed && tb_current(p.tokenbuffer) != NULL)
+        parse_error(&p, "Unrecognized token in input");
+
+    if (p.failed)
+    {
+        printf("\nPARSE ERROR:\n%s", p.error_desc);
+        ast_release_node(&block);
+    }
+
+    /* nested functions were registered when the body was scanned */
+    for (i = 0; i < p.num_globals; i++)
+        free(p.globals[i]);
+
+    free(p.globals);
+
+    parse_end(&p, tf);
+    return block;
+}
+
+AstNode_t* parse(const char* filename, const char* script, int flags)
+{
+    Tokenfactory_t *tf;
+    parsing_context_t p;
+    size_t i;
+
+    tf = parse_begin(&p, filename, script, flags);
+    p.arena = ast_arena();
 
     ast_script(&p);
 
@@ -1044,6 +1286,7 @@ AstNode_t* parse(const char* filename, const char* script)
     {
         printf("\nPARSE ERROR:\n%s", p.error_desc);
         ast_release_node(&p.script);
+        ast_arena_release(&p.arena);
 
         for (i = 0; i < p.num_globals; i++)
             free(p.globals[i]);
@@ -1054,18 +1297,221 @@ AstNode_t* parse(const char* filename, const char* script)
     {
         //ast_print(p.script, 0, node_names, sizeof(node_names) / sizeof(*node_names));
 
-        ast_properties = (ast_properties_t *) malloc(sizeof(ast_properties_t));
-        ast_properties->globals = p.globals;
-        ast_properties->num_globals = p.num_globals;
-        
-        p.script->cust_data = ast_properties;
-        p.script->on_release = node_on_release_script;
+        ast_arena_set_root(p.script);
+        set_properties(p.script, p.globals, p.num_globals, filename);
     }
 
-    tokenbuffer_del(&p.tokenbuffer);
-    tokenfactory_del(&tf);
+    parse_end(&p, tf);
+    return p.script;
+}
 
-    free(p.error_desc);
+/*
+ *  Binary AST cache
+ *
+ *  The cache file starts with a header identifying what it was produced from: format version, the number of node
+ *  kinds (so that a rebuilt interpreter with a different SN_ enum rejects it), parse flags, and the path, mtime,
+ *  length and FNV-1a hash of the source. The globals table follows, then the raw (not yet finalized) AST as written
+ *  by ast_serialize_node. All values are in host byte order; the magic number catches a foreign one.
+ */
 
-    return p.script;
+#define CACHE_MAGIC     0x43415354      /* "TSAC" */
+#define CACHE_VERSION   4
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version, num_node_kinds;
+    uint32_t flags;
+    int64_t mtime;
+    uint64_t source_hash;
+    uint32_t source_length, path_length;
+}
+cache_header_t;
+
+static uint64_t hash_source(const char* script, size_t length)
+{
+    uint64_t hash;
+    size_t i;
+
+    hash = 0xcbf29ce484222325ULL;
+
+    for (i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t) script[i]) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+static int cache_header(cache_header_t* header, const char* filename, const char* script, int flags)
+{
+    struct stat st;
+
+    if (stat(filename, &st) != 0)
+        return -1;
+
+    memset(header, 0, sizeof(cache_header_t));
+    header->magic = CACHE_MAGIC;
+    header->version = CACHE_VERSION;
+    header->num_node_kinds = sizeof(node_names) / sizeof(*node_names);
+    header->flags = flags;
+    header->mtime = (int64_t) st.st_mtime;
+    header->source_length = strlen(script);
+    header->source_hash = hash_source(script, header->source_length);
+    header->path_length = strlen(filename);
+
+    return 0;
+}
+
+static char* cache_file_name(const char* filename)
+{
+    char* cache_filename;
+
+    cache_filename = (char *) malloc(strlen(filename) + 5);
+    sprintf(cache_filename, "%s.ast", filename);
+
+    return cache_filename;
+}
+
+static int write_string(FILE* f, const char* string)
+{
+    uint32_t length;
+
+    length = strlen(string);
+
+    return (fwrite(&length, 4, 1, f) == 1 && fwrite(string, 1, length, f) == length) ? 0 : -1;
+}
+
+static char* read_string(FILE* f)
+{
+    uint32_t length;
+    char* string;
+
+    if (fread(&length, 4, 1, f) != 1 || (string = (char *) malloc(length + 1)) == NULL)
+        return NULL;
+
+    if (fread(string, 1, length, f) != length)
+    {
+        free(string);
+        return NULL;
+    }
+
+    string[length] = 0;
+    return string;
+}
+
+AstNode_t* parse_cache_load(const char* filename, const char* script, int flags)
+{
+    cache_header_t expected, header;
+    char *cache_filename, *path;
+    char** globals;
+    uint32_t num_globals, i;
+    int mismatch;
+    AstArena_t* arena;
+    AstNode_t* ast;
+    FILE* f;
+
+    if (cache_header(&expected, filename, script, flags) != 0)
+        return NULL;
+
+    cache_filename = cache_file_name(filename);
+    f = fopen(cache_filename, "rb");
+    free(cache_filename);
+
+    if (f == NULL)
+        return NULL;
+
+    ast = NULL;
+    globals = NULL;
+    num_globals = 0;
+
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(&header, &expected, sizeof(header)) != 0)
+        goto done;
+
+    if ((path = read_string(f)) == NULL)
+        goto done;
+
+    mismatch = strcmp(path, filename);
+    free(path);
+
+    if (mismatch || fread(&num_globals, 4, 1, f) != 1 || num_globals > header.source_length)
+        goto done;
+
+    globals = (char **) calloc(num_globals + 1, sizeof(char *));
+
+    for (i = 0; i < num_globals; i++)
+        if ((globals[i] = read_string(f)) == NULL)
+            goto done;
+
+    arena = ast_arena();
+
+    if ((ast = ast_deserialize_node(arena, f)) == NULL || ast->name != SN_SCRIPT || fgetc(f) != EOF)
+    {
+        ast_release_node(&ast);
+        ast_arena_release(&arena);
+        goto done;
+    }
+
+    ast_arena_set_root(ast);
+    set_properties(ast, globals, num_globals, filename);
+    globals = NULL;
+
+done:
+    if (globals != NULL)
+    {
+        for (i = 0; i < num_globals; i++)
+            free(globals[i]);
+
+        free(globals);
+    }
+
+    fclose(f);
+    return ast;
+}
+
+int parse_cache_store(const char* filename, const char* script, AstNode_t* ast, int flags)
+{
+    cache_header_t header;
+    ast_properties_t *ast_properties;
+    char *cache_filename, *temp_filename;
+    uint32_t num_globals, i;
+    int rc;
+    FILE* f;
+
+    if (cache_header(&header, filename, script, flags) != 0)
+        return -1;
+
+    ast_properties = (ast_properties_t *) ast->cust_data;
+    num_globals = ast_properties->num_globals;
+
+    /* written under a temporary name and renamed, so that a concurrent tsi never sees a partial file */
+    cache_filename = cache_file_name(filename);
+    temp_filename = (char *) malloc(strlen(cache_filename) + 24);
+    sprintf(temp_filename, "%s.%lu", cache_filename, (unsigned long) getpid());
+
+    rc = -1;
+    f = fopen(temp_filename, "wb");
+
+    if (f != NULL)
+    {
+        rc = (fwrite(&header, sizeof(header), 1, f) == 1 && write_string(f, filename) == 0
+                && fwrite(&num_globals, 4, 1, f) == 1) ? 0 : -1;
+
+        for (i = 0; rc == 0 && i < num_globals; i++)
+            rc = write_string(f, ast_properties->globals[i]);
+
+        if (rc == 0)
+            rc = ast_serialize_node(ast, f);
+
+        if (fclose(f) != 0)
+            rc = -1;
+
+        if (rc == 0)
+            rc = rename(temp_filename, cache_filename);
+
+        if (rc != 0)
+            remove(temp_filename);
+    }
+
+    free(temp_filename);
+    free(cache_filename);
+    return rc;
 }
@@ -20,6 +20,7 @@ enum {
     SN_INDEX,
     SN_INT,
     SN_ITERATE,
+    SN_LAZY,
     SN_LIST,
     SN_MEMBER,
     SN_MULTIPLY,
@@ -33,14 +34,53 @@ enum {
     SN_STRING,
     SN_SUBTRACT,
     SN_TRUE,
-    SN_WHILE
+    SN_WHILE,
+
+    /* superinstructions, fused by ast_finalize */
+    SN_ADD_CONST_STORE,
+    SN_CALL_NAME,
+    SN_IF_EQUALS,
+    SN_MEMBER_STORE,
+
+    /* type-specialized operators, selected by ast_specialize using the inferred types of their operands */
+    SN_ADD_FLOAT,
+    SN_ADD_INT,
+    SN_DIVIDE_FLOAT,
+    SN_EQUALS_INT,
+    SN_MULTIPLY_FLOAT,
+    SN_MULTIPLY_INT,
+    SN_NOT_EQUALS_INT,
+    SN_SUBTRACT_FLOAT,
+    SN_SUBTRACT_INT,
+
+    SN_NUM_KINDS
 };
 
-AstNode_t* parse(const char* filename, const char* script);
+/* parse() flags */
+#define PARSE_LAZY  1       /* keep function bodies as source (SN_LAZY) until parse_lazy_body */
+
+AstNode_t* parse(const char* filename, const char* script, int flags);
+
+/* parses the body of a function kept as SN_LAZY; returns NULL on a parse error */
+AstNode_t* parse_lazy_body(const char* filename, AstNode_t* lazy, int flags);
 
 typedef struct
 {
     char** globals;
     size_t num_globals;
+
+    /* names that were global before the script ran (set by the scripts run before it, or restored from a
+       snapshot), which type inference must not take for locals; the array is owned, the names are not */
+    const char** known_globals;
+    size_t num_known_globals;
+
+    char* file_name;
 }
-ast_properties_t;
\ No newline at end of file
+ast_properties_t;
+
+/* binary AST cache, kept next to the script as '<filename>.ast'. a cache is only loaded if it was written by this
+   build for the same path, mtime, source text and flags; returns NULL otherwise */
+AstNode_t* parse_cache_load(const char* filename, const char* script, int flags);
+
+/* writes the cache for a freshly parsed, not yet finalized script; returns 0 on success */
+int parse_cache_store(const char* filename, const char* script, AstNode_t* ast, int flags);
@@ -0,0 +1,311 @@
+/*
+ *  Hot reload
+ *
+ *  Watches the directory of a running script with inotify (editors usually replace a file rather than write to it)
+ *  and, when the script is written, parses it again. Each top-level function definition is compared with the one
+ *  running by a hash of its unfinalized subtree, line numbers left out; a function that differs has its arguments
+ *  and body swapped with the new ones in the SN_FUNCTION node that all of its values point to, so globals and
+ *  objects holding it keep working and run the new code from their next call. Functions that are new are added to
+ *  the globals. Top-level code outside function definitions is not run again.
+ *
+ *  Calls that are running while a reload happens finish in the old body, which is why every re-parsed script is
+ *  kept (holding the bodies it was swapped with) until the reload is released.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reload.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+typedef struct
+{
+    const char* name;
+    uint64_t hash;
+
+    /* the SN_FUNCTION node that values of the function point to */
+    AstNode_t* func;
+}
+reload_function_t;
+
+struct reload
+{
+    char* filename;
+    const char* base_name;
+    reload_env_t env;
+
+    int fd;
+
+    reload_function_t* functions;
+    size_t num_functions;
+
+    AstNode_t** scripts;
+    size_t num_scripts;
+};
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t length)
+{
+    const uint8_t* bytes;
+    size_t i;
+
+    bytes = (const uint8_t*) data;
+
+    for (i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+static uint64_t hash_node(uint64_t hash, AstNode_t* node)
+{
+    uint32_t i;
+
+    if (node == NULL)
+        return hash_bytes(hash, "", 1);
+
+    hash = hash_bytes(hash, &node->name, sizeof(node->name));
+    hash = hash_bytes(hash, &node->token.number, sizeof(node->token.number));
+    hash = hash_bytes(hash, &node->token.decimal, sizeof(node->token.decimal));
+
+    if (node->token.text != NULL)
+        hash = hash_bytes(hash, node->token.text, strlen((const char*) node->token.text) + 1);
+
+    hash = hash_node(hash, node->left);
+    hash = hash_node(hash, node->right);
+
+    hash = hash_bytes(hash, &node->children_num, sizeof(node->children_num));
+
+    for (i = 0; i < node->children_num; i++)
+        hash = hash_node(hash, node->children[i]);
+
+    return hash;
+}
+
+/* top-level function definitions are blocks of the script holding 'name = function ...' */
+static void collect_functions(AstNode_t* script, reload_function_t** functions_out, size_t* num_functions_out)
+{
+    reload_function_t* functions;
+    size_t num_functions, i, j;
+
+    functions = NULL;
+    num_functions = 0;
+
+    for (i = 0; i < script->children_num; i++)
+        for (j = 0; j < script->children[i]->children_num; j++)
+        {
+            AstNode_t* statement;
+
+            statement = script->children[i]->children[j];
+
+            if (statement->name != SN_ASSIGN || statement->left == NULL || statement->left->name != SN_IDENT
+                    || statement->right == NULL || statement->right->name != SN_FUNCTION)
+                continue;
+
+            functions = (reload_function_t*) realloc(functions, (num_functions + 1) * sizeof(reload_function_t));
+            functions[num_functions].name = (const char*) statement->left->token.text;
+            functions[num_functions].hash = hash_node(0xcbf29ce484222325ULL, statement->right);
+            functions[num_functions].func = statement->right;
+            num_functions++;
+        }
+
+    *functions_out = functions;
+    *num_functions_out = num_functions;
+}
+
+static reload_function_t* find_function(reload_t* reload, const char* name)
+{
+    size_t i;
+
+    /* a function defined twice is the last definition */
+    for (i = reload->num_functions; i > 0; i--)
+        if (strcmp(reload->functions[i - 1].name, name) == 0)
+            return &reload->functions[i - 1];
+
+    return NULL;
+}
+
+#ifdef __linux__
+
+reload_t* reload_watch(const char* filename, AstNode_t* script, const reload_env_t* env)
+{
+    reload_t* reload;
+    char* dir;
+    const char* slash;
+
+    reload = (reload_t*) malloc(sizeof(reload_t));
+    reload->filename = (char*) malloc(strlen(filename) + 1);
+    strcpy(reload->filename, filename);
+
+    slash = strrchr(reload->filename, '/');
+    reload->base_name = (slash != NULL) ? slash + 1 : reload->filename;
+
+    if (slash == NULL)
+    {
+        dir = (char*) malloc(2);
+        strcpy(dir, ".");
+    }
+    else
+    {
+        dir = (char*) malloc(slash - reload->filename + 2);
+        memcpy(dir, reload->filename, slash - reload->filename + 1);
+        dir[slash - reload->filename + 1] = 0;
+    }
+
+    reload->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (reload->fd < 0 || inotify_add_watch(reload->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        if (reload->fd >= 0)
+            close(reload->fd);
+
+        free(dir);
+        free(reload->filename);
+        free(reload);
+        return NULL;
+    }
+
+    free(dir);
+
+    reload->env = *env;
+    collect_functions(script, &reload->functions, &reload->num_functions);
+
+    reload->scripts = NULL;
+    reload->num_scripts = 0;
+
+    return reload;
+}
+
+/* drains pending events; returns non-zero if any of them was about the script */
+static int has_changed(reload_t* reload)
+{
+    char buffer[4096];
+    const struct inotify_event* event;
+    ssize_t length, i;
+    int changed;
+
+    changed = 0;
+
+    while ((length = read(reload->fd, buffer, sizeof(buffer))) > 0)
+        for (i = 0; i < length; i += sizeof(struct inotify_event) + event->len)
+        {
+            event = (const struct inotify_event*) (buffer + i);
+
+            if (event->len > 0 && strcmp(event->name, reload->base_name) == 0)
+                changed = 1;
+        }
+
+    return changed;
+}
+
+#else
+
+reload_t* reload_watch(const char* filename, AstNode_t* script, const reload_env_t* env)
+{
+    return NULL;
+}
+
+static int has_changed(reload_t* reload)
+{
+    return 0;
+}
+
+#endif
+
+int reload_poll(reload_t* reload, TS_Val globals)
+{
+    Tfsource_t source;
+    AstNode_t* script;
+    reload_function_t* fresh;
+    size_t num_fresh, i;
+    int count;
+
+    if (reload == NULL || !has_changed(reload))
+        return 0;
+
+    if (tf_source_open(&source, reload->filename) != 0)
+        return -1;
+
+    script = parse(reload->filename, source.text, reload->env.flags);
+    tf_source_close(&source);
+
+    if (script == NULL)
+    {
+        fprintf(stderr, "tinyscript: `%s` not reloaded\n", reload->filename);
+        return -1;
+    }
+
+    /* hashed before finalization, which rewrites nodes */
+    collect_functions(script, &fresh, &num_fresh);
+    reload->env.prepare(script);
+
+    count = 0;
+
+    for (i = 0; i < num_fresh; i++)
+    {
+        reload_function_t* live;
+
+        live = find_function(reload, fresh[i].name);
+
+        if (live != NULL && live->hash == fresh[i].hash)
+            continue;
+
+        if (live != NULL)
+        {
+            reload->env.swap_function(live->func, fresh[i].func);
+            live->hash = fresh[i].hash;
+        }
+        else
+        {
+            TS_set_member(globals, fresh[i].name, reload->env.function_value(fresh[i].func));
+
+            reload->functions = (reload_function_t*) realloc(reload->functions,
+                    (reload->num_functions + 1) * sizeof(reload_function_t));
+            reload->functions[reload->num_functions++] = fresh[i];
+        }
+
+        count++;
+    }
+
+    free(fresh);
+
+    /* the script holds the replaced bodies and the names of added functions from now on */
+    if (count > 0)
+    {
+        reload->scripts = (AstNode_t**) realloc(reload->scripts, (reload->num_scripts + 1) * sizeof(AstNode_t*));
+        reload->scripts[reload->num_scripts++] = script;
+
+        fprintf(stderr, "tinyscript: reloaded %d function(s) from `%s`\n", count, reload->filename);
+    }
+    else
+        ast_release_node(&script);
+
+    return count;
+}
+
+void reload_release(reload_t** reload_p)
+{
+    size_t i;
+
+    if (*reload_p == NULL)
+        return;
+
+#ifdef __linux__
+    close((*reload_p)->fd);
+#endif
+
+    for (i = 0; i < (*reload_p)->num_scripts; i++)
+        ast_release_node(&(*reload_p)->scripts[i]);
+
+    free((*reload_p)->scripts);
+    free((*reload_p)->functions);
+    free((*reload_p)->filename);
+
+    free(*reload_p);
+    *reload_p = NULL;
+}
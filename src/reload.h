@@ -0,0 +1,36 @@
+#pragma once
+
+#include <tsval.h>
+
+#include "parse.h"
+
+typedef struct reload reload_t;
+
+typedef struct
+{
+    /* finalizes a freshly parsed script */
+    void (*prepare)(AstNode_t* script);
+
+    /* gives 'live' the arguments, body and tier-up state of 'fresh' and vice versa, so that existing values of the
+       function run the new code */
+    void (*swap_function)(AstNode_t* live, AstNode_t* fresh);
+
+    /* returns a new reference to the value of an SN_FUNCTION node */
+    TS_Val (*function_value)(AstNode_t* func);
+
+    /* parse() flags to reload with */
+    int flags;
+}
+reload_env_t;
+
+/* starts watching the source of 'script', which must not be finalized yet; returns NULL if the file can't be
+   watched (or on platforms without inotify) */
+reload_t* reload_watch(const char* filename, AstNode_t* script, const reload_env_t* env);
+
+/* if the file has changed, re-parses it and swaps in the top-level functions that differ, adding new ones to
+   'globals'. never blocks; returns the number of functions replaced or added, or -1 if the new source fails to
+   parse (the old code stays in place) */
+int reload_poll(reload_t* reload, TS_Val globals);
+
+/* releases the watch and every script parsed for a reload */
+void reload_release(reload_t** reload_p);
@@ -0,0 +1,649 @@
+/*
+ *  Heap snapshots
+ *
+ *  A snapshot is the globals object of a finished script with everything reachable from it, written as a tree of
+ *  tagged values in depth-first order. Lists, objects, strings and natives get an id when they are first written and
+ *  later occurrences refer back to it, which keeps shared values shared and makes cycles representable. Values that
+ *  can't outlive the process (objects wrapping a native such as open files, natives without a serialize hook,
+ *  functions from loaded modules) are stored as null with a warning.
+ *
+ *  Script function values are stored as the pre-order position of their SN_FUNCTION node, so a snapshot is tied to
+ *  the exact script it was taken from; the header records its name, length and hash.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC      0x4e535354      /* "TSSN" */
+#define SNAPSHOT_VERSION    1
+
+enum { V_NULL, V_BOOL, V_FLOAT, V_INT, V_STRING, V_LIST, V_OBJECT, V_NATIVEFUNC, V_FUNCTION, V_NATIVE, V_REF };
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version, reserved;
+    uint32_t script_length;
+    uint64_t script_hash;
+}
+snapshot_header_t;
+
+typedef struct
+{
+    const char* type_name;
+    TS_Val (*deserialize)(FILE* f);
+}
+native_type_t;
+
+static native_type_t* native_types;
+static size_t num_native_types;
+
+/* pointer -> index; used for the ids of written values and the positions of function nodes */
+typedef struct
+{
+    const void** keys;
+    uint32_t* values;
+    size_t count, num_slots;
+}
+ptr_map_t;
+
+static size_t ptr_hash(const void* key, size_t num_slots)
+{
+    return (size_t) (((uintptr_t) key >> 3) * 0x9E3779B1u) & (num_slots - 1);
+}
+
+static int ptr_map_get(const ptr_map_t* map, const void* key, uint32_t* value_out)
+{
+    size_t slot;
+
+    if (map->num_slots == 0)
+        return 0;
+
+    for (slot = ptr_hash(key, map->num_slots); map->keys[slot] != NULL; slot = (slot + 1) & (map->num_slots - 1))
+        if (map->keys[slot] == key)
+        {
+            *value_out = map->values[slot];
+            return 1;
+        }
+
+    return 0;
+}
+
+static void ptr_map_put(ptr_map_t* map, const void* key, uint32_t value)
+{
+    size_t slot, i;
+
+    if ((map->count + 1) * 2 > map->num_slots)
+    {
+        ptr_map_t old;
+
+        old = *map;
+
+        map->num_slots = (old.num_slots == 0) ? 64 : old.num_slots * 2;
+        map->keys = (const void**) calloc(map->num_slots, sizeof(void*));
+        map->values = (uint32_t*) malloc(map->num_slots * sizeof(uint32_t));
+        map->count = 0;
+
+        for (i = 0; i < old.num_slots; i++)
+            if (old.keys[i] != NULL)
+                ptr_map_put(map, old.keys[i], old.values[i]);
+
+        free(old.keys);
+        free(old.values);
+    }
+
+    for (slot = ptr_hash(key, map->num_slots); map->keys[slot] != NULL; slot = (slot + 1) & (map->num_slots - 1))
+        ;
+
+    map->keys[slot] = key;
+    map->values[slot] = value;
+    map->count++;
+}
+
+static void ptr_map_release(ptr_map_t* map)
+{
+    free(map->keys);
+    free(map->values);
+}
+
+/* numbers the SN_FUNCTION nodes of the script in pre-order */
+static void collect_functions(AstNode_t* node, AstNode_t*** functions, uint32_t* num_functions)
+{
+    size_t i;
+
+    if (node == NULL)
+        return;
+
+    if (node->name == SN_FUNCTION)
+    {
+        *functions = (AstNode_t**) realloc(*functions, (*num_functions + 1) * sizeof(AstNode_t*));
+        (*functions)[(*num_functions)++] = node;
+    }
+
+    collect_functions(node->left, functions, num_functions);
+    collect_functions(node->right, functions, num_functions);
+
+    for (i = 0; i < node->children_num; i++)
+        collect_functions(node->children[i], functions, num_functions);
+}
+
+static int hash_script(const char* script_name, uint32_t* length_out, uint64_t* hash_out)
+{
+    Tfsource_t source;
+    size_t i;
+    uint64_t hash;
+
+    if (tf_source_open(&source, script_name) != 0)
+        return -1;
+
+    hash = 0xcbf29ce484222325ULL;
+
+    for (i = 0; i < source.length; i++)
+        hash = (hash ^ (uint8_t) source.text[i]) * 0x100000001b3ULL;
+
+    *length_out = (uint32_t) source.length;
+    *hash_out = hash;
+
+    tf_source_close(&source);
+    return 0;
+}
+
+static const char* script_name(const snapshot_env_t* env)
+{
+    return ((ast_properties_t*) env->script->cust_data)->file_name;
+}
+
+/******************************************************************************/
+
+typedef struct
+{
+    const snapshot_env_t* env;
+    FILE* f;
+
+    ptr_map_t ids, functions;
+    uint32_t num_ids;
+
+    int failed;
+}
+writer_t;
+
+static void write_u8(writer_t* w, uint8_t value)
+{
+    fwrite(&value, 1, 1, w->f);
+}
+
+static void write_u32(writer_t* w, uint32_t value)
+{
+    fwrite(&value, 4, 1, w->f);
+}
+
+static void write_bytes(writer_t* w, const void* bytes, uint32_t num_bytes)
+{
+    write_u32(w, num_bytes);
+    fwrite(bytes, 1, num_bytes, w->f);
+}
+
+static void write_null(writer_t* w, const char* what)
+{
+    printf("Warning: snapshot: %s can't be stored, writing null\n", what);
+    write_u8(w, V_NULL);
+}
+
+static void write_value(writer_t* w, TS_Val val)
+{
+    const void* heap;
+    uint32_t id;
+    size_t i;
+
+    heap = NULL;
+
+    switch (val.type)
+    {
+        case TS_LIST: heap = val.list; break;
+        case TS_NATIVE: heap = val.native; break;
+        case TS_OBJECT: heap = val.object; break;
+        case TS_STRING: heap = val.string; break;
+    }
+
+    if (heap != NULL && ptr_map_get(&w->ids, heap, &id))
+    {
+        write_u8(w, V_REF);
+        write_u32(w, id);
+        return;
+    }
+
+    switch (val.type)
+    {
+        case TS_NULL:
+            write_u8(w, V_NULL);
+            return;
+
+        case TS_BOOL:
+        case TS_INT:
+            write_u8(w, (val.type == TS_BOOL) ? V_BOOL : V_INT);
+            write_u32(w, (uint32_t) val.intval);
+            return;
+
+        case TS_FLOAT:
+            write_u8(w, V_FLOAT);
+            fwrite(&val.floatval, sizeof(float), 1, w->f);
+            return;
+
+        case TS_NATIVEFUNC:
+            /* TS_native_function converts the pointer the same way it did when the value was made */
+            for (i = 0; i < w->env->num_native_funcs; i++)
+                if (TS_native_function(w->env->native_funcs[i].func).native_func == val.native_func)
+                {
+                    write_u8(w, V_NATIVEFUNC);
+                    write_bytes(w, w->env->native_funcs[i].name, strlen(w->env->native_funcs[i].name));
+                    return;
+                }
+
+            write_null(w, "native function from a module");
+            return;
+
+        case TS_NATIVE:
+            if (ptr_map_get(&w->functions, val.native->cust_data, &id) && strcmp(val.native->type_name, "TS.FunctionNodeRef") == 0)
+            {
+                write_u8(w, V_FUNCTION);
+                write_u32(w, id);
+                return;
+            }
+
+            if (val.native->serialize == NULL)
+            {
+                write_null(w, val.native->type_name);
+                return;
+            }
+
+            ptr_map_put(&w->ids, heap, w->num_ids++);
+            write_u8(w, V_NATIVE);
+            write_bytes(w, val.native->type_name, strlen(val.native->type_name));
+
+            if (val.native->serialize(val, w->f) != 0)
+                w->failed = 1;
+
+            return;
+
+        case TS_STRING:
+            ptr_map_put(&w->ids, heap, w->num_ids++);
+            write_u8(w, V_STRING);
+            write_bytes(w, val.string->bytes, val.string->num_bytes);
+            return;
+
+        case TS_LIST:
+            ptr_map_put(&w->ids, heap, w->num_ids++);
+            write_u8(w, V_LIST);
+            write_u32(w, val.list->num_items);
+
+            for (i = 0; i < val.list->num_items; i++)
+                write_value(w, val.list->items[i]);
+
+            return;
+
+        case TS_OBJECT:
+            if (val.object->native != NULL)
+            {
+                write_null(w, val.object->native->type_name);
+                return;
+            }
+
+            ptr_map_put(&w->ids, heap, w->num_ids++);
+            write_u8(w, V_OBJECT);
+            write_u32(w, val.object->num_members);
+
+            for (i = 0; i < val.object->num_members; i++)
+            {
+                write_value(w, val.object->members[i].key);
+                write_value(w, val.object->members[i].val);
+            }
+
+            return;
+    }
+
+    write_null(w, "value");
+}
+
+int snapshot_write(const char* filename, const snapshot_env_t* env, TS_Val globals)
+{
+    snapshot_header_t header;
+    writer_t w;
+    AstNode_t** functions;
+    uint32_t num_functions, i;
+    int rc;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+
+    if (hash_script(script_name(env), &header.script_length, &header.script_hash) != 0)
+        return -1;
+
+    w.f = fopen(filename, "wb");
+
+    if (w.f == NULL)
+        return -1;
+
+    w.env = env;
+    memset(&w.ids, 0, sizeof(w.ids));
+    memset(&w.functions, 0, sizeof(w.functions));
+    w.num_ids = 0;
+    w.failed = 0;
+
+    functions = NULL;
+    num_functions = 0;
+    collect_functions(env->script, &functions, &num_functions);
+
+    for (i = 0; i < num_functions; i++)
+        ptr_map_put(&w.functions, functions[i], i);
+
+    fwrite(&header, sizeof(header), 1, w.f);
+    write_bytes(&w, script_name(env), strlen(script_name(env)));
+    write_value(&w, globals);
+
+    rc = (w.failed || ferror(w.f)) ? -1 : 0;
+
+    if (fclose(w.f) != 0)
+        rc = -1;
+
+    free(functions);
+    ptr_map_release(&w.ids);
+    ptr_map_release(&w.functions);
+    return rc;
+}
+
+/******************************************************************************/
+
+typedef struct
+{
+    const snapshot_env_t* env;
+    FILE* f;
+
+    AstNode_t** functions;
+    uint32_t num_functions;
+
+    /* borrowed; every value in here is also owned by its container */
+    TS_Val* values;
+    uint32_t num_values;
+}
+reader_t;
+
+static int read_u32(reader_t* r, uint32_t* value_out)
+{
+    return (fread(value_out, 4, 1, r->f) == 1) ? 0 : -1;
+}
+
+/* reads a length-prefixed byte string and terminates it */
+static uint8_t* read_bytes(FILE* f, uint32_t* num_bytes_out)
+{
+    uint32_t num_bytes;
+    uint8_t* bytes;
+
+    if (fread(&num_bytes, 4, 1, f) != 1 || (bytes = (uint8_t*) malloc((size_t) num_bytes + 1)) == NULL)
+        return NULL;
+
+    if (fread(bytes, 1, num_bytes, f) != num_bytes)
+    {
+        free(bytes);
+        return NULL;
+    }
+
+    bytes[num_bytes] = 0;
+    *num_bytes_out = num_bytes;
+    return bytes;
+}
+
+static void add_value(reader_t* r, TS_Val val)
+{
+    r->values = (TS_Val*) realloc(r->values, (r->num_values + 1) * sizeof(TS_Val));
+    r->values[r->num_values++] = val;
+}
+
+static int read_value(reader_t* r, TS_Val* val_out)
+{
+    uint8_t tag;
+    uint32_t value, count, i;
+    uint8_t* bytes;
+    TS_Val val, key;
+
+    if (fread(&tag, 1, 1, r->f) != 1)
+        return -1;
+
+    switch (tag)
+    {
+        case V_NULL:
+            *val_out = TS_null();
+            return 0;
+
+        case V_BOOL:
+        case V_INT:
+            if (read_u32(r, &value) != 0)
+                return -1;
+
+            *val_out = (tag == V_BOOL) ? TS_bool((int) value) : TS_int((int) value);
+            return 0;
+
+        case V_FLOAT:
+        {
+            float floatval;
+
+            if (fread(&floatval, sizeof(float), 1, r->f) != 1)
+                return -1;
+
+            *val_out = TS_float(floatval);
+            return 0;
+        }
+
+        case V_REF:
+            if (read_u32(r, &value) != 0 || value >= r->num_values)
+                return -1;
+
+            *val_out = TS_reference(r->values[value]);
+            return 0;
+
+        case V_FUNCTION:
+            if (read_u32(r, &value) != 0 || value >= r->num_functions)
+                return -1;
+
+            *val_out = r->env->function_value(r->functions[value]);
+            return 0;
+
+        case V_NATIVEFUNC:
+            if ((bytes = read_bytes(r->f, &count)) == NULL)
+                return -1;
+
+            for (i = 0; i < r->env->num_native_funcs; i++)
+                if (strcmp(r->env->native_funcs[i].name, (const char*) bytes) == 0)
+                    break;
+
+            free(bytes);
+
+            if (i == r->env->num_native_funcs)
+                return -1;
+
+            *val_out = TS_native_function(r->env->native_funcs[i].func);
+            return 0;
+
+        case V_NATIVE:
+            if ((bytes = read_bytes(r->f, &count)) == NULL)
+                return -1;
+
+            for (i = 0; i < num_native_types; i++)
+                if (strcmp(native_types[i].type_name, (const char*) bytes) == 0)
+                    break;
+
+            free(bytes);
+
+            if (i == num_native_types)
+                return -1;
+
+            val = native_types[i].deserialize(r->f);
+
+            if (val.type != TS_NATIVE)
+            {
+                TS_rlsvalue(val);
+                return -1;
+            }
+
+            add_value(r, val);
+            *val_out = val;
+            return 0;
+
+        case V_STRING:
+            if ((bytes = read_bytes(r->f, &count)) == NULL)
+                return -1;
+
+            val = TS_create_string_using(bytes, count);
+            add_value(r, val);
+            *val_out = val;
+            return 0;
+
+        case V_LIST:
+            if (read_u32(r, &count) != 0)
+                return -1;
+
+            /* registered before the items are read, so that they can refer back to it */
+            val = TS_create_list(0);
+            add_value(r, val);
+
+            for (i = 0; i < count; i++)
+            {
+                TS_Val item;
+
+                if (read_value(r, &item) != 0)
+                    goto error;
+
+                TS_add_item(val.list, item);
+            }
+
+            *val_out = val;
+            return 0;
+
+        case V_OBJECT:
+            if (read_u32(r, &count) != 0)
+                return -1;
+
+            val = TS_create_object(4);
+            add_value(r, val);
+
+            for (i = 0; i < count; i++)
+            {
+                TS_Val member;
+
+                if (read_value(r, &key) != 0)
+                    goto error;
+
+                if (read_value(r, &member) != 0)
+                {
+                    TS_rlsvalue(key);
+                    goto error;
+                }
+
+                TS_set_entry(val, key, member);
+            }
+
+            *val_out = val;
+            return 0;
+    }
+
+    return -1;
+
+error:
+    /* releases whatever was read into it; nothing reads r->values after a failure */
+    TS_rlsvalue(val);
+    return -1;
+}
+
+static FILE* open_snapshot(const char* filename, snapshot_header_t* header, char** script_name_out)
+{
+    FILE* f;
+    uint32_t length;
+
+    f = fopen(filename, "rb");
+
+    if (f == NULL)
+        return NULL;
+
+    if (fread(header, sizeof(snapshot_header_t), 1, f) != 1 || header->magic != SNAPSHOT_MAGIC
+            || header->version != SNAPSHOT_VERSION || (*script_name_out = (char*) read_bytes(f, &length)) == NULL)
+    {
+        fclose(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+char* snapshot_script_name(const char* filename)
+{
+    snapshot_header_t header;
+    char* name;
+    FILE* f;
+
+    f = open_snapshot(filename, &header, &name);
+
+    if (f == NULL)
+        return NULL;
+
+    fclose(f);
+    return name;
+}
+
+TS_Val snapshot_read(const char* filename, const snapshot_env_t* env)
+{
+    snapshot_header_t header;
+    reader_t r;
+    uint32_t length;
+    uint64_t hash;
+    char* name;
+    TS_Val globals;
+
+    r.f = open_snapshot(filename, &header, &name);
+
+    if (r.f == NULL)
+        return TS_null();
+
+    free(name);
+
+    if (hash_script(script_name(env), &length, &hash) != 0 || length != header.script_length || hash != header.script_hash)
+    {
+        printf("Warning: snapshot: `%s` has changed since the snapshot was taken\n", script_name(env));
+        fclose(r.f);
+        return TS_null();
+    }
+
+    r.env = env;
+    r.functions = NULL;
+    r.num_functions = 0;
+    r.values = NULL;
+    r.num_values = 0;
+
+    collect_functions(env->script, &r.functions, &r.num_functions);
+
+    if (read_value(&r, &globals) != 0)
+        globals = TS_null();
+    else if (globals.type != TS_OBJECT || fgetc(r.f) != EOF)
+    {
+        TS_rlsvalue(globals);
+        globals = TS_null();
+    }
+
+    if (globals.type == TS_NULL)
+        printf("Warning: snapshot: `%s` is damaged\n", filename);
+
+    fclose(r.f);
+    free(r.functions);
+    free(r.values);
+    return globals;
+}
+
+void snapshot_add_native_type(const char* type_name, TS_Val (*deserialize)(FILE* f))
+{
+    native_types = (native_type_t*) realloc(native_types, (num_native_types + 1) * sizeof(native_type_t));
+    native_types[num_native_types].type_name = type_name;
+    native_types[num_native_types].deserialize = deserialize;
+    num_native_types++;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdio.h>
+#include <tsval.h>
+
+#include "parse.h"
+
+typedef struct
+{
+    const char* name;
+    TS_NativeFunction_t func;
+}
+snapshot_native_func_t;
+
+typedef struct
+{
+    /* the finalized script the snapshot is taken from or restored into; script function values are stored as the
+       position of their SN_FUNCTION node, so it must have been parsed without PARSE_LAZY */
+    AstNode_t* script;
+
+    /* returns a new reference to the value of an SN_FUNCTION node of 'script' */
+    TS_Val (*function_value)(AstNode_t* func);
+
+    /* native functions are stored by name */
+    const snapshot_native_func_t* native_funcs;
+    size_t num_native_funcs;
+}
+snapshot_env_t;
+
+/* writes everything reachable from 'globals'; returns 0 on success */
+int snapshot_write(const char* filename, const snapshot_env_t* env, TS_Val globals);
+
+/* the name of the script a snapshot was taken from (to be released with free), or NULL if it's not a snapshot */
+char* snapshot_script_name(const char* filename);
+
+/* restores the globals of a snapshot; returns TS_null() if it can't be read or the script has changed since */
+TS_Val snapshot_read(const char* filename, const snapshot_env_t* env);
+
+/* natives are written by their TS_Native::serialize hook and recreated by the function registered for their type */
+void snapshot_add_native_type(const char* type_name, TS_Val (*deserialize)(FILE* f));
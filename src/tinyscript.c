@@ -1,4 +1,5 @@
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -7,7 +8,12 @@
 #include <crtdbg.h>
 #endif
 
+#include "image.h"
+#include "infer.h"
+#include "jit.h"
 #include "parse.h"
+#include "reload.h"
+#include "snapshot.h"
 #include <tinyapi.h>
 
 #include <parse_args.h>
@@ -24,7 +30,16 @@ void *alloca(size_t size);
 #endif
 
 #ifdef _WIN32
+#include <io.h>
 #include <windows.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 typedef struct
@@ -51,6 +66,9 @@ TS_Val TS_func_load_module(TS_CallContext *ctx, TS_Val* arguments, size_t num_ar
 #ifdef _WIN32
     char path[MAX_PATH];
     HMODULE library;
+#else
+    char path[256];
+    void* library;
 #endif
 
     if (num_arguments != 1 || arguments[0].type != TS_STRING)
@@ -78,10 +96,127 @@ TS_Val TS_func_load_module(TS_CallContext *ctx, TS_Val* arguments, size_t num_ar
         return TS_null();
     }
 
+    return entry(arguments[0].string->bytes, ctx->globals);
+#else
+    snprintf(path, sizeof(path), "./module_%s.so", arguments[0].string->bytes);
+
+    library = dlopen(path, RTLD_NOW);
+
+    if (library == NULL)
+    {
+        printf("Warning: failed to open `%s`\n", path);
+        return TS_null();
+    }
+
+    entry = (TS_ModuleEntry_t) dlsym(library, "TS_ModuleEntry");
+
+    if (entry == NULL)
+    {
+        printf("Warning: failed to load module `%s`\n", arguments[0].string->bytes);
+        return TS_null();
+    }
+
     return entry(arguments[0].string->bytes, ctx->globals);
 #endif
 }
 
+static const char* TS_Range_type_name = "TS.Range";
+
+typedef struct
+{
+    int start, end, step;
+}
+range_cust_data;
+
+static void release_range(TS_Val val)
+{
+    free(val.native->cust_data);
+}
+
+static void print_range(TS_Val val)
+{
+    range_cust_data *range;
+
+    range = (range_cust_data *) val.native->cust_data;
+    printf("range(%i, %i, %i)", range->start, range->end, range->step);
+}
+
+static int serialize_range(TS_Val val, FILE* f)
+{
+    range_cust_data *range;
+    int32_t fields[3];
+
+    range = (range_cust_data *) val.native->cust_data;
+    fields[0] = range->start;
+    fields[1] = range->end;
+    fields[2] = range->step;
+
+    return (fwrite(fields, sizeof(fields), 1, f) == 1) ? 0 : -1;
+}
+
+static TS_Val create_range(range_cust_data *range)
+{
+    TS_Val val;
+
+    val = TS_create_native(TS_Range_type_name, range, release_range);
+    val.native->printvalue = print_range;
+    val.native->serialize = serialize_range;
+    return val;
+}
+
+static TS_Val deserialize_range(FILE* f)
+{
+    range_cust_data *range;
+    int32_t fields[3];
+
+    if (fread(fields, sizeof(fields), 1, f) != 1 || fields[2] == 0)
+        return TS_null();
+
+    range = (range_cust_data *) malloc(sizeof(range_cust_data));
+    range->start = fields[0];
+    range->end = fields[1];
+    range->step = fields[2];
+
+    return create_range(range);
+}
+
+// TS> Range range([int start,] int end [, int step])
+TS_Val TS_func_range(TS_CallContext *ctx, TS_Val* arguments, size_t num_arguments)
+{
+    range_cust_data *range;
+    size_t i;
+
+    if (num_arguments < 1 || num_arguments > 3)
+        return TS_null();
+
+    for (i = 0; i < num_arguments; i++)
+        if (!TS_IS_NUMERIC(arguments[i]))
+            return TS_null();
+
+    range = (range_cust_data *) malloc(sizeof(range_cust_data));
+
+    if (num_arguments == 1)
+    {
+        range->start = 0;
+        range->end = TS_NUMERIC_AS_INT(arguments[0]);
+    }
+    else
+    {
+        range->start = TS_NUMERIC_AS_INT(arguments[0]);
+        range->end = TS_NUMERIC_AS_INT(arguments[1]);
+    }
+
+    range->step = (num_arguments == 3) ? TS_NUMERIC_AS_INT(arguments[2]) : 1;
+
+    if (range->step == 0)
+    {
+        free(range);
+        return TS_null();
+    }
+
+    return create_range(range);
+}
+
 TS_Val TS_func_say(TS_CallContext *ctx, TS_Val* arguments, size_t num_arguments)
 {
     size_t i;
@@ -103,52 +238,273 @@ TS_Val TS_func_say(TS_CallContext *ctx, TS_Val* arguments, size_t num_arguments)
 
 static const char* TS_File_type_name = "TS.File";
 
+#define FILE_BUFFER_SIZE    65536
+
+/* lines are found in a buffer that is refilled with fread, or in the whole file if it could be mapped */
+typedef struct
+{
+    FILE* file;
+    int release;
+
+    const char* data;
+    size_t begin, end;
+
+    char* buffer;
+    size_t capacity;
+    int mapped;
+}
+file_cust_data;
+
 static void release_file(TS_Val val)
 {
-    fclose((FILE*) val.object->native->cust_data);
+    file_cust_data *cust_data;
+
+    cust_data = (file_cust_data *) val.object->native->cust_data;
+
+#ifndef _WIN32
+    if (cust_data->mapped)
+        munmap((void*) cust_data->data, cust_data->end);
+#endif
+
+    if (cust_data->release)
+        fclose(cust_data->file);
+
+    free(cust_data->buffer);
+    free(cust_data);
 }
 
-static FILE* unwrap_file(TS_Val val)
+static file_cust_data* unwrap_file(TS_Val val)
 {
     if (val.type != TS_OBJECT || val.object->native == NULL || val.object->native->type_name != TS_File_type_name)
         return NULL;
 
-    return (FILE*) val.object->native->cust_data;
+    return (file_cust_data*) val.object->native->cust_data;
+}
+
+/* keeps the unread bytes and appends more from the file, growing the buffer if it's full; returns the number of
+   bytes added */
+static size_t fill_buffer(file_cust_data* file)
+{
+    size_t num_read;
+
+    if (file->mapped)
+        return 0;
+
+    if (file->begin > 0)
+    {
+        memmove(file->buffer, file->buffer + file->begin, file->end - file->begin);
+        file->end -= file->begin;
+        file->begin = 0;
+    }
+
+    if (file->end == file->capacity)
+    {
+        file->capacity = (file->capacity == 0) ? FILE_BUFFER_SIZE : (file->capacity * 2);
+        file->buffer = (char*) realloc(file->buffer, file->capacity);
+    }
+
+    num_read = fread(file->buffer + file->end, 1, file->capacity - file->end, file->file);
+    file->data = file->buffer;
+    file->end += num_read;
+    return num_read;
+}
+
+static TS_Val read_line(file_cust_data* file)
+{
+    const char* newline;
+    size_t scanned, length;
+    uint8_t* bytes;
+
+    scanned = 0;
+
+    /* only what was appended since the last search is searched again */
+    while ((newline = (const char*) memchr(file->data + file->begin + scanned, '\n',
+            file->end - file->begin - scanned)) == NULL)
+    {
+        scanned = file->end - file->begin;
+
+        if (fill_buffer(file) == 0)
+            break;
+    }
+
+    if (newline == NULL && file->begin == file->end)
+        return TS_null();
+
+    length = (newline != NULL) ? (size_t) (newline - (file->data + file->begin)) : (file->end - file->begin);
+
+    /* strings own their (null-terminated) bytes, so the line is copied once, at its final size */
+    bytes = (uint8_t*) malloc(length + 1);
+    memcpy(bytes, file->data + file->begin, length);
+    bytes[length] = 0;
+
+    file->begin += (newline != NULL) ? (length + 1) : length;
+
+    return TS_create_string_using(bytes, length);
+}
+
+/* the bytes of a regular file past the stdio position; 0 if that can't be told up front (pipes, devices, and
+   files that are empty or claim to be) */
+static size_t unread_size(file_cust_data* file)
+{
+#ifndef _WIN32
+    struct stat st;
+    long position;
+
+    if (fstat(fileno(file->file), &st) != 0 || !S_ISREG(st.st_mode) || (position = ftell(file->file)) < 0
+            || st.st_size <= (off_t) position)
+        return 0;
+
+    return (size_t) (st.st_size - position);
+#else
+    return 0;
+#endif
+}
+
+/* up to 'limit' bytes as one string: straight from the mapping, or what is buffered followed by reads into the
+   string itself; those are a single fread if the size of the file is known, and chunks that grow otherwise */
+static TS_Val read_bytes(file_cust_data* file, size_t limit)
+{
+    size_t length, capacity, size, wanted, num_read;
+    uint8_t* bytes;
+
+    length = (file->end - file->begin < limit) ? (file->end - file->begin) : limit;
+    capacity = length;
+
+    if (!file->mapped && length < limit)
+    {
+        /* one byte more than the rest of the file, so that the first read already comes up short at the end */
+        if ((size = unread_size(file)) > 0)
+            capacity = (limit - length <= size) ? limit : (length + size + 1);
+        else
+            capacity = (limit - length < FILE_BUFFER_SIZE) ? limit : (length + FILE_BUFFER_SIZE);
+    }
+
+    bytes = (uint8_t*) malloc(capacity + 1);
+    memcpy(bytes, file->data + file->begin, length);
+    file->begin += length;
+
+    if (!file->mapped)
+        while (length < limit)
+        {
+            if (length == capacity)
+            {
+                capacity = (limit - capacity < capacity) ? limit : (capacity * 2);
+                bytes = (uint8_t*) realloc(bytes, capacity + 1);
+            }
+
+            wanted = capacity - length;
+            num_read = fread(bytes + length, 1, wanted, file->file);
+            length += num_read;
+
+            /* fread only comes up short at the end of the file (or on an error) */
+            if (num_read < wanted)
+                break;
+        }
+
+    bytes[length] = 0;
+    return TS_create_string_using(bytes, length);
+}
+
+static int next_line(TS_Val val, TS_Val* item_out)
+{
+    file_cust_data *file;
+
+    file = unwrap_file(val);
+
+    if (file == NULL)
+        return 0;
+
+    *item_out = read_line(file);
+    return item_out->type != TS_NULL;
 }
 
 TS_Val TS_func_File_read_line(TS_CallContext *ctx, TS_Val* arguments, size_t num_arguments)
 {
-    FILE *file;
-    static char buffer[2000];
-    int num;
+    file_cust_data *file;
+
+    (void) arguments;
 
     file = unwrap_file(ctx->me);
 
     if (file == NULL || num_arguments != 0)
         return TS_null();
 
-    /* TODO: buffer */
-    if (!fgets(buffer, sizeof(buffer), file))
+    return read_line(file);
+}
+
+// TS> String File.read_all()
+TS_Val TS_func_File_read_all(TS_CallContext *ctx, TS_Val* arguments, size_t num_arguments)
+{
+    file_cust_data *file;
+
+    (void) arguments;
+
+    file = unwrap_file(ctx->me);
+
+    if (file == NULL || num_arguments != 0)
+        return TS_null();
+
+    return read_bytes(file, SIZE_MAX);
+}
+
+// TS> String File.read_bytes(int count)
+TS_Val TS_func_File_read_bytes(TS_CallContext *ctx, TS_Val* arguments, size_t num_arguments)
+{
+    file_cust_data *file;
+    TS_Val bytes;
+
+    file = unwrap_file(ctx->me);
+
+    if (file == NULL || num_arguments != 1 || !TS_IS_NUMERIC(arguments[0]) || TS_NUMERIC_AS_INT(arguments[0]) <= 0)
+        return TS_null();
+
+    bytes = read_bytes(file, (size_t) TS_NUMERIC_AS_INT(arguments[0]));
+
+    /* so that 'while (chunk = f.read_bytes(n))' ends */
+    if (bytes.string->num_bytes == 0)
+    {
+        TS_rlsvalue(bytes);
+        return TS_null();
+    }
+
+    return bytes;
+}
+
+// TS> File.write_raw(String str, ...)
+TS_Val TS_func_File_write_raw(TS_CallContext *ctx, TS_Val* arguments, size_t num_arguments)
+{
+    file_cust_data *file;
+    size_t i;
+
+    file = unwrap_file(ctx->me);
+
+    if (file == NULL)
         return TS_null();
 
-    num = strlen(buffer);
+    for (i = 0; i < num_arguments; i++)
+        if (arguments[i].type != TS_STRING)
+            return TS_null();
 
-    if (num > 0 && buffer[num - 1] == '\n')
-        buffer[num - 1] = 0;
+    /* unlike write, no formatting and no separators */
+    for (i = 0; i < num_arguments; i++)
+        fwrite(arguments[i].string->bytes, 1, arguments[i].string->num_bytes, file->file);
 
-    return TS_create_string(buffer);
+    return TS_int(0);
 }
 
 TS_Val TS_func_File_write(TS_CallContext *ctx, TS_Val* arguments, size_t num_arguments)
 {
+    file_cust_data *cust_data;
     FILE *file;
     size_t i;
 
-    file = unwrap_file(ctx->me);
+    cust_data = unwrap_file(ctx->me);
 
-    if (file == NULL)
+    if (cust_data == NULL)
         return TS_null();
 
+    file = cust_data->file;
+
     for (i = 0; i < num_arguments; i++)
     {
         if (arguments[i].type == TS_STRING)
@@ -166,17 +522,60 @@ TS_Val TS_func_File_write(TS_CallContext *ctx, TS_Val* arguments, size_t num_arg
     return TS_int(0);
 }
 
-static TS_Val wrap_file(FILE* file, int release)
+/* a regular file that is only read from is mapped whole */
+static void map_file(file_cust_data* cust_data)
+{
+#ifndef _WIN32
+    struct stat st;
+    void* map;
+
+    if (fstat(fileno(cust_data->file), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return;
+
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fileno(cust_data->file), 0);
+
+    if (map == MAP_FAILED)
+        return;
+
+#ifdef MADV_SEQUENTIAL
+    madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+#endif
+
+    cust_data->data = (const char*) map;
+    cust_data->end = (size_t) st.st_size;
+    cust_data->mapped = 1;
+#endif
+}
+
+static TS_Val wrap_file(FILE* file, int release, int map)
 {
+    file_cust_data *cust_data;
     TS_Val native;
 
     if (file == NULL)
         return TS_null();
 
+    cust_data = (file_cust_data *) malloc(sizeof(file_cust_data));
+    cust_data->file = file;
+    cust_data->release = release;
+    cust_data->data = "";
+    cust_data->begin = 0;
+    cust_data->end = 0;
+    cust_data->buffer = NULL;
+    cust_data->capacity = 0;
+    cust_data->mapped = 0;
+
+    if (map)
+        map_file(cust_data);
+
     native = TS_create_object(4);
-    native.object->native = TS_create_native_struct(TS_File_type_name, file, release ? release_file : NULL);
+    native.object->native = TS_create_native_struct(TS_File_type_name, cust_data, release_file);
+    native.object->native->next = next_line;
+    TS_set_member(native, "read_all", TS_native_function(TS_func_File_read_all));
+    TS_set_member(native, "read_bytes", TS_native_function(TS_func_File_read_bytes));
     TS_set_member(native, "read_line", TS_native_function(TS_func_File_read_line));
     TS_set_member(native, "write", TS_native_function(TS_func_File_write));
+    TS_set_member(native, "write_raw", TS_native_function(TS_func_File_write_raw));
     return native;
 }
 
@@ -185,7 +584,7 @@ TS_Val TS_func_create_file(TS_CallContext *ctx, TS_Val* arguments, size_t num_ar
     if (num_arguments != 1 || arguments[0].type != TS_STRING)
         return TS_null();
 
-    return wrap_file(fopen((const char *) arguments[0].string->bytes, "wb"), 1);
+    return wrap_file(fopen((const char *) arguments[0].string->bytes, "wb"), 1, 0);
 }
 
 TS_Val TS_func_open_file(TS_CallContext *ctx, TS_Val* arguments, size_t num_arguments)
@@ -193,7 +592,7 @@ TS_Val TS_func_open_file(TS_CallContext *ctx, TS_Val* arguments, size_t num_argu
     if (num_arguments != 1 || arguments[0].type != TS_STRING)
         return TS_null();
 
-    return wrap_file(fopen((const char *) arguments[0].string->bytes, "r"), 1);
+    return wrap_file(fopen((const char *) arguments[0].string->bytes, "r"), 1, 1);
 }
 
 // TS> String expand(String str, Object dictionary)
@@ -271,17 +670,89 @@ typedef struct
 }
 ident_cust_data;
 
+typedef struct
+{
+    TS_Val ref;
+
+    /* the SN_SCRIPT root, needed to parse and finalize a lazy body */
+    AstNode_t* script;
+
+    /* tier-up state */
+    unsigned num_calls;
+    jit_code_t* jit_code;
+}
+function_cust_data;
+
+typedef struct
+{
+    unsigned num_iterations;
+    jit_code_t* jit_code;
+}
+loop_cust_data;
+
+static int jit_enabled = 1;
+static int parse_flags = 0;
+static int use_cache = 0;
+static int watch_script = 0;
+static const char *image_filename = NULL;
+static const char *snapshot_filename = NULL;
+static const char *from_snapshot_filename = NULL;
+
 static void node_on_release_struct(AstNode_t* node)
 {
     free(node->cust_data);
 }
 
-static void node_on_release_tsval(AstNode_t* node)
+static void node_on_release_function(AstNode_t* node)
+{
+    function_cust_data *cust_data;
+
+    cust_data = (function_cust_data *) node->cust_data;
+
+    TS_rlsvalue(cust_data->ref);
+    jit_release(cust_data->jit_code);
+    free(cust_data);
+}
+
+static void node_on_release_loop(AstNode_t* node)
 {
-    TS_rlsvalue( *((TS_Val*) node->cust_data) );
+    jit_release(((loop_cust_data *) node->cust_data)->jit_code);
     free(node->cust_data);
 }
 
+TS_Val ast_invoke(TS_Val function, TS_Val me, TS_Val* arguments, size_t num_arguments, ast_context_t* context);
+
+/* follows an error message with where 'node' is in its script */
+static void print_location(const AstNode_t* node)
+{
+    AstNode_t* script;
+    int line, column;
+
+    script = ast_location(node, &line, &column);
+
+    if (script != NULL && script->name == SN_SCRIPT && script->cust_data != NULL)
+        printf("\t(%s, line %i, column %i)\n", ((ast_properties_t *) script->cust_data)->file_name, line, column + 1);
+    else
+        printf("\t(line %i)\n", line);
+
+    /* most of these are followed by abort() */
+    fflush(stdout);
+}
+
+/* TS_Native::invoke for script functions, so that native (and compiled) code can call back into scripts */
+static TS_Val ast_invoke_native(TS_Val function, TS_Val globals, TS_Val me, TS_Val* arguments, size_t num_arguments)
+{
+    ast_context_t context;
+
+    context.globals = globals;
+    context.locals = TS_null();
+    context.return_value = TS_null();
+    context.should_break = 0;
+    context.should_return = 0;
+
+    return ast_invoke(function, me, arguments, num_arguments, &context);
+}
+
 void ast_finalize(AstNode_t* node, ast_finalize_context_t* context)
 {
     size_t i;
@@ -312,10 +783,49 @@ void ast_finalize(AstNode_t* node, ast_finalize_context_t* context)
             break;
         }
 
+        /* superinstructions: fused forms of a few common statement shapes */
+        case SN_ASSIGN:
+            if (node->left->name == SN_MEMBER)
+                node->name = SN_MEMBER_STORE;
+            else if (node->left->name == SN_IDENT && node->right->name == SN_ADD
+                    && node->right->left->name == SN_IDENT && node->right->right->name == SN_INT
+                    && strcmp((const char*) node->left->token.text, (const char*) node->right->left->token.text) == 0)
+                node->name = SN_ADD_CONST_STORE;
+
+            break;
+
+        case SN_CALL:
+            /* the callee is looked up like any other name, locals first */
+            if (node->left->name == SN_IDENT)
+                node->name = SN_CALL_NAME;
+
+            break;
+
+        case SN_IF:
+            if (node->left->name == SN_EQUALS)
+                node->name = SN_IF_EQUALS;
+
+            break;
+
+        case SN_ITERATE:
+        case SN_WHILE:
+        {
+            loop_cust_data *cust_data;
+
+            cust_data = (loop_cust_data *) malloc(sizeof(loop_cust_data));
+            cust_data->num_iterations = 0;
+            cust_data->jit_code = NULL;
+
+            node->cust_data = cust_data;
+            node->on_release = node_on_release_loop;
+            break;
+        }
+
         case SN_MEMBER:
             if (node->right == NULL || node->right->name != SN_IDENT || node->right->token.text == NULL)
             {
                 printf("Validation error: right node of SN_MEMBER must be SN_IDENT\n");
+                print_location(node);
                 abort();
             }
 
@@ -323,7 +833,7 @@ void ast_finalize(AstNode_t* node, ast_finalize_context_t* context)
 
         case SN_FUNCTION:
         {
-            TS_Val obj;
+            function_cust_data *cust_data;
 
             /* validate argument list */
             if (node->right != NULL)
@@ -331,14 +841,19 @@ void ast_finalize(AstNode_t* node, ast_finalize_context_t* context)
                     if (node->right->children[i]->name != SN_IDENT || node->right->children[i]->token.text == NULL)
                     {
                         printf("Validation error: expected SN_IDENT in function argument declaration\n");
+                        print_location(node->right->children[i]);
                         abort();
                     }
 
-            obj = TS_create_native(TS_FunctionNodeRef_name, node, NULL);
+            cust_data = (function_cust_data *) malloc(sizeof(function_cust_data));
+            cust_data->ref = TS_create_native(TS_FunctionNodeRef_name, node, NULL);
+            cust_data->ref.native->invoke = ast_invoke_native;
+            cust_data->script = context->script;
+            cust_data->num_calls = 0;
+            cust_data->jit_code = NULL;
 
-            node->cust_data = malloc(sizeof(TS_Val));
-            memcpy(node->cust_data, &obj, sizeof(TS_Val));
-            node->on_release = node_on_release_tsval;
+            node->cust_data = cust_data;
+            node->on_release = node_on_release_function;
             break;
         }
     }
@@ -353,13 +868,103 @@ void ast_finalize(AstNode_t* node, ast_finalize_context_t* context)
         ast_finalize(node->children[i], context);
 }
 
-void ast_store_to(AstNode_t* node, ast_context_t* context, TS_Val val)
+/* replaces generic operators by their typed variants where the operand types are proven */
+static void ast_specialize_node(AstNode_t* node, const infer_result_t* types)
 {
-    /* remember to ALWAYS add a reference if the 'val' will be saved */
+    int left, right;
+    size_t i;
+
+    if (node == NULL || node->name == SN_FUNCTION)
+        return;
 
     switch (node->name)
     {
-        case SN_IDENT:
+        case SN_ADD:
+        case SN_DIVIDE:
+        case SN_EQUALS:
+        case SN_MULTIPLY:
+        case SN_NOT_EQUALS:
+        case SN_SUBTRACT:
+            if (node->left == NULL)
+                break;
+
+            left = infer_expression_type(types, node->left);
+            right = infer_expression_type(types, node->right);
+
+            if (left == TY_INT && right == TY_INT)
+            {
+                switch (node->name)
+                {
+                    case SN_ADD: node->name = SN_ADD_INT; break;
+                    case SN_EQUALS: node->name = SN_EQUALS_INT; break;
+                    case SN_MULTIPLY: node->name = SN_MULTIPLY_INT; break;
+                    case SN_NOT_EQUALS: node->name = SN_NOT_EQUALS_INT; break;
+                    case SN_SUBTRACT: node->name = SN_SUBTRACT_INT; break;
+                }
+            }
+            else if (left == TY_FLOAT && right == TY_FLOAT)
+            {
+                /* no float equality: TS_equals never considers floats equal */
+                switch (node->name)
+                {
+                    case SN_ADD: node->name = SN_ADD_FLOAT; break;
+                    case SN_DIVIDE: node->name = SN_DIVIDE_FLOAT; break;
+                    case SN_MULTIPLY: node->name = SN_MULTIPLY_FLOAT; break;
+                    case SN_SUBTRACT: node->name = SN_SUBTRACT_FLOAT; break;
+                }
+            }
+
+            break;
+    }
+
+    ast_specialize_node(node->left, types);
+    ast_specialize_node(node->right, types);
+
+    for (i = 0; i < node->children_num; i++)
+        ast_specialize_node(node->children[i], types);
+}
+
+static void ast_specialize_functions(AstNode_t* script, AstNode_t* node)
+{
+    infer_result_t types;
+    size_t i;
+
+    if (node == NULL)
+        return;
+
+    if (node->name == SN_FUNCTION)
+    {
+        infer_types(script, node, &types);
+        ast_specialize_node(node->children[0], &types);
+        infer_release(&types);
+    }
+
+    ast_specialize_functions(script, node->left);
+    ast_specialize_functions(script, node->right);
+
+    for (i = 0; i < node->children_num; i++)
+        ast_specialize_functions(script, node->children[i]);
+}
+
+/* type inference and specialization for the top-level code and every function of a finalized script */
+static void ast_specialize(AstNode_t* script)
+{
+    infer_result_t types;
+
+    infer_types(script, NULL, &types);
+    ast_specialize_node(script, &types);
+    infer_release(&types);
+
+    ast_specialize_functions(script, script);
+}
+
+void ast_store_to(AstNode_t* node, ast_context_t* context, TS_Val val)
+{
+    /* remember to ALWAYS add a reference if the 'val' will be saved */
+
+    switch (node->name)
+    {
+        case SN_IDENT:
         {
             TS_ObjectMember* member;
 
@@ -411,11 +1016,331 @@ void ast_store_to(AstNode_t* node, ast_context_t* context, TS_Val val)
 
         default:
             printf("Error: can't store to node type %i\n", node->name);
+            print_location(node);
     }
 }
 
+/* ast_eval dispatch: with TS_COMPUTED_GOTO (GCC/Clang labels-as-values) every node kind jumps straight to its
+   handler through a table; otherwise a plain switch is used. 'break' leaves the handler in both variants. */
+#if defined(TS_COMPUTED_GOTO) && defined(__GNUC__)
+#define AST_DISPATCH(node_)     switch (0) default: if (1) goto *ast_dispatch_table[(node_)->name]; else
+#define AST_CASE(name_)         op_##name_:
+#define AST_DEFAULT             op_default:
+
+#define AST_DISPATCH_TABLE      static const void* const ast_dispatch_table[] = {\
+        [SN_ADD] = &&op_SN_ADD,\
+        [SN_APPEND] = &&op_SN_APPEND,\
+        [SN_ASSIGN] = &&op_SN_ASSIGN,\
+        [SN_BIN_AND] = &&op_default,\
+        [SN_BIN_OR] = &&op_SN_BIN_OR,\
+        [SN_BLOCK] = &&op_SN_BLOCK,\
+        [SN_BREAK] = &&op_SN_BREAK,\
+        [SN_CALL] = &&op_SN_CALL,\
+        [SN_DIVIDE] = &&op_SN_DIVIDE,\
+        [SN_EQUALS] = &&op_SN_EQUALS,\
+        [SN_FALSE] = &&op_SN_FALSE,\
+        [SN_FUNCTION] = &&op_SN_FUNCTION,\
+        [SN_IDENT] = &&op_SN_IDENT,\
+        [SN_IF] = &&op_SN_IF,\
+        [SN_INDEX] = &&op_SN_INDEX,\
+        [SN_INT] = &&op_SN_INT,\
+        [SN_ITERATE] = &&op_SN_ITERATE,\
+        [SN_LAZY] = &&op_default,\
+        [SN_LIST] = &&op_SN_LIST,\
+        [SN_MEMBER] = &&op_SN_MEMBER,\
+        [SN_MULTIPLY] = &&op_SN_MULTIPLY,\
+        [SN_NOT] = &&op_SN_NOT,\
+        [SN_NOT_EQUALS] = &&op_SN_NOT_EQUALS,\
+        [SN_NULL] = &&op_SN_NULL,\
+        [SN_OBJECT] = &&op_SN_OBJECT,\
+        [SN_REAL] = &&op_SN_REAL,\
+        [SN_RETURN] = &&op_SN_RETURN,\
+        [SN_SCRIPT] = &&op_SN_SCRIPT,\
+        [SN_STRING] = &&op_SN_STRING,\
+        [SN_SUBTRACT] = &&op_SN_SUBTRACT,\
+        [SN_TRUE] = &&op_SN_TRUE,\
+        [SN_WHILE] = &&op_SN_WHILE,\
+\
+        [SN_ADD_CONST_STORE] = &&op_SN_ADD_CONST_STORE,\
+        [SN_CALL_NAME] = &&op_SN_CALL_NAME,\
+        [SN_IF_EQUALS] = &&op_SN_IF_EQUALS,\
+        [SN_MEMBER_STORE] = &&op_SN_MEMBER_STORE,\
+\
+        [SN_ADD_FLOAT] = &&op_SN_ADD_FLOAT,\
+        [SN_ADD_INT] = &&op_SN_ADD_INT,\
+        [SN_DIVIDE_FLOAT] = &&op_SN_DIVIDE_FLOAT,\
+        [SN_EQUALS_INT] = &&op_SN_EQUALS_INT,\
+        [SN_MULTIPLY_FLOAT] = &&op_SN_MULTIPLY_FLOAT,\
+        [SN_MULTIPLY_INT] = &&op_SN_MULTIPLY_INT,\
+        [SN_NOT_EQUALS_INT] = &&op_SN_NOT_EQUALS_INT,\
+        [SN_SUBTRACT_FLOAT] = &&op_SN_SUBTRACT_FLOAT,\
+        [SN_SUBTRACT_INT] = &&op_SN_SUBTRACT_INT\
+    };
+#else
+#define AST_DISPATCH(node_)     switch ((node_)->name)
+#define AST_CASE(name_)         case name_:
+#define AST_DEFAULT             default:
+
+#define AST_DISPATCH_TABLE
+#endif
+
+static TS_ObjectMember* ast_find_variable(AstNode_t* ident, ast_context_t* context)
+{
+    TS_ObjectMember* member;
+
+    member = TS_find_member(context->locals, (const char*) ident->token.text);
+
+    if (member == NULL)
+        member = TS_find_member(context->globals, (const char*) ident->token.text);
+
+    return member;
+}
+
+static int jit_helper_exec(AstNode_t* node, void* context_)
+{
+    ast_context_t* context;
+
+    context = (ast_context_t*) context_;
+
+    TS_rlsvalue(ast_eval(node, context));
+    return context->should_break > 0 || context->should_return > 0;
+}
+
+static int jit_helper_test(AstNode_t* node, void* context_)
+{
+    TS_Val condition;
+    int is_zero;
+
+    condition = ast_eval(node, (ast_context_t*) context_);
+    is_zero = TS_is_zero(condition);
+    TS_rlsvalue(condition);
+
+    return !is_zero;
+}
+
+static int jit_helper_test_equals(AstNode_t* node, void* context_)
+{
+    TS_Val left, right;
+    int equals;
+
+    left = ast_eval(node->left, (ast_context_t*) context_);
+    right = ast_eval(node->right, (ast_context_t*) context_);
+    equals = TS_equals(left, right);
+    TS_rlsvalue(left);
+    TS_rlsvalue(right);
+
+    return equals;
+}
+
+static int jit_helper_loop_stop(void* context_)
+{
+    ast_context_t* context;
+
+    context = (ast_context_t*) context_;
+
+    if (context->should_break > 0)
+    {
+        context->should_break--;
+        return 0;
+    }
+
+    return 1;
+}
+
+static intptr_t jit_helper_find_local(AstNode_t* ident, void* context_)
+{
+    ast_context_t* context;
+    TS_ObjectMember* member;
+
+    context = (ast_context_t*) context_;
+
+    member = TS_find_member(context->locals, (const char*) ident->token.text);
+
+    return (member != NULL) ? (member - context->locals.object->members) : -1;
+}
+
+static const jit_helpers_t jit_helpers = {
+    jit_helper_exec,
+    jit_helper_test,
+    jit_helper_test_equals,
+    jit_helper_loop_stop,
+    jit_helper_find_local,
+    offsetof(ast_context_t, locals)
+};
+
+/* lazy mode: parses, finalizes and specializes a function body on the first call */
+static void ast_materialize(AstNode_t* func)
+{
+    function_cust_data *cust_data;
+    ast_finalize_context_t finalize_context;
+    ast_properties_t *properties;
+    infer_result_t types;
+    AstNode_t* body;
+
+    cust_data = (function_cust_data *) func->cust_data;
+    properties = (ast_properties_t *) cust_data->script->cust_data;
+
+    /* a body that fails to parse is reported and behaves as an empty one */
+    body = parse_lazy_body(properties->file_name, func->children[0], parse_flags);
+
+    if (body == NULL)
+        body = ast_arena_node(func->arena, SN_NULL, NULL);
+
+    ast_release_node(&func->children[0]);
+    func->children[0] = body;
+
+    finalize_context.script = cust_data->script;
+    ast_finalize(body, &finalize_context);
+
+    infer_types(cust_data->script, func, &types);
+    ast_specialize_node(body, &types);
+    infer_release(&types);
+
+    ast_specialize_functions(cust_data->script, body);
+}
+
+/* counts calls of a script function and compiles it once it gets hot; returns NULL to stay in the interpreter */
+static jit_code_t* ast_tier_up(AstNode_t* func)
+{
+    function_cust_data *cust_data;
+    char name[64];
+
+    cust_data = (function_cust_data *) func->cust_data;
+
+    if (!jit_enabled || cust_data->num_calls > JIT_CALL_THRESHOLD)
+        return cust_data->jit_code;
+
+    if (++cust_data->num_calls > JIT_CALL_THRESHOLD)
+    {
+        snprintf(name, sizeof(name), "function_%p", (void*) func);
+        cust_data->jit_code = jit_compile(func->children[0], name, &jit_helpers, NULL);
+    }
+
+    return cust_data->jit_code;
+}
+
+/* counts back-edges of a loop; once it is hot, 'trace' is compiled using the current locals as type feedback */
+static void ast_tier_up_loop(AstNode_t* loop, AstNode_t* trace, ast_context_t* context)
+{
+    loop_cust_data *cust_data;
+    char name[64];
+
+    cust_data = (loop_cust_data *) loop->cust_data;
+
+    if (!jit_enabled || cust_data->num_iterations > JIT_LOOP_THRESHOLD)
+        return;
+
+    if (++cust_data->num_iterations > JIT_LOOP_THRESHOLD)
+    {
+        snprintf(name, sizeof(name), "loop_%p", (void*) loop);
+        cust_data->jit_code = jit_compile(trace, name, &jit_helpers, context);
+    }
+}
+
+static int ast_is_invokable(TS_Val function)
+{
+    return (function.type == TS_NATIVE && function.native->type_name == TS_FunctionNodeRef_name)
+            || (function.type == TS_NATIVEFUNC && function.native_func != NULL);
+}
+
+/* watch mode: the script file is checked for changes every RELOAD_POLL_CALLS script function calls */
+#define RELOAD_POLL_CALLS 1024
+
+static reload_t* reloader = NULL;
+static unsigned reload_ticks = 0;
+
+/* arguments and 'me' are borrowed; 'me' is only bound if not null */
+TS_Val ast_invoke(TS_Val function, TS_Val me, TS_Val* arguments, size_t num_arguments, ast_context_t* context)
+{
+    TS_Val retval;
+
+    if (function.type == TS_NATIVE && function.native->type_name == TS_FunctionNodeRef_name)
+    {
+        AstNode_t* func;
+        ast_context_t new_context;
+        jit_code_t* jit_code;
+        size_t i;
+
+        if (reloader != NULL && ++reload_ticks % RELOAD_POLL_CALLS == 0)
+            reload_poll(reloader, context->globals);
+
+        func = (AstNode_t*) function.native->cust_data;
+
+        if (func->children[0]->name == SN_LAZY)
+            ast_materialize(func);
+
+        new_context.globals = TS_reference(context->globals);
+        new_context.locals = TS_create_object(4);
+        new_context.return_value = TS_null();
+        new_context.should_break = 0;
+        new_context.should_return = 0;
+
+        if (me.type != TS_NULL)
+            TS_set_member(new_context.locals, "me", TS_reference(me));
+
+        if (func->right != NULL)
+        {
+            for (i = 0; i < func->right->children_num && i < num_arguments; i++)
+                TS_set_member(new_context.locals, (const char*) func->right->children[i]->token.text, TS_reference(arguments[i]));
+        }
+
+        jit_code = ast_tier_up(func);
+
+        if (jit_code != NULL)
+            jit_run(jit_code, &new_context);
+        else
+            /* should be null anyway */
+            TS_rlsvalue(ast_eval( func->children[0], &new_context ));
+
+        retval = new_context.return_value;
+
+        TS_rlsvalue(new_context.globals);
+        TS_rlsvalue(new_context.locals);
+    }
+    else if (function.type == TS_NATIVEFUNC && function.native_func != NULL)
+    {
+        TS_CallContext ctx;
+
+        ctx.globals = context->globals;
+        ctx.me = me;
+
+        retval = ((TS_NativeFunction_t) function.native_func)(&ctx, arguments, num_arguments);
+    }
+    else
+    {
+        printf("Error: uninvokable expression\n");
+        abort();
+    }
+
+    return retval;
+}
+
+/* runs one iteration of the loop body; returns 0 if the loop should stop */
+static int ast_iterate_body(AstNode_t* node, ast_context_t* context)
+{
+    loop_cust_data *cust_data;
+
+    cust_data = (loop_cust_data *) node->cust_data;
+
+    if (cust_data->jit_code != NULL)
+        jit_run(cust_data->jit_code, context);
+    else
+    {
+        TS_rlsvalue(ast_eval(node->children[0], context));
+        ast_tier_up_loop(node, node->children[0], context);
+    }
+
+    if (context->should_break > 0)
+    {
+        context->should_break--;
+        return 0;
+    }
+
+    return context->should_return == 0;
+}
+
 #define AST_EVAL_BINARY_OP(node_name_, function_)\
-        case node_name_:\
+        AST_CASE(node_name_)\
         {\
             TS_Val left, right, val;\
 \
@@ -429,47 +1354,65 @@ void ast_store_to(AstNode_t* node, ast_context_t* context, TS_Val val)
             return val;\
         }
 
+/* the generic operator behind a typed one, for operands that turned out not to have the inferred type */
+static TS_Val ast_eval_untyped_op(int name, TS_Val left, TS_Val right)
+{
+    TS_Val val;
+
+    switch (name)
+    {
+        case SN_ADD_FLOAT:
+        case SN_ADD_INT: val = TS_add(left, right); break;
+        case SN_DIVIDE_FLOAT: val = TS_divide(left, right); break;
+        case SN_EQUALS_INT: val = TS_bool(TS_equals(left, right)); break;
+        case SN_MULTIPLY_FLOAT:
+        case SN_MULTIPLY_INT: val = TS_multiply(left, right); break;
+        case SN_NOT_EQUALS_INT: val = TS_bool(!TS_equals(left, right)); break;
+        default: val = TS_subtract(left, right); break;
+    }
+
+    TS_rlsvalue(left);
+    TS_rlsvalue(right);
+    return val;
+}
+
+/* inference proves both operands to be of the same type as long as its locals really are locals, but a store can
+   reach a global of that name that it doesn't know about (set by a module loaded while the script runs), and other
+   code can then change the global's type; so the tags are still checked, and the generic operator takes over where
+   they don't match */
+#define AST_EVAL_TYPED_OP(node_name_, type_, constructor_, field_, operator_)\
+        AST_CASE(node_name_)\
+        {\
+            TS_Val left, right;\
+\
+            left = ast_eval(node->left, context);\
+            right = ast_eval(node->right, context);\
+\
+            if (left.type == type_ && right.type == type_)\
+                return constructor_(left.field_ operator_ right.field_);\
+\
+            return ast_eval_untyped_op(node->name, left, right);\
+        }
+
 TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
 {
-    switch (node->name)
+    AST_DISPATCH_TABLE
+
+    AST_DISPATCH(node)
     {
         AST_EVAL_BINARY_OP(SN_ADD, TS_add)
 
-        case SN_APPEND:
+        AST_CASE(SN_APPEND)
         {
             TS_Val left, right;
 
             left = ast_eval(node->left, context);
             right = ast_eval(node->right, context);
-            
-            if (left.type == TS_LIST)
-            {
-                TS_add_item(left.list, right);
-                return left;
-            }
-            else if (left.type == TS_STRING && right.type == TS_STRING)
-            {
-                uint8_t *joined;
-                size_t length;
 
-                length = left.string->num_bytes + right.string->num_bytes;
-                joined = (uint8_t *)malloc(length + 1);
-                memcpy(joined, left.string->bytes, left.string->num_bytes);
-                memcpy(joined + left.string->num_bytes, right.string->bytes, right.string->num_bytes + 1);
-
-                TS_rlsvalue(left);
-                TS_rlsvalue(right);
-                return TS_create_string_using(joined, length);
-            }
-            else
-            {
-                TS_rlsvalue(left);
-                TS_rlsvalue(right);
-                return TS_null();
-            }
+            return TS_append(left, right);
         }
 
-        case SN_ASSIGN:
+        AST_CASE(SN_ASSIGN)
         {
             TS_Val val;
 
@@ -482,115 +1425,60 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
         //AST_EVAL_BINARY_OP(SN_BIN_AND, TS_bin_and)
         AST_EVAL_BINARY_OP(SN_BIN_OR, TS_bin_or)
 
-        case SN_BREAK:
+        AST_CASE(SN_BREAK)
             context->should_break = 1;
             break;
 
-        case SN_CALL:
+        AST_CASE(SN_CALL)
+        AST_CASE(SN_CALL_NAME)
         {
-            TS_Val function, retval;
-
-            function = ast_eval(node->left, context);
+            TS_Val function, me, retval;
+            TS_Val *arguments;
+            size_t num_arguments, i;
 
-            if (function.type == TS_NATIVE && function.native->type_name == TS_FunctionNodeRef_name)
+            if (node->name == SN_CALL_NAME)
             {
-                AstNode_t* func;
-                ast_context_t new_context;
-                size_t i;
-
-                func = (AstNode_t*) function.native->cust_data;
-
-                new_context.globals = TS_reference(context->globals);
-                new_context.locals = TS_create_object(4);
-                new_context.return_value = TS_null();
-                new_context.should_break = 0;
-                new_context.should_return = 0;
-
-                if (node->left->name == SN_MEMBER)
-                    TS_set_member(new_context.locals, "me", ast_eval(node->left->left, context));
-
-                if (func->right != NULL)
-                {
-                    for (i = 0; i < func->right->children_num; i++)
-                    {
-                        if (i < node->right->children_num)
-                            TS_set_member(new_context.locals, (const char*) func->right->children[i]->token.text, ast_eval(node->right->children[i], context));
-                    }
-                }
-
-                /* should be null anyway */
-                TS_rlsvalue(ast_eval( func->children[0], &new_context ));
+                TS_ObjectMember* member;
 
-                retval = new_context.return_value;
-
-                TS_rlsvalue(new_context.globals);
-                TS_rlsvalue(new_context.locals);
+                member = ast_find_variable(node->left, context);
+                function = (member != NULL) ? TS_reference(member->val) : TS_null();
             }
-            /*else if (function.type == TS_NATIVE && function.native->invoke != NULL)
-            {
-                TS_Val *arguments;
-                size_t num_arguments, i;
+            else
+                function = ast_eval(node->left, context);
 
-                num_arguments = node->right->children_num;
+            num_arguments = node->right->children_num;
 
 #ifdef _MSC_VER
-                arguments = (TS_Val*) _malloca(num_arguments * sizeof(TS_Val));
+            arguments = (TS_Val*) _malloca(num_arguments * sizeof(TS_Val));
 #else
-                arguments = (TS_Val*) alloca(num_arguments * sizeof(TS_Val));
+            arguments = (TS_Val*) alloca(num_arguments * sizeof(TS_Val));
 #endif
 
-                for (i = 0; i < num_arguments; i++)
-                    arguments[i] = ast_eval(node->right->children[i], context);
-
-                retval = function.native->invoke(function, context->globals, arguments, num_arguments);
+            for (i = 0; i < num_arguments; i++)
+                arguments[i] = ast_eval(node->right->children[i], context);
 
-                for (i = 0; i < num_arguments; i++)
-                    TS_rlsvalue(arguments[i]);
+            if (node->left->name == SN_MEMBER)
+                me = ast_eval(node->left->left, context);
+            else
+                me = TS_null();
 
-#ifdef _MSC_VER
-                _freea(arguments);
-#endif
-            }*/
-            else if (function.type == TS_NATIVEFUNC && function.native_func != NULL)
+            if (function.type != TS_NATIVE && function.type != TS_NATIVEFUNC)
             {
-                TS_CallContext ctx;
-                TS_Val *arguments;
-                size_t num_arguments, i;
-
-                num_arguments = node->right->children_num;
-
-#ifdef _MSC_VER
-                arguments = (TS_Val*) _malloca(num_arguments * sizeof(TS_Val));
-#else
-                arguments = (TS_Val*) alloca(num_arguments * sizeof(TS_Val));
-#endif
-
-                for (i = 0; i < num_arguments; i++)
-                    arguments[i] = ast_eval(node->right->children[i], context);
-
-                ctx.globals = context->globals;
-
-                if (node->left->name == SN_MEMBER)
-                    ctx.me = ast_eval(node->left->left, context);
-                else
-                    ctx.me = TS_null();
+                printf("Error: uninvokable expression\n");
+                print_location(node);
+                abort();
+            }
 
-                retval = ((TS_NativeFunction_t) function.native_func)(&ctx, arguments, num_arguments);
+            retval = ast_invoke(function, me, arguments, num_arguments, context);
 
-                TS_rlsvalue(ctx.me);
+            TS_rlsvalue(me);
 
-                for (i = 0; i < num_arguments; i++)
-                    TS_rlsvalue(arguments[i]);
+            for (i = 0; i < num_arguments; i++)
+                TS_rlsvalue(arguments[i]);
 
 #ifdef _MSC_VER
-                _freea(arguments);
+            _freea(arguments);
 #endif
-            }
-            else
-            {
-                printf("Error: uninvokable expression\n");
-                abort();
-            }
 
             TS_rlsvalue(function);
             return retval;
@@ -598,7 +1486,7 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
 
         AST_EVAL_BINARY_OP(SN_DIVIDE, TS_divide)
 
-        case SN_EQUALS:
+        AST_CASE(SN_EQUALS)
         {
             TS_Val left, right;
             int is_zero;
@@ -614,22 +1502,17 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
             return TS_bool(is_zero);
         }
 
-        case SN_FALSE:
+        AST_CASE(SN_FALSE)
             return TS_bool(0);
 
-        case SN_FUNCTION:
-            return TS_reference( *((TS_Val*) node->cust_data) );
+        AST_CASE(SN_FUNCTION)
+            return TS_reference( ((function_cust_data *) node->cust_data)->ref );
 
-        case SN_IDENT:
+        AST_CASE(SN_IDENT)
         {
             TS_ObjectMember* member;
 
-            member = TS_find_member(context->locals, (const char*) node->token.text);
-
-            if (member != NULL)
-                return TS_reference(member->val);
-
-            member = TS_find_member(context->globals, (const char*) node->token.text);
+            member = ast_find_variable(node, context);
 
             if (member != NULL)
                 return TS_reference(member->val);
@@ -637,7 +1520,7 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
             break;
         }
 
-        case SN_IF:
+        AST_CASE(SN_IF)
         {
             TS_Val condition;
             int is_zero;
@@ -653,7 +1536,7 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
             break;
         }
 
-        case SN_INDEX:
+        AST_CASE(SN_INDEX)
         {
             TS_Val array, key, val;
 
@@ -667,23 +1550,78 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
             return val;
         }
 
-        case SN_INT:
+        AST_CASE(SN_INT)
             return TS_int(node->token.number);
 
-        case SN_ITERATE:
+        AST_CASE(SN_ITERATE)
         {
             TS_Val list;
+            TS_Native *native;
             size_t i;
 
             list = ast_eval(node->right, context);
 
-            if (list.type == TS_LIST)
+            if (list.type == TS_NATIVE)
+                native = list.native;
+            else if (list.type == TS_OBJECT)
+                native = list.object->native;
+            else
+                native = NULL;
+
+            if (native != NULL && native->type_name == TS_Range_type_name)
+            {
+                range_cust_data *range;
+                size_t slot;
+                int64_t counter;
+
+                /* counted loop: the counter is kept unboxed and written straight into the variable's slot.
+                   members are never removed from an object, so the slot index stays valid even if the body
+                   adds new locals (and reallocates the member array). the variable is only bound by the first
+                   element, so an empty range leaves it as it was (which is what type inference assumes) */
+                range = (range_cust_data *) native->cust_data;
+                slot = (size_t) -1;
+
+                for (counter = range->start; range->step > 0 ? counter < range->end : counter > range->end; counter += range->step)
+                {
+                    TS_ObjectMember *member;
+
+                    if (slot == (size_t) -1)
+                    {
+                        TS_set_member(context->locals, (const char *) node->left->token.text, TS_int((int) counter));
+                        slot = TS_find_member(context->locals, (const char *) node->left->token.text) - context->locals.object->members;
+                    }
+                    else
+                    {
+                        member = &context->locals.object->members[slot];
+                        TS_rlsvalue(member->val);
+                        member->val = TS_int((int) counter);
+                    }
+
+                    if (!ast_iterate_body(node, context))
+                        break;
+                }
+            }
+            else if (native != NULL && native->next != NULL)
+            {
+                TS_Val item;
+
+                /* lazy iterator: pull one item at a time from the native */
+                while (native->next(list, &item))
+                {
+                    TS_set_member(context->locals, (const char *) node->left->token.text, item);
+
+                    if (!ast_iterate_body(node, context))
+                        break;
+                }
+            }
+            else if (list.type == TS_LIST)
             {
                 for(i = 0; i < list.list->num_items; i++)
                 {
                     TS_set_member(context->locals, (const char *) node->left->token.text, TS_reference(list.list->items[i]));
 
-                    TS_rlsvalue(ast_eval(node->children[0], context));
+                    if (!ast_iterate_body(node, context))
+                        break;
                 }
             }
             else if (list.type == TS_STRING)
@@ -692,15 +1630,41 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
                 {
                     TS_set_member(context->locals, (const char *) node->left->token.text, TS_int(list.string->bytes[i]));
 
-                    TS_rlsvalue(ast_eval(node->children[0], context));
+                    if (!ast_iterate_body(node, context))
+                        break;
                 }
             }
+            else if (list.type == TS_OBJECT)
+            {
+                TS_Val next, item;
+
+                /* script-level generator: call list.next() until it returns null */
+                next = TS_get_member(list, "next");
+
+                if (ast_is_invokable(next))
+                {
+                    while (1)
+                    {
+                        item = ast_invoke(next, list, NULL, 0, context);
+
+                        if (item.type == TS_NULL)
+                            break;
+
+                        TS_set_member(context->locals, (const char *) node->left->token.text, item);
+
+                        if (!ast_iterate_body(node, context))
+                            break;
+                    }
+                }
+
+                TS_rlsvalue(next);
+            }
 
             TS_rlsvalue(list);
             break;
         }
 
-        case SN_LIST:
+        AST_CASE(SN_LIST)
             if(node->children_num == 1)
                 return ast_eval(node->children[0], context);
             else
@@ -716,7 +1680,7 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
                 return val;
             }
 
-        case SN_MEMBER:
+        AST_CASE(SN_MEMBER)
         {
             TS_Val val, member;
 
@@ -729,7 +1693,7 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
 
         AST_EVAL_BINARY_OP(SN_MULTIPLY, TS_multiply)
 
-        case SN_NOT:
+        AST_CASE(SN_NOT)
         {
             TS_Val left, val;
 
@@ -740,7 +1704,7 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
             return val;
         }
 
-        case SN_NOT_EQUALS:
+        AST_CASE(SN_NOT_EQUALS)
         {
             TS_Val left, right;
             int is_zero;
@@ -754,10 +1718,10 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
             return TS_bool(is_zero);
         }
 
-        case SN_NULL:
+        AST_CASE(SN_NULL)
             return TS_null();
 
-        case SN_OBJECT:
+        AST_CASE(SN_OBJECT)
         {
             TS_Val val;
             size_t i;
@@ -770,18 +1734,18 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
             return val;
         }
 
-        case SN_REAL:
+        AST_CASE(SN_REAL)
             return TS_float((float) node->token.decimal);
 
-        case SN_RETURN:
+        AST_CASE(SN_RETURN)
             if (node->left != NULL)
                 context->return_value = ast_eval(node->left, context);
 
             context->should_return = 1;
             break;
 
-        case SN_BLOCK:
-        case SN_SCRIPT:
+        AST_CASE(SN_BLOCK)
+        AST_CASE(SN_SCRIPT)
         {
             size_t i;
 
@@ -796,11 +1760,11 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
             break;
         }
 
-        case SN_STRING:
+        AST_CASE(SN_STRING)
             /* TODO: reference a TS_Val stored in the AST Node */
             return TS_create_string((const char*) node->token.text);
 
-        case SN_SUBTRACT:
+        AST_CASE(SN_SUBTRACT)
         {
             TS_Val left, right, val;
 
@@ -819,16 +1783,27 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
             return val;
         }
 
-        case SN_TRUE:
+        AST_CASE(SN_TRUE)
             return TS_bool(1);
 
-        case SN_WHILE:
+        AST_CASE(SN_WHILE)
         {
+            loop_cust_data *cust_data;
+
+            cust_data = (loop_cust_data *) node->cust_data;
+
             while (1)
             {
                 TS_Val condition;
                 int is_zero;
 
+                /* the loop got hot: the compiled trace runs the remaining iterations */
+                if (cust_data->jit_code != NULL)
+                {
+                    jit_run(cust_data->jit_code, context);
+                    break;
+                }
+
                 condition = ast_eval(node->left, context);
                 is_zero = TS_is_zero(condition);
                 TS_rlsvalue(condition);
@@ -843,80 +1818,579 @@ TS_Val ast_eval(AstNode_t* node, ast_context_t* context)
                     context->should_break--;
                     break;
                 }
+
+                if (context->should_return > 0)
+                    break;
+
+                ast_tier_up_loop(node, node, context);
+            }
+
+            break;
+        }
+
+        AST_CASE(SN_ADD_CONST_STORE)
+        {
+            TS_ObjectMember* member;
+            TS_Val val;
+
+            /* x = x + <int>: ints are updated in place, anything else takes the generic path */
+            member = ast_find_variable(node->left, context);
+
+            if (member != NULL && member->val.type == TS_INT)
+            {
+                member->val.intval += node->right->right->token.number;
+                return member->val;
+            }
+
+            val = TS_add(member != NULL ? member->val : TS_null(), TS_int(node->right->right->token.number));
+            ast_store_to(node->left, context, val);
+            return val;
+        }
+
+        AST_CASE(SN_IF_EQUALS)
+        {
+            TS_Val left, right;
+            int equals;
+
+            left = ast_eval(node->left->left, context);
+            right = ast_eval(node->left->right, context);
+
+            if (node->left->name == SN_EQUALS_INT && left.type == TS_INT && right.type == TS_INT)
+                equals = (left.intval == right.intval);
+            else
+            {
+                equals = TS_equals(left, right);
+                TS_rlsvalue(left);
+                TS_rlsvalue(right);
             }
 
+            if (equals)
+                TS_rlsvalue(ast_eval(node->right, context));
+            else if (node->children_num > 0)
+                TS_rlsvalue(ast_eval(node->children[0], context));
             break;
         }
+
+        AST_CASE(SN_MEMBER_STORE)
+        {
+            TS_Val val, obj;
+
+            val = ast_eval(node->right, context);
+
+            obj = ast_eval(node->left->left, context);
+            TS_set_member(obj, (const char*) node->left->right->token.text, TS_reference(val));
+            TS_rlsvalue(obj);
+            return val;
+        }
+
+        AST_EVAL_TYPED_OP(SN_ADD_FLOAT, TS_FLOAT, TS_float, floatval, +)
+        AST_EVAL_TYPED_OP(SN_ADD_INT, TS_INT, TS_int, intval, +)
+        AST_EVAL_TYPED_OP(SN_DIVIDE_FLOAT, TS_FLOAT, TS_float, floatval, /)
+        AST_EVAL_TYPED_OP(SN_EQUALS_INT, TS_INT, TS_bool, intval, ==)
+        AST_EVAL_TYPED_OP(SN_MULTIPLY_FLOAT, TS_FLOAT, TS_float, floatval, *)
+        AST_EVAL_TYPED_OP(SN_MULTIPLY_INT, TS_INT, TS_int, intval, *)
+        AST_EVAL_TYPED_OP(SN_NOT_EQUALS_INT, TS_INT, TS_bool, intval, !=)
+        AST_EVAL_TYPED_OP(SN_SUBTRACT_FLOAT, TS_FLOAT, TS_float, floatval, -)
+        AST_EVAL_TYPED_OP(SN_SUBTRACT_INT, TS_INT, TS_int, intval, -)
+
+        AST_DEFAULT
+            break;
     }
 
     return TS_null();
 }
 
-void ast_exec(AstNode_t* ast)
+/* natives registered in globals; snapshots refer to native functions by these names */
+static const snapshot_native_func_t builtins[] = {
+    {"create_file", TS_func_create_file},
+    {"load_module", TS_func_load_module},
+    {"open_file", TS_func_open_file},
+    {"range", TS_func_range},
+    {"say", TS_func_say},
+    {"_strdrop", TS_func__strdrop},
+    {"_strexpand", TS_func_expand},
+
+    /* methods of TS.File objects, not globals */
+    {"File.read_all", TS_func_File_read_all},
+    {"File.read_bytes", TS_func_File_read_bytes},
+    {"File.read_line", TS_func_File_read_line},
+    {"File.write", TS_func_File_write},
+    {"File.write_raw", TS_func_File_write_raw},
+};
+
+static TS_Val create_globals(void)
 {
-    ast_finalize_context_t finalize_context;
-    ast_context_t context;
+    TS_Val globals;
+    size_t i;
 
-    /* TODO: wrap the whole script in a function */
+    globals = TS_create_object(4);
+
+    for (i = 0; i < sizeof(builtins) / sizeof(*builtins); i++)
+        if (strchr(builtins[i].name, '.') == NULL)
+            TS_set_member(globals, builtins[i].name, TS_native_function(builtins[i].func));
+
+    return globals;
+}
+
+static TS_Val function_node_value(AstNode_t* func)
+{
+    return TS_reference(((function_cust_data *) func->cust_data)->ref);
+}
+
+/* hot reload: the node stays, everything that makes up the code of the function changes sides */
+static void swap_function(AstNode_t* live, AstNode_t* fresh)
+{
+    function_cust_data *a, *b;
+    AstNode_t *arguments, *body, *script;
+    unsigned num_calls;
+    jit_code_t* jit_code;
+
+    a = (function_cust_data *) live->cust_data;
+    b = (function_cust_data *) fresh->cust_data;
+
+    arguments = live->right;
+    live->right = fresh->right;
+    fresh->right = arguments;
+
+    body = live->children[0];
+    live->children[0] = fresh->children[0];
+    fresh->children[0] = body;
+
+    /* compiled code of the old body may still be running, it goes with the old body */
+    script = a->script;
+    a->script = b->script;
+    b->script = script;
+
+    num_calls = a->num_calls;
+    a->num_calls = b->num_calls;
+    b->num_calls = num_calls;
+
+    jit_code = a->jit_code;
+    a->jit_code = b->jit_code;
+    b->jit_code = jit_code;
+}
+
+static void snapshot_env(snapshot_env_t* env, AstNode_t* script)
+{
+    env->script = script;
+    env->function_value = function_node_value;
+    env->native_funcs = builtins;
+    env->num_native_funcs = sizeof(builtins) / sizeof(*builtins);
+}
+
+static void ast_finalize_script(AstNode_t* ast)
+{
+    ast_finalize_context_t finalize_context;
 
     finalize_context.script = ast;
     ast_finalize(ast, &finalize_context);
+}
+
+static void ast_prepare(AstNode_t* ast)
+{
+    ast_finalize_script(ast);
+    ast_specialize(ast);
+}
+
+/* tells type inference about the names that are global before the script runs, which it doesn't declare itself */
+static void ast_known_globals(AstNode_t* ast, TS_Val globals)
+{
+    ast_properties_t *properties;
+    size_t i;
+
+    properties = (ast_properties_t *) ast->cust_data;
+    properties->known_globals = (const char**) realloc(properties->known_globals,
+            (globals.object->num_members + 1) * sizeof(const char*));
+
+    for (i = 0; i < globals.object->num_members; i++)
+        properties->known_globals[i] = (const char*) globals.object->members[i].key.string->bytes;
+
+    properties->num_known_globals = globals.object->num_members;
+}
+
+/* runs the top-level code of a prepared script */
+static void ast_run(AstNode_t* ast, TS_Val globals)
+{
+    ast_context_t context;
+
+    /* TODO: wrap the whole script in a function */
 
     /* set up context */
-    context.globals = TS_create_object(4);
+    context.globals = globals;
     context.locals = TS_create_object(4);
     context.return_value = TS_null();
     context.should_break = 0;
     context.should_return = 0;
 
-    TS_set_member(context.globals, "create_file", TS_native_function(TS_func_create_file));
-    TS_set_member(context.globals, "load_module", TS_native_function(TS_func_load_module));
-    TS_set_member(context.globals, "open_file", TS_native_function(TS_func_open_file));
-    TS_set_member(context.globals, "say", TS_native_function(TS_func_say));
-    TS_set_member(context.globals, "_strdrop", TS_native_function(TS_func__strdrop));
-    TS_set_member(context.globals, "_strexpand", TS_native_function(TS_func_expand));
-
     TS_rlsvalue(ast_eval(ast, &context));
+    TS_rlsvalue(context.locals);
+}
+
+void ast_exec(AstNode_t* ast)
+{
+    TS_Val globals;
+
+    ast_prepare(ast);
+
+    globals = create_globals();
+    ast_run(ast, globals);
 
     printf("\n");
-    TS_printvalue(context.globals, 0);
+    TS_printvalue(globals, 0);
 
-    TS_rlsvalue(context.globals);
-    TS_rlsvalue(context.locals);
+    TS_rlsvalue(globals);
 }
 
-int do_script(const char* filename)
+/* a compiled image, or a script to be parsed (or loaded from the AST cache) */
+static AstNode_t* load_script(const char* filename, int flags)
 {
-    char* script;
+    Tfsource_t source;
     AstNode_t* ast;
+    int cache;
+
+    ast = image_load(filename);
+
+    if (ast != NULL)
+        return ast;
+
+    if (tf_source_open(&source, filename) != 0)
+        return NULL;
+
+    /* a script read from stdin has no file to keep its cache next to */
+    cache = use_cache && strcmp(filename, "-") != 0;
+
+    ast = cache ? parse_cache_load(filename, source.text, flags) : NULL;
+
+    if (ast == NULL)
+    {
+        ast = parse(filename, source.text, flags);
+
+        if (ast != NULL && cache)
+            parse_cache_store(filename, source.text, ast, flags);
+    }
+
+    tf_source_close(&source);
+    return ast;
+}
+
+/*
+ *  Scripts given together are loaded and finalized on a thread per core and then run in the order given, sharing
+ *  one set of globals. Each thread handles every n-th script with its own tokenfactory, parser and arena; the
+ *  token tables are read-only and finalization only touches the script's own tree, so nothing else is shared.
+ *  Type inference has to wait until the scripts before have run: their globals aren't locals of the next one.
+ */
+
+typedef struct
+{
+    const char** filenames;
+    AstNode_t** scripts;
+    size_t count, first, stride;
+}
+load_job_t;
+
+static void load_job_run(load_job_t* job)
+{
+    size_t i;
+
+    for (i = job->first; i < job->count; i += job->stride)
+    {
+        job->scripts[i] = load_script(job->filenames[i], parse_flags);
+
+        if (job->scripts[i] != NULL)
+            ast_finalize_script(job->scripts[i]);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI load_thread(LPVOID job)
+{
+    load_job_run((load_job_t*) job);
+    return 0;
+}
+#else
+static void* load_thread(void* job)
+{
+    load_job_run((load_job_t*) job);
+    return NULL;
+}
+#endif
+
+static size_t num_cpus(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors > 0) ? info.dwNumberOfProcessors : 1;
+#else
+    long n;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (size_t) n : 1;
+#endif
+}
+
+static void load_scripts(const char** filenames, size_t count, AstNode_t** scripts)
+{
+    load_job_t* jobs;
+    size_t num_threads, i;
+#ifdef _WIN32
+    HANDLE* threads;
+#else
+    pthread_t* threads;
+    int* started;
+#endif
+
+    num_threads = num_cpus();
+
+    if (num_threads > count)
+        num_threads = count;
+
+    jobs = (load_job_t*) malloc(num_threads * sizeof(load_job_t));
+
+    for (i = 0; i < num_threads; i++)
+    {
+        jobs[i].filenames = filenames;
+        jobs[i].scripts = scripts;
+        jobs[i].count = count;
+        jobs[i].first = i;
+        jobs[i].stride = num_threads;
+    }
+
+    /* the calling thread takes the first share; a share whose thread can't be started runs on it as well */
+#ifdef _WIN32
+    threads = (HANDLE*) malloc(num_threads * sizeof(HANDLE));
+
+    for (i = 1; i < num_threads; i++)
+        if ((threads[i] = CreateThread(NULL, 0, load_thread, &jobs[i], 0, NULL)) == NULL)
+            load_job_run(&jobs[i]);
+
+    load_job_run(&jobs[0]);
+
+    for (i = 1; i < num_threads; i++)
+        if (threads[i] != NULL)
+        {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+#else
+    threads = (pthread_t*) malloc(num_threads * sizeof(pthread_t));
+    started = (int*) malloc(num_threads * sizeof(int));
+
+    for (i = 1; i < num_threads; i++)
+        if (!(started[i] = (pthread_create(&threads[i], NULL, load_thread, &jobs[i]) == 0)))
+            load_job_run(&jobs[i]);
+
+    load_job_run(&jobs[0]);
+
+    for (i = 1; i < num_threads; i++)
+        if (started[i])
+            pthread_join(threads[i], NULL);
+
+    free(started);
+#endif
+
+    free(threads);
+    free(jobs);
+}
+
+/* loads the script a snapshot was taken from (which its function values point into) and the snapshot's globals */
+static AstNode_t* restore_snapshot(const char* filename, TS_Val* globals_out)
+{
+    snapshot_env_t env;
+    AstNode_t* base;
+    char* base_name;
+
+    base_name = snapshot_script_name(filename);
+
+    if (base_name == NULL)
+    {
+        fprintf(stderr, "tinyscript: `%s` is not a snapshot\n", filename);
+        return NULL;
+    }
+
+    base = load_script(base_name, parse_flags & ~PARSE_LAZY);
+    free(base_name);
+
+    if (base == NULL)
+        return NULL;
+
+    ast_prepare(base);
+
+    snapshot_env(&env, base);
+    *globals_out = snapshot_read(filename, &env);
 
-    script = tf_load_file(filename, NULL);
+    if (globals_out->type == TS_NULL)
+        ast_release_node(&base);
 
-    if (script == NULL)
+    return base;
+}
+
+int do_script(const char* filename)
+{
+    Tfsource_t source;
+    snapshot_env_t env;
+    AstNode_t *ast, *base;
+    TS_Val globals;
+
+    if (image_filename != NULL)
+    {
+        if (tf_source_open(&source, filename) != 0)
+            return -1;
+
+        /* images always hold fully parsed function bodies */
+        ast = parse(filename, source.text, parse_flags & ~PARSE_LAZY);
+        tf_source_close(&source);
+
+        if (ast != NULL && image_write(ast, image_filename) != 0)
+            fprintf(stderr, "tinyscript: failed to write `%s`\n", image_filename);
+
+        ast_release_node(&ast);
+        return 0;
+    }
+
+    if (snapshot_filename != NULL && from_snapshot_filename == NULL)
+    {
+        /* snapshots identify script functions by their position in the fully parsed tree */
+        ast = load_script(filename, parse_flags & ~PARSE_LAZY);
+
+        if (ast == NULL)
+            return -1;
+
+        ast_prepare(ast);
+
+        globals = create_globals();
+        ast_run(ast, globals);
+
+        snapshot_env(&env, ast);
+
+        if (snapshot_write(snapshot_filename, &env, globals) != 0)
+            fprintf(stderr, "tinyscript: failed to write `%s`\n", snapshot_filename);
+
+        TS_rlsvalue(globals);
+        ast_release_node(&ast);
+        return 0;
+    }
+
+    base = NULL;
+
+    if (from_snapshot_filename != NULL && (base = restore_snapshot(from_snapshot_filename, &globals)) == NULL)
         return -1;
 
-    ast = parse(filename, script);
-    free(script);
+    ast = load_script(filename, parse_flags);
+
+    if (ast != NULL && watch_script)
+    {
+        reload_env_t reload_env;
+
+        reload_env.prepare = ast_prepare;
+        reload_env.swap_function = swap_function;
+        reload_env.function_value = function_node_value;
+        reload_env.flags = parse_flags;
+
+        if ((reloader = reload_watch(filename, ast, &reload_env)) == NULL)
+            fprintf(stderr, "tinyscript: can't watch `%s`\n", filename);
+    }
 
     if (ast != NULL)
     {
-        //ast_serialize(ast, "ast.txt");
-        ast_exec(ast);
+        if (base != NULL)
+        {
+            /* the snapshot replaces the initialization; the script continues from its globals */
+            ast_known_globals(ast, globals);
+            ast_prepare(ast);
+            ast_run(ast, globals);
+
+            printf("\n");
+            TS_printvalue(globals, 0);
+
+            TS_rlsvalue(globals);
+        }
+        else
+            ast_exec(ast);
+
+        reload_release(&reloader);
         ast_release_node(&ast);
     }
+    else if (base != NULL)
+        TS_rlsvalue(globals);
 
+    ast_release_node(&base);
     return 0;
 }
 
+/* runs several scripts, loaded in parallel, one after another on the same globals */
+int do_scripts(const char** filenames, size_t count)
+{
+    AstNode_t** scripts;
+    TS_Val globals;
+    size_t i;
+    int rc;
+
+    scripts = (AstNode_t**) malloc(count * sizeof(AstNode_t*));
+    load_scripts(filenames, count, scripts);
+
+    rc = 0;
+
+    for (i = 0; i < count; i++)
+        if (scripts[i] == NULL)
+        {
+            fprintf(stderr, "tinyscript: failed to load `%s`\n", filenames[i]);
+            rc = -1;
+        }
+
+    if (rc == 0)
+    {
+        globals = create_globals();
+
+        for (i = 0; i < count; i++)
+        {
+            ast_known_globals(scripts[i], globals);
+            ast_specialize(scripts[i]);
+            ast_run(scripts[i], globals);
+        }
+
+        printf("\n");
+        TS_printvalue(globals, 0);
+
+        TS_rlsvalue(globals);
+    }
+
+    for (i = 0; i < count; i++)
+        ast_release_node(&scripts[i]);
+
+    free(scripts);
+    return rc;
+}
+
 int ssscanf(const char* string, int flags, const char* format, ...);
 
-static const char *input_filename = NULL;
+static const char **input_filenames = NULL;
+static size_t num_input_filenames = 0;
 
 static int on_arg(int type, const char* arg, const char* ext)
 {
     if (type == ARG_DEFAULT)
-        /* TODO: What to do if multiple */
-        input_filename = arg;
+    {
+        input_filenames = (const char**) realloc(input_filenames, (num_input_filenames + 1) * sizeof(const char*));
+        input_filenames[num_input_filenames++] = arg;
+    }
+    else if (type == ARG_MULTI_CHAR && strcmp(arg, "--cache") == 0)
+        use_cache = 1;
+    else if (type == ARG_MULTI_CHAR && strcmp(arg, "--lazy") == 0)
+        parse_flags |= PARSE_LAZY;
+    else if (type == ARG_MULTI_CHAR && strcmp(arg, "--no-jit") == 0)
+        jit_enabled = 0;
+    else if (type == ARG_MULTI_CHAR && strcmp(arg, "--perf-map") == 0)
+        jit_perf_map = 1;
+    else if (type == ARG_MULTI_CHAR && strcmp(arg, "--watch") == 0)
+        watch_script = 1;
+    else if (type == ARG_MULTI_CHAR_EXT && strncmp(arg, "--write-image=", 14) == 0)
+        image_filename = ext;
+    else if (type == ARG_MULTI_CHAR_EXT && strncmp(arg, "--snapshot=", 11) == 0)
+        snapshot_filename = ext;
+    else if (type == ARG_MULTI_CHAR_EXT && strncmp(arg, "--from-snapshot=", 16) == 0)
+        from_snapshot_filename = ext;
 
     return 0;
 }
@@ -926,9 +2400,25 @@ static void on_err(const char* arg)
     fprintf(stderr, "tinyscript: unrecognized argument `%s`\n", arg);
 }
 
+static const char *tinyscript_multi_char_args[] = {
+    "cache",
+    "lazy",
+    "no-jit",
+    "perf-map",
+    "watch",
+    NULL
+};
+
+static const char *tinyscript_multi_char_ext_args[] = {
+    "from-snapshot",
+    "snapshot",
+    "write-image",
+    NULL
+};
+
 parse_args_t tinyscript_args = {
     "", "",
-    NULL, NULL,
+    tinyscript_multi_char_args, tinyscript_multi_char_ext_args,
 
     on_arg,
     on_err
@@ -944,12 +2434,27 @@ int main(int argc, char **argv)
     if (parse_args(argc - 1, argv + 1, &tinyscript_args) < 0)
         return -1;
 
-    if (input_filename == NULL)
+    snapshot_add_native_type(TS_Range_type_name, deserialize_range);
+
+    /* without a file name, a script piped in is read from stdin */
+    if (num_input_filenames == 0 && !isatty(fileno(stdin)))
+        on_arg(ARG_DEFAULT, "-", NULL);
+
+    if (num_input_filenames == 0)
     {
         fprintf(stderr, "tinyscript: Nothing to do.\n");
         return 0;
     }
 
-    do_script(input_filename);
+    if (num_input_filenames == 1)
+        do_script(input_filenames[0]);
+    else if (image_filename != NULL || snapshot_filename != NULL || from_snapshot_filename != NULL)
+        fprintf(stderr, "tinyscript: images and snapshots take a single script\n");
+    else if (watch_script)
+        fprintf(stderr, "tinyscript: --watch takes a single script\n");
+    else
+        do_scripts(input_filenames, num_input_filenames);
+
+    free(input_filenames);
     return 0;
 }
@@ -0,0 +1,1118 @@
+/*
+ *  tsc: ahead-of-time TinyScript to C translator
+ *
+ *  The output is a module in the format expected by load_module: every script function becomes a C function
+ *  following the TS_NativeFunction_t convention, and the top-level code becomes TS_ModuleEntry. The generated
+ *  code only depends on the value API in tsval.h (provided by tsi at load time).
+ *
+ *  Differences from the interpreter:
+ *    - variables are resolved statically: a name that is assigned (or iterated) in a function and not declared
+ *      global is a C local for the whole function, everything else is looked up in globals
+ *    - top-level functions defined exactly once (`function name ...`) are called directly (early binding)
+ *    - `iterate x in range(...)` becomes a plain C loop if `range` is not redefined by the script
+ *    - locals proven to be always int or always float (see infer.c) are kept unboxed in C variables
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "infer.h"
+#include "parse.h"
+
+#include <parse_args.h>
+
+#define TSC_MAX_LOOP_DEPTH 64
+
+typedef struct
+{
+    char* data;
+    size_t length, capacity;
+}
+tsc_buffer_t;
+
+typedef struct
+{
+    AstNode_t* script;
+    ast_properties_t* properties;
+
+    /* all SN_FUNCTION nodes in pre-order; 'direct_names' is non-NULL for functions that can be called directly */
+    AstNode_t** functions;
+    const char** direct_names;
+    size_t num_functions, max_functions;
+
+    /* current function; 'types.locals' lists all its locals */
+    infer_result_t types;
+    unsigned num_temps, num_loops;
+
+    /* list temporaries of the enclosing iterate loops, released on 'return' */
+    unsigned loop_temps[TSC_MAX_LOOP_DEPTH];
+    size_t loop_depth;
+
+    tsc_buffer_t body;
+    int indent;
+
+    /* whether the current function refers to globals and returns early */
+    int uses_globals, uses_done;
+
+    /* prelude helpers called anywhere in the module */
+    int uses_test, uses_next;
+}
+tsc_context_t;
+
+/* makes room for 'length' more characters and a terminator; returns where they go */
+static char* buffer_reserve(tsc_buffer_t* buffer, size_t length)
+{
+    if (buffer->length + length + 1 > buffer->capacity)
+    {
+        buffer->capacity = (buffer->length + length + 1) * 2;
+        buffer->data = (char*) realloc(buffer->data, buffer->capacity);
+    }
+
+    return buffer->data + buffer->length;
+}
+
+static void buffer_printf(tsc_buffer_t* buffer, const char* format, ...)
+{
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    va_start(args, format);
+    vsnprintf(buffer_reserve(buffer, length), length + 1, format, args);
+    va_end(args);
+
+    buffer->length += length;
+}
+
+/* emits one indented line of the current function body; lines are not limited in length (a long string literal
+   is a single line) */
+static void emit(tsc_context_t* ctx, const char* format, ...)
+{
+    va_list args;
+    int length, i;
+
+    for (i = 0; i < ctx->indent; i++)
+        buffer_printf(&ctx->body, "    ");
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    va_start(args, format);
+    vsnprintf(buffer_reserve(&ctx->body, length), length + 1, format, args);
+    va_end(args);
+
+    ctx->body.length += length;
+    buffer_printf(&ctx->body, "\n");
+}
+
+/* string literal as a C string constant */
+static void emit_string_literal(tsc_buffer_t* buffer, const uint8_t* text)
+{
+    buffer_printf(buffer, "\"");
+
+    for (; *text != 0; text++)
+    {
+        if (*text == '"' || *text == '\\')
+            buffer_printf(buffer, "\\%c", *text);
+        else if (*text == '\n')
+            buffer_printf(buffer, "\\n");
+        else if (*text == '\t')
+            buffer_printf(buffer, "\\t");
+        else if (*text < ' ' || *text >= 127 || *text == '?')
+            buffer_printf(buffer, "\\%03o", *text);
+        else
+            buffer_printf(buffer, "%c", *text);
+    }
+
+    buffer_printf(buffer, "\"");
+}
+
+static int is_global_name(tsc_context_t* ctx, const char* name)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->properties->num_globals; i++)
+        if (strcmp(ctx->properties->globals[i], name) == 0)
+            return 1;
+
+    return 0;
+}
+
+static int is_local_name(tsc_context_t* ctx, const char* name)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->types.num_locals; i++)
+        if (strcmp(ctx->types.locals[i].name, name) == 0)
+            return 1;
+
+    return 0;
+}
+
+static int is_typed(int type)
+{
+    return type == TY_INT || type == TY_FLOAT;
+}
+
+/* whether the value of variable 'name' is used anywhere below 'node' in the same function */
+static int is_read(AstNode_t* node, const char* name)
+{
+    size_t i;
+
+    if (node == NULL || node->name == SN_FUNCTION)
+        return 0;
+
+    if (node->name == SN_IDENT)
+        return strcmp((const char*) node->token.text, name) == 0;
+
+    if (node->name == SN_OBJECT)
+    {
+        for (i = 0; i < node->children_num; i++)
+            if (is_read(node->children[i]->right, name))
+                return 1;
+
+        return 0;
+    }
+
+    if (node->name == SN_MEMBER)
+        return is_read(node->left, name);
+
+    /* storing to a variable doesn't read it */
+    if ((node->name != SN_ASSIGN && node->name != SN_ITERATE) || node->left->name != SN_IDENT)
+        if (is_read(node->left, name))
+            return 1;
+
+    if (is_read(node->right, name))
+        return 1;
+
+    for (i = 0; i < node->children_num; i++)
+        if (is_read(node->children[i], name))
+            return 1;
+
+    return 0;
+}
+
+static void collect_functions(tsc_context_t* ctx, AstNode_t* node, const char* assigned_to)
+{
+    size_t i;
+
+    if (node == NULL)
+        return;
+
+    if (node->name == SN_FUNCTION)
+    {
+        if (ctx->num_functions + 1 > ctx->max_functions)
+        {
+            ctx->max_functions = (ctx->max_functions == 0) ? 8 : (ctx->max_functions * 2);
+            ctx->functions = (AstNode_t**) realloc(ctx->functions, ctx->max_functions * sizeof(AstNode_t*));
+            ctx->direct_names = (const char**) realloc(ctx->direct_names, ctx->max_functions * sizeof(const char*));
+        }
+
+        ctx->functions[ctx->num_functions] = node;
+        ctx->direct_names[ctx->num_functions] = (assigned_to != NULL && is_global_name(ctx, assigned_to)
+                && infer_count_stores(ctx->script, assigned_to) == 1) ? assigned_to : NULL;
+        ctx->num_functions++;
+    }
+
+    if (node->name == SN_ASSIGN && node->left->name == SN_IDENT && node->right->name == SN_FUNCTION)
+    {
+        collect_functions(ctx, node->left, NULL);
+        collect_functions(ctx, node->right, (const char*) node->left->token.text);
+        return;
+    }
+
+    collect_functions(ctx, node->left, NULL);
+    collect_functions(ctx, node->right, NULL);
+
+    for (i = 0; i < node->children_num; i++)
+        collect_functions(ctx, node->children[i], NULL);
+}
+
+static int function_index(tsc_context_t* ctx, AstNode_t* func)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->num_functions; i++)
+        if (ctx->functions[i] == func)
+            return (int) i;
+
+    return -1;
+}
+
+static int direct_function(tsc_context_t* ctx, const char* name)
+{
+    size_t i;
+
+    if (is_local_name(ctx, name))
+        return -1;
+
+    for (i = 0; i < ctx->num_functions; i++)
+        if (ctx->direct_names[i] != NULL && strcmp(ctx->direct_names[i], name) == 0)
+            return (int) i;
+
+    return -1;
+}
+
+static void compile_statement(tsc_context_t* ctx, AstNode_t* node);
+static unsigned compile_expression(tsc_context_t* ctx, AstNode_t* node);
+
+/* type of an expression that can be compiled as plain C arithmetic, or TY_ANY; unlike infer_expression_type this
+   rejects stores to boxed variables */
+static int typed_expression_type(tsc_context_t* ctx, AstNode_t* node)
+{
+    switch (node->name)
+    {
+        case SN_ASSIGN:
+            if (node->left->name != SN_IDENT || !is_typed(infer_local_type(&ctx->types, (const char*) node->left->token.text)))
+                return TY_ANY;
+
+            return typed_expression_type(ctx, node->right);
+
+        case SN_LIST:
+            return (node->children_num == 1) ? typed_expression_type(ctx, node->children[0]) : TY_ANY;
+
+        case SN_ADD:
+        case SN_DIVIDE:
+        case SN_MULTIPLY:
+        case SN_SUBTRACT:
+            if ((node->left != NULL && !is_typed(typed_expression_type(ctx, node->left)))
+                    || !is_typed(typed_expression_type(ctx, node->right)))
+                return TY_ANY;
+    }
+
+    return infer_expression_type(&ctx->types, node);
+}
+
+/* writes an expression of a proven type (TY_INT or TY_FLOAT) as plain C arithmetic */
+static void compile_typed(tsc_context_t* ctx, AstNode_t* node, tsc_buffer_t* out)
+{
+    static const char* operators[] = {"+", "/", "*", "-"};
+
+    const char* operator;
+    int type;
+
+    type = typed_expression_type(ctx, node);
+
+    switch (node->name)
+    {
+        case SN_INT:
+            buffer_printf(out, "%d", (int) node->token.number);
+            break;
+
+        case SN_REAL:
+            buffer_printf(out, "((float) %.17g)", node->token.decimal);
+            break;
+
+        case SN_IDENT:
+            buffer_printf(out, "v_%s", node->token.text);
+            break;
+
+        case SN_ASSIGN:
+            buffer_printf(out, "(v_%s = ", node->left->token.text);
+            compile_typed(ctx, node->right, out);
+            buffer_printf(out, ")");
+            break;
+
+        case SN_LIST:
+            compile_typed(ctx, node->children[0], out);
+            break;
+
+        case SN_SUBTRACT:
+            if (node->left == NULL)
+            {
+                buffer_printf(out, "(-");
+                compile_typed(ctx, node->right, out);
+                buffer_printf(out, ")");
+                break;
+            }
+            /* fall through */
+
+        case SN_ADD:
+        case SN_DIVIDE:
+        case SN_MULTIPLY:
+            operator = operators[node->name == SN_ADD ? 0 : node->name == SN_DIVIDE ? 1 : node->name == SN_MULTIPLY ? 2 : 3];
+
+            /* mixed int/float operands are converted the way TS_NUMERIC_AS_FLOAT does */
+            buffer_printf(out, (type == TY_FLOAT) ? "((float) " : "(");
+            compile_typed(ctx, node->left, out);
+            buffer_printf(out, (type == TY_FLOAT) ? " %s (float) " : " %s ", operator);
+            compile_typed(ctx, node->right, out);
+            buffer_printf(out, ")");
+            break;
+    }
+}
+
+/* C expression of an 'if'/'while' condition; returns non-zero if it is a typed comparison */
+static int compile_typed_condition(tsc_context_t* ctx, AstNode_t* node, tsc_buffer_t* out)
+{
+    if ((node->name == SN_EQUALS || node->name == SN_NOT_EQUALS)
+            && typed_expression_type(ctx, node->left) == TY_INT
+            && typed_expression_type(ctx, node->right) == TY_INT)
+    {
+        compile_typed(ctx, node->left, out);
+        buffer_printf(out, (node->name == SN_EQUALS) ? " == " : " != ");
+        compile_typed(ctx, node->right, out);
+        return 1;
+    }
+    else if (is_typed(typed_expression_type(ctx, node)))
+    {
+        compile_typed(ctx, node, out);
+        buffer_printf(out, " != 0");
+        return 1;
+    }
+
+    return 0;
+}
+
+/* emits the evaluation of a condition and returns the C expression testing it (to be freed by the caller) */
+static char* compile_condition(tsc_context_t* ctx, AstNode_t* node)
+{
+    tsc_buffer_t condition = {NULL, 0, 0};
+
+    if (!compile_typed_condition(ctx, node, &condition))
+    {
+        buffer_printf(&condition, "tsc_test(t%u)", compile_expression(ctx, node));
+        ctx->uses_test = 1;
+    }
+
+    return condition.data;
+}
+
+/* evaluates an expression into a new temporary holding an owned reference; returns its number */
+static unsigned compile_expression(tsc_context_t* ctx, AstNode_t* node)
+{
+    unsigned t, left, right;
+    size_t i;
+    int type;
+
+    t = ctx->num_temps++;
+    type = typed_expression_type(ctx, node);
+
+    if (is_typed(type))
+    {
+        tsc_buffer_t expression = {NULL, 0, 0};
+
+        compile_typed(ctx, node, &expression);
+        emit(ctx, "t%u = %s(%s);", t, (type == TY_INT) ? "TS_int" : "TS_float", expression.data);
+        free(expression.data);
+        return t;
+    }
+
+    switch (node->name)
+    {
+        case SN_ADD:
+        case SN_BIN_OR:
+        case SN_DIVIDE:
+        case SN_MULTIPLY:
+        {
+            static const char* functions[] = {"TS_add", "TS_bin_or", "TS_divide", "TS_multiply"};
+            const char* function;
+
+            function = functions[node->name == SN_ADD ? 0 : node->name == SN_BIN_OR ? 1 : node->name == SN_DIVIDE ? 2 : 3];
+
+            left = compile_expression(ctx, node->left);
+            right = compile_expression(ctx, node->right);
+            emit(ctx, "t%u = %s(t%u, t%u);", t, function, left, right);
+            emit(ctx, "TS_rlsvalue(t%u);", left);
+            emit(ctx, "TS_rlsvalue(t%u);", right);
+            break;
+        }
+
+        case SN_APPEND:
+            left = compile_expression(ctx, node->left);
+            right = compile_expression(ctx, node->right);
+            emit(ctx, "t%u = TS_append(t%u, t%u);", t, left, right);
+            break;
+
+        case SN_ASSIGN:
+        {
+            unsigned obj, key;
+
+            right = compile_expression(ctx, node->right);
+            emit(ctx, "t%u = t%u;", t, right);
+
+            if (node->left->name == SN_IDENT && is_local_name(ctx, (const char*) node->left->token.text))
+            {
+                emit(ctx, "TS_rlsvalue(v_%s);", node->left->token.text);
+                emit(ctx, "v_%s = TS_reference(t%u);", node->left->token.text, t);
+            }
+            else if (node->left->name == SN_IDENT)
+            {
+                tsc_buffer_t name = {NULL, 0, 0};
+
+                emit_string_literal(&name, node->left->token.text);
+                emit(ctx, "TS_set_member(globals, %s, TS_reference(t%u));", name.data, t);
+                ctx->uses_globals = 1;
+                free(name.data);
+            }
+            else if (node->left->name == SN_INDEX)
+            {
+                obj = compile_expression(ctx, node->left->left);
+                key = compile_expression(ctx, node->left->right);
+                emit(ctx, "TS_set_entry(t%u, t%u, TS_reference(t%u));", obj, key, t);
+                emit(ctx, "TS_rlsvalue(t%u);", obj);
+            }
+            else if (node->left->name == SN_MEMBER)
+            {
+                obj = compile_expression(ctx, node->left->left);
+                emit(ctx, "TS_set_member(t%u, \"%s\", TS_reference(t%u));", obj, node->left->right->token.text, t);
+                emit(ctx, "TS_rlsvalue(t%u);", obj);
+            }
+            else
+                fprintf(stderr, "tsc: warning: can't store to node type %i\n", node->left->name);
+
+            break;
+        }
+
+        case SN_CALL:
+        {
+            unsigned function, me;
+            unsigned *arguments;
+            size_t num_arguments;
+            int direct;
+
+            num_arguments = node->right->children_num;
+            arguments = (unsigned*) malloc((num_arguments + 1) * sizeof(unsigned));
+
+            direct = (node->left->name == SN_IDENT) ? direct_function(ctx, (const char*) node->left->token.text) : -1;
+
+            function = 0;
+            me = 0;
+
+            if (node->left->name == SN_MEMBER)
+            {
+                me = compile_expression(ctx, node->left->left);
+                function = ctx->num_temps++;
+                emit(ctx, "t%u = TS_get_member(t%u, \"%s\");", function, me, node->left->right->token.text);
+            }
+            else if (direct < 0)
+                function = compile_expression(ctx, node->left);
+
+            for (i = 0; i < num_arguments; i++)
+                arguments[i] = compile_expression(ctx, node->right->children[i]);
+
+            emit(ctx, "{");
+            ctx->indent++;
+            ctx->uses_globals = 1;
+
+            if (num_arguments > 0)
+            {
+                emit(ctx, "TS_Val arguments[%u];", (unsigned) num_arguments);
+
+                for (i = 0; i < num_arguments; i++)
+                    emit(ctx, "arguments[%u] = t%u;", (unsigned) i, arguments[i]);
+            }
+
+            if (direct >= 0)
+            {
+                emit(ctx, "TS_CallContext call;");
+                emit(ctx, "call.globals = globals;");
+                emit(ctx, "call.me = TS_null();");
+                emit(ctx, "t%u = tsc_function_%i(&call, %s, %u);", t, direct, num_arguments > 0 ? "arguments" : "NULL",
+                        (unsigned) num_arguments);
+            }
+            else
+            {
+                char me_name[16];
+
+                if (node->left->name == SN_MEMBER)
+                    sprintf(me_name, "t%u", me);
+                else
+                    strcpy(me_name, "TS_null()");
+
+                emit(ctx, "t%u = TS_invoke(t%u, globals, %s, %s, %u);", t, function, me_name,
+                        num_arguments > 0 ? "arguments" : "NULL", (unsigned) num_arguments);
+            }
+
+            ctx->indent--;
+            emit(ctx, "}");
+
+            for (i = 0; i < num_arguments; i++)
+                emit(ctx, "TS_rlsvalue(t%u);", arguments[i]);
+
+            if (node->left->name == SN_MEMBER)
+                emit(ctx, "TS_rlsvalue(t%u);", me);
+
+            if (direct < 0)
+                emit(ctx, "TS_rlsvalue(t%u);", function);
+
+            free(arguments);
+            break;
+        }
+
+        case SN_EQUALS:
+        case SN_NOT_EQUALS:
+            left = compile_expression(ctx, node->left);
+            right = compile_expression(ctx, node->right);
+            emit(ctx, "t%u = TS_bool(%sTS_equals(t%u, t%u));", t, node->name == SN_NOT_EQUALS ? "!" : "", left, right);
+            emit(ctx, "TS_rlsvalue(t%u);", left);
+            emit(ctx, "TS_rlsvalue(t%u);", right);
+            break;
+
+        case SN_FALSE:
+            emit(ctx, "t%u = TS_bool(0);", t);
+            break;
+
+        case SN_FUNCTION:
+            emit(ctx, "t%u = TS_native_function(tsc_function_%i);", t, function_index(ctx, node));
+            break;
+
+        case SN_IDENT:
+            if (is_local_name(ctx, (const char*) node->token.text))
+                emit(ctx, "t%u = TS_reference(v_%s);", t, node->token.text);
+            else
+            {
+                tsc_buffer_t name = {NULL, 0, 0};
+
+                emit_string_literal(&name, node->token.text);
+                emit(ctx, "t%u = TS_get_member(globals, %s);", t, name.data);
+                ctx->uses_globals = 1;
+                free(name.data);
+            }
+            break;
+
+        case SN_INDEX:
+            left = compile_expression(ctx, node->left);
+            right = compile_expression(ctx, node->right);
+            emit(ctx, "t%u = TS_get_entry(t%u, t%u);", t, left, right);
+            emit(ctx, "TS_rlsvalue(t%u);", left);
+            emit(ctx, "TS_rlsvalue(t%u);", right);
+            break;
+
+        case SN_INT:
+            emit(ctx, "t%u = TS_int(%d);", t, (int) node->token.number);
+            break;
+
+        case SN_LIST:
+            if (node->children_num == 1)
+            {
+                left = compile_expression(ctx, node->children[0]);
+                emit(ctx, "t%u = t%u;", t, left);
+                break;
+            }
+
+            emit(ctx, "t%u = TS_create_list(%u);", t, (unsigned) node->children_num + 3);
+
+            for (i = 0; i < node->children_num; i++)
+            {
+                left = compile_expression(ctx, node->children[i]);
+                emit(ctx, "TS_add_item(t%u.list, t%u);", t, left);
+            }
+            break;
+
+        case SN_MEMBER:
+            left = compile_expression(ctx, node->left);
+            emit(ctx, "t%u = TS_get_member(t%u, \"%s\");", t, left, node->right->token.text);
+            emit(ctx, "TS_rlsvalue(t%u);", left);
+            break;
+
+        case SN_NOT:
+            left = compile_expression(ctx, node->left);
+            emit(ctx, "t%u = TS_not(t%u);", t, left);
+            emit(ctx, "TS_rlsvalue(t%u);", left);
+            break;
+
+        case SN_OBJECT:
+            emit(ctx, "t%u = TS_create_object(%u);", t, (unsigned) node->children_num);
+
+            for (i = 0; i < node->children_num; i++)
+            {
+                right = compile_expression(ctx, node->children[i]->right);
+                emit(ctx, "TS_set_member(t%u, \"%s\", t%u);", t, node->children[i]->left->token.text, right);
+            }
+            break;
+
+        case SN_REAL:
+            emit(ctx, "t%u = TS_float((float) %.17g);", t, node->token.decimal);
+            break;
+
+        case SN_STRING:
+        {
+            tsc_buffer_t literal = {NULL, 0, 0};
+
+            emit_string_literal(&literal, node->token.text);
+            emit(ctx, "t%u = TS_create_string(%s);", t, literal.data);
+            free(literal.data);
+            break;
+        }
+
+        case SN_SUBTRACT:
+            right = compile_expression(ctx, node->right);
+
+            if (node->left != NULL)
+            {
+                left = compile_expression(ctx, node->left);
+                emit(ctx, "t%u = TS_subtract(t%u, t%u);", t, left, right);
+                emit(ctx, "TS_rlsvalue(t%u);", left);
+            }
+            else
+                emit(ctx, "t%u = TS_negative(t%u);", t, right);
+
+            emit(ctx, "TS_rlsvalue(t%u);", right);
+            break;
+
+        case SN_TRUE:
+            emit(ctx, "t%u = TS_bool(1);", t);
+            break;
+
+        /* statements evaluate to null */
+        case SN_BLOCK:
+        case SN_BREAK:
+        case SN_IF:
+        case SN_ITERATE:
+        case SN_RETURN:
+        case SN_WHILE:
+            compile_statement(ctx, node);
+            emit(ctx, "t%u = TS_null();", t);
+            break;
+
+        case SN_NULL:
+        default:
+            emit(ctx, "t%u = TS_null();", t);
+    }
+
+    return t;
+}
+
+static int is_range_call(tsc_context_t* ctx, AstNode_t* node)
+{
+    return infer_is_builtin_range(ctx->script, node) && !is_local_name(ctx, "range")
+            && node->right->children_num >= 1 && node->right->children_num <= 3;
+}
+
+static void compile_iterate(tsc_context_t* ctx, AstNode_t* node)
+{
+    const char* name;
+    unsigned loop, list;
+
+    name = (const char*) node->left->token.text;
+    loop = ctx->num_loops++;
+
+    if (is_range_call(ctx, node->right))
+    {
+        unsigned bounds[3];
+        size_t i, num_bounds;
+
+        /* counted loop over range(); mirrors TS_func_range, which yields nothing for invalid arguments */
+        num_bounds = node->right->right->children_num;
+
+        for (i = 0; i < num_bounds; i++)
+            bounds[i] = compile_expression(ctx, node->right->right->children[i]);
+
+        emit(ctx, "{");
+        ctx->indent++;
+        emit(ctx, "int64_t i%u;", loop);
+        emit(ctx, "int start%u, end%u, step%u;", loop, loop, loop);
+
+        emit(ctx, "start%u = 0;", loop);
+        emit(ctx, "end%u = 0;", loop);
+        emit(ctx, "step%u = 0;", loop);
+
+        if (num_bounds == 1)
+            emit(ctx, "if (TS_IS_NUMERIC(t%u))", bounds[0]);
+        else if (num_bounds == 2)
+            emit(ctx, "if (TS_IS_NUMERIC(t%u) && TS_IS_NUMERIC(t%u))", bounds[0], bounds[1]);
+        else
+            emit(ctx, "if (TS_IS_NUMERIC(t%u) && TS_IS_NUMERIC(t%u) && TS_IS_NUMERIC(t%u))", bounds[0], bounds[1], bounds[2]);
+
+        emit(ctx, "{");
+        ctx->indent++;
+
+        if (num_bounds > 1)
+            emit(ctx, "start%u = TS_NUMERIC_AS_INT(t%u);", loop, bounds[0]);
+
+        emit(ctx, "end%u = TS_NUMERIC_AS_INT(t%u);", loop, bounds[num_bounds == 1 ? 0 : 1]);
+
+        if (num_bounds == 3)
+            emit(ctx, "step%u = TS_NUMERIC_AS_INT(t%u);", loop, bounds[2]);
+        else
+            emit(ctx, "step%u = 1;", loop);
+
+        ctx->indent--;
+        emit(ctx, "}");
+
+        for (i = 0; i < num_bounds; i++)
+            emit(ctx, "TS_rlsvalue(t%u);", bounds[i]);
+
+        emit(ctx, "for (i%u = start%u; step%u > 0 ? i%u < end%u : (step%u < 0 && i%u > end%u); i%u += step%u)",
+                loop, loop, loop, loop, loop, loop, loop, loop, loop, loop);
+        emit(ctx, "{");
+        ctx->indent++;
+        if (infer_local_type(&ctx->types, name) == TY_INT)
+            emit(ctx, "v_%s = (int) i%u;", name, loop);
+        else
+        {
+            emit(ctx, "TS_rlsvalue(v_%s);", name);
+            emit(ctx, "v_%s = TS_int((int) i%u);", name, loop);
+        }
+        compile_statement(ctx, node->children[0]);
+        ctx->indent--;
+        emit(ctx, "}");
+
+        ctx->indent--;
+        emit(ctx, "}");
+        return;
+    }
+
+    list = compile_expression(ctx, node->right);
+
+    if (ctx->loop_depth >= TSC_MAX_LOOP_DEPTH)
+    {
+        fprintf(stderr, "tsc: error: loops nested too deep\n");
+        exit(-1);
+    }
+
+    ctx->loop_temps[ctx->loop_depth++] = list;
+
+    emit(ctx, "{");
+    ctx->indent++;
+    emit(ctx, "size_t i%u;", loop);
+    emit(ctx, "TS_Val item%u;", loop);
+    emit(ctx, "i%u = 0;", loop);
+    emit(ctx, "while (tsc_next(globals, t%u, &i%u, &item%u))", list, loop, loop);
+    ctx->uses_globals = 1;
+    ctx->uses_next = 1;
+    emit(ctx, "{");
+    ctx->indent++;
+    emit(ctx, "TS_rlsvalue(v_%s);", name);
+    emit(ctx, "v_%s = item%u;", name, loop);
+    compile_statement(ctx, node->children[0]);
+    ctx->indent--;
+    emit(ctx, "}");
+    ctx->indent--;
+    emit(ctx, "}");
+
+    ctx->loop_depth--;
+    emit(ctx, "TS_rlsvalue(t%u);", list);
+}
+
+static void compile_statement(tsc_context_t* ctx, AstNode_t* node)
+{
+    char* condition;
+    size_t i;
+
+    switch (node->name)
+    {
+        case SN_BLOCK:
+        case SN_SCRIPT:
+            for (i = 0; i < node->children_num; i++)
+                compile_statement(ctx, node->children[i]);
+            break;
+
+        case SN_BREAK:
+            emit(ctx, "break;");
+            break;
+
+        case SN_IF:
+            condition = compile_condition(ctx, node->left);
+            emit(ctx, "if (%s)", condition);
+            free(condition);
+            emit(ctx, "{");
+            ctx->indent++;
+            compile_statement(ctx, node->right);
+            ctx->indent--;
+            emit(ctx, "}");
+
+            if (node->children_num > 0)
+            {
+                emit(ctx, "else");
+                emit(ctx, "{");
+                ctx->indent++;
+                compile_statement(ctx, node->children[0]);
+                ctx->indent--;
+                emit(ctx, "}");
+            }
+            break;
+
+        case SN_ITERATE:
+            compile_iterate(ctx, node);
+            break;
+
+        case SN_RETURN:
+            if (node->left != NULL)
+            {
+                unsigned value;
+
+                value = compile_expression(ctx, node->left);
+                emit(ctx, "retval = t%u;", value);
+            }
+
+            for (i = ctx->loop_depth; i > 0; i--)
+                emit(ctx, "TS_rlsvalue(t%u);", ctx->loop_temps[i - 1]);
+
+            emit(ctx, "goto done;");
+            ctx->uses_done = 1;
+            break;
+
+        case SN_WHILE:
+            emit(ctx, "while (1)");
+            emit(ctx, "{");
+            ctx->indent++;
+            condition = compile_condition(ctx, node->left);
+            emit(ctx, "if (!(%s))", condition);
+            free(condition);
+            emit(ctx, "    break;");
+            compile_statement(ctx, node->right);
+            ctx->indent--;
+            emit(ctx, "}");
+            break;
+
+        default:
+            if (is_typed(typed_expression_type(ctx, node)))
+            {
+                tsc_buffer_t expression = {NULL, 0, 0};
+
+                compile_typed(ctx, node, &expression);
+                emit(ctx, "%s;", expression.data);
+                free(expression.data);
+            }
+            else
+                emit(ctx, "TS_rlsvalue(t%u);", compile_expression(ctx, node));
+    }
+}
+
+/* compiles a function (or the top-level code if 'func' is NULL) and appends it to 'output' */
+static void compile_function(tsc_context_t* ctx, AstNode_t* func, int index, tsc_buffer_t* output)
+{
+    static const char* c_types[] = {"TS_Val", "int", "float", "TS_Val"};
+
+    infer_local_t* locals;
+    size_t i, num_arguments;
+
+    ctx->num_temps = 0;
+    ctx->num_loops = 0;
+    ctx->loop_depth = 0;
+    ctx->body.length = 0;
+    ctx->indent = 1;
+    ctx->uses_globals = 0;
+    ctx->uses_done = 0;
+
+    /* arguments come first in the list of locals, followed by 'me' for functions */
+    infer_types(ctx->script, func, &ctx->types);
+    locals = ctx->types.locals;
+    num_arguments = (func != NULL && func->right != NULL) ? func->right->children_num : 0;
+
+    buffer_printf(&ctx->body, "");
+    compile_statement(ctx, (func != NULL) ? func->children[0] : ctx->script);
+
+    if (func != NULL)
+    {
+        buffer_printf(output, "static TS_Val tsc_function_%i(TS_CallContext* ctx, TS_Val* arguments, size_t num_arguments)\n{\n", index);
+
+        if (ctx->uses_globals)
+            buffer_printf(output, "    TS_Val globals = ctx->globals;\n");
+    }
+    else
+        buffer_printf(output, "TS_Val TS_ModuleEntry(const uint8_t* name, TS_Val globals)\n{\n");
+
+    buffer_printf(output, "    TS_Val retval = TS_null();\n");
+
+    for (i = 0; i < ctx->types.num_locals; i++)
+        buffer_printf(output, "    %s v_%s;\n", c_types[locals[i].type], locals[i].name);
+
+    if (ctx->num_temps > 0)
+    {
+        buffer_printf(output, "    TS_Val t0");
+
+        for (i = 1; i < ctx->num_temps; i++)
+            buffer_printf(output, ", t%u", (unsigned) i);
+
+        buffer_printf(output, ";\n");
+    }
+
+    buffer_printf(output, "\n");
+
+    for (i = 0; i < ctx->types.num_locals; i++)
+    {
+        if (i < num_arguments)
+            buffer_printf(output, "    v_%s = (num_arguments > %u) ? TS_reference(arguments[%u]) : TS_null();\n",
+                    locals[i].name, (unsigned) i, (unsigned) i);
+        else if (func != NULL && strcmp(locals[i].name, "me") == 0)
+            buffer_printf(output, "    v_%s = TS_reference(ctx->me);\n", locals[i].name);
+        else if (is_typed(locals[i].type))
+            buffer_printf(output, "    v_%s = 0;\n", locals[i].name);
+        else
+            buffer_printf(output, "    v_%s = TS_null();\n", locals[i].name);
+    }
+
+    buffer_printf(output, "\n%s\n", ctx->body.data);
+
+    if (ctx->uses_done)
+        buffer_printf(output, "done:\n");
+
+    /* unboxed locals that are only ever assigned */
+    for (i = num_arguments; i < ctx->types.num_locals; i++)
+        if (is_typed(locals[i].type) && !is_read((func != NULL) ? func->children[0] : ctx->script, locals[i].name))
+            buffer_printf(output, "    (void) v_%s;\n", locals[i].name);
+
+    for (i = 0; i < ctx->types.num_locals; i++)
+        if (!is_typed(locals[i].type))
+            buffer_printf(output, "    TS_rlsvalue(v_%s);\n", locals[i].name);
+
+    buffer_printf(output, "    return retval;\n}\n\n");
+
+    infer_release(&ctx->types);
+}
+
+static const char* tsc_test_source =
+    "/* returns non-zero if 'val' is true; releases 'val' */\n"
+    "static int tsc_test(TS_Val val)\n"
+    "{\n"
+    "    int is_zero;\n"
+    "\n"
+    "    is_zero = TS_is_zero(val);\n"
+    "    TS_rlsvalue(val);\n"
+    "    return !is_zero;\n"
+    "}\n"
+    "\n";
+
+static const char* tsc_next_source =
+    "/* generic 'iterate': lists, strings, natives with a next hook and objects with a next() method */\n"
+    "static int tsc_next(TS_Val globals, TS_Val list, size_t* index, TS_Val* item)\n"
+    "{\n"
+    "    TS_Native* native;\n"
+    "\n"
+    "    native = (list.type == TS_NATIVE) ? list.native : (list.type == TS_OBJECT) ? list.object->native : NULL;\n"
+    "\n"
+    "    if (native != NULL && native->next != NULL)\n"
+    "        return native->next(list, item);\n"
+    "    else if (list.type == TS_LIST)\n"
+    "    {\n"
+    "        if (*index >= list.list->num_items)\n"
+    "            return 0;\n"
+    "\n"
+    "        *item = TS_reference(list.list->items[(*index)++]);\n"
+    "        return 1;\n"
+    "    }\n"
+    "    else if (list.type == TS_STRING)\n"
+    "    {\n"
+    "        if (*index >= list.string->num_bytes)\n"
+    "            return 0;\n"
+    "\n"
+    "        *item = TS_int(list.string->bytes[(*index)++]);\n"
+    "        return 1;\n"
+    "    }\n"
+    "    else if (list.type == TS_OBJECT)\n"
+    "    {\n"
+    "        TS_Val next;\n"
+    "\n"
+    "        next = TS_get_member(list, \"next\");\n"
+    "        *item = TS_invoke(next, globals, list, NULL, 0);\n"
+    "        TS_rlsvalue(next);\n"
+    "\n"
+    "        return item->type != TS_NULL;\n"
+    "    }\n"
+    "\n"
+    "    return 0;\n"
+    "}\n"
+    "\n";
+
+static const char* input_filename = NULL;
+static const char* output_filename = NULL;
+
+static int on_arg(int type, const char* arg, const char* ext)
+{
+    if (type == ARG_DEFAULT)
+        input_filename = arg;
+    else if (type == ARG_SINGLE_CHAR_EXT && arg[1] == 'o')
+        output_filename = ext;
+
+    return 0;
+}
+
+static void on_err(const char* arg)
+{
+    fprintf(stderr, "tsc: unrecognized argument `%s`\n", arg);
+}
+
+parse_args_t tsc_args = {
+    "", "o",
+    NULL, NULL,
+
+    on_arg,
+    on_err
+};
+
+int main(int argc, char** argv)
+{
+    tsc_context_t ctx;
+    AstNode_t* ast;
+    FILE* output;
+    Tfsource_t source;
+    tsc_buffer_t functions = {NULL, 0, 0};
+    size_t i;
+
+    if (parse_args(argc - 1, argv + 1, &tsc_args) < 0)
+        return -1;
+
+    if (input_filename == NULL)
+    {
+        fprintf(stderr, "usage: tsc <script> [-o <output.c>]\n");
+        return 0;
+    }
+
+    if (tf_source_open(&source, input_filename) != 0)
+    {
+        fprintf(stderr, "tsc: failed to open `%s`\n", input_filename);
+        return -1;
+    }
+
+    ast = parse(input_filename, source.text, 0);
+    tf_source_close(&source);
+
+    if (ast == NULL)
+        return -1;
+
+    output = (output_filename != NULL) ? fopen(output_filename, "w") : stdout;
+
+    if (output == NULL)
+    {
+        fprintf(stderr, "tsc: failed to create `%s`\n", output_filename);
+        ast_release_node(&ast);
+        return -1;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.script = ast;
+    ctx.properties = (ast_properties_t*) ast->cust_data;
+
+    collect_functions(&ctx, ast, NULL);
+
+    /* compiled first, so that only the helpers they call are written */
+    for (i = 0; i < ctx.num_functions; i++)
+        compile_function(&ctx, ctx.functions[i], (int) i, &functions);
+
+    compile_function(&ctx, NULL, -1, &functions);
+
+    fprintf(output, "/* generated by tsc from %s; build with: cc -shared -fPIC -I<tinyscript>/include */\n\n", input_filename);
+    fprintf(output, "#include <tinyapi.h>\n\n");
+
+    if (ctx.uses_test)
+        fprintf(output, "%s", tsc_test_source);
+
+    if (ctx.uses_next)
+        fprintf(output, "%s", tsc_next_source);
+
+    for (i = 0; i < ctx.num_functions; i++)
+        fprintf(output, "static TS_Val tsc_function_%u(TS_CallContext* ctx, TS_Val* arguments, size_t num_arguments);\n", (unsigned) i);
+
+    fprintf(output, "\n%s", functions.data);
+
+    if (output != stdout)
+        fclose(output);
+
+    free(ctx.functions);
+    free(ctx.direct_names);
+    free(ctx.body.data);
+    free(functions.data);
+
+    ast_release_node(&ast);
+    return 0;
+}
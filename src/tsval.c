@@ -107,8 +107,10 @@ TS_Native* TS_create_native_struct(const char* type_name, void* cust_data, void
     native->get_hash = NULL;
     native->get_member = NULL;
     native->invoke = NULL;
+    native->next = NULL;
     native->on_destroy = on_destroy;
     native->printvalue = NULL;
+    native->serialize = NULL;
 
     return native;
 }
@@ -423,6 +425,36 @@ TS_Val TS_add(TS_Val left, TS_Val right)
     return TS_float(TS_NUMERIC_AS_FLOAT(left) + TS_NUMERIC_AS_FLOAT(right));
 }
 
+/* consumes both references */
+TS_Val TS_append(TS_Val left, TS_Val right)
+{
+    /* list .. any => list (item appended in place) */
+    if (left.type == TS_LIST)
+    {
+        TS_add_item(left.list, right);
+        return left;
+    }
+    /* string .. string => new string */
+    else if (left.type == TS_STRING && right.type == TS_STRING)
+    {
+        uint8_t *joined;
+        size_t length;
+
+        length = left.string->num_bytes + right.string->num_bytes;
+        joined = (uint8_t *)malloc(length + 1);
+        memcpy(joined, left.string->bytes, left.string->num_bytes);
+        memcpy(joined + left.string->num_bytes, right.string->bytes, right.string->num_bytes + 1);
+
+        TS_rlsvalue(left);
+        TS_rlsvalue(right);
+        return TS_create_string_using(joined, length);
+    }
+
+    TS_rlsvalue(left);
+    TS_rlsvalue(right);
+    return TS_null();
+}
+
 TS_Val TS_bin_or(TS_Val left, TS_Val right)
 {
     /* any num as int | any num as int => int */
@@ -657,6 +689,24 @@ static void TS_rlsobject(TS_Object* obj)
     free(obj);
 }
 
+/* arguments and 'me' are borrowed */
+TS_Val TS_invoke(TS_Val function, TS_Val globals, TS_Val me, TS_Val* arguments, size_t num_arguments)
+{
+    if (function.type == TS_NATIVEFUNC && function.native_func != NULL)
+    {
+        TS_CallContext ctx;
+
+        ctx.globals = globals;
+        ctx.me = me;
+
+        return ((TS_NativeFunction_t) function.native_func)(&ctx, arguments, num_arguments);
+    }
+    else if (function.type == TS_NATIVE && function.native->invoke != NULL)
+        return function.native->invoke(function, globals, me, arguments, num_arguments);
+
+    return TS_null();
+}
+
 TS_Val TS_native_function(TS_NativeFunction_t invoke)
 {
     TS_Val native_function;
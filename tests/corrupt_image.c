@@ -0,0 +1,151 @@
+/* Writes damaged copies of an image, one per file, each with a single field of a single node changed:
+ *
+ *   corrupt_image <image> <output dir>
+ *
+ * and prints how many it wrote (<output dir>/0.img ...). tsi has to reject or run every one of them without
+ * crashing; see corrupt_image.cmake. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the parts of the layout in src/image.c that are changed here */
+#define NO_INDEX        0xFFFFFFFF
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version, num_node_kinds;
+
+    uint32_t num_nodes, num_children, num_strings, num_constants, num_globals;
+    uint32_t strings_size;
+
+    uint32_t nodes, children, string_offsets, strings, constants, globals;
+    uint32_t file_name;
+}
+image_header_t;
+
+typedef struct
+{
+    int16_t name;
+    uint16_t children_num;
+    int32_t line;
+
+    uint32_t left, right;
+    uint32_t children;
+    uint32_t text, constant;
+}
+image_node_t;
+
+enum { CLEAR_LEFT, CLEAR_RIGHT, SWAP_OPERANDS, NEXT_KIND, PREVIOUS_KIND, MORE_CHILDREN, FEWER_CHILDREN,
+        NUM_DAMAGES };
+
+static int write_variant(const char* dir, unsigned index, const uint8_t* image, size_t size)
+{
+    char path[1024];
+    FILE* f;
+    size_t written;
+
+    sprintf(path, "%.1000s/%u.img", dir, index);
+
+    if ((f = fopen(path, "wb")) == NULL)
+        return -1;
+
+    written = fwrite(image, 1, size, f);
+    return (fclose(f) == 0 && written == size) ? 0 : -1;
+}
+
+static void damage(image_node_t* node, int how)
+{
+    uint32_t swap;
+
+    switch (how)
+    {
+        case CLEAR_LEFT:        node->left = NO_INDEX; break;
+        case CLEAR_RIGHT:       node->right = NO_INDEX; break;
+        case SWAP_OPERANDS:     swap = node->left; node->left = node->right; node->right = swap; break;
+        case NEXT_KIND:         node->name++; break;
+        case PREVIOUS_KIND:     node->name--; break;
+        case MORE_CHILDREN:     node->children_num++; break;
+        case FEWER_CHILDREN:    node->children_num--; break;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    FILE* f;
+    uint8_t* image;
+    uint8_t* copy;
+    long size;
+    image_header_t header;
+    unsigned num_variants;
+    uint32_t i;
+    int how;
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: corrupt_image <image> <output dir>\n");
+        return 1;
+    }
+
+    if ((f = fopen(argv[1], "rb")) == NULL || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < (long) sizeof(header))
+    {
+        fprintf(stderr, "corrupt_image: can't read `%s`\n", argv[1]);
+        return 1;
+    }
+
+    rewind(f);
+    image = (uint8_t*) malloc(size);
+    copy = (uint8_t*) malloc(size);
+
+    if (fread(image, 1, size, f) != (size_t) size)
+    {
+        fprintf(stderr, "corrupt_image: can't read `%s`\n", argv[1]);
+        return 1;
+    }
+
+    fclose(f);
+    memcpy(&header, image, sizeof(header));
+
+    if (header.nodes > size || header.num_nodes > (size - header.nodes) / sizeof(image_node_t))
+    {
+        fprintf(stderr, "corrupt_image: `%s` is not an image\n", argv[1]);
+        return 1;
+    }
+
+    num_variants = 0;
+
+    for (i = 0; i < header.num_nodes; i++)
+        for (how = 0; how < NUM_DAMAGES; how++)
+        {
+            image_node_t node;
+            size_t offset;
+
+            offset = header.nodes + i * sizeof(image_node_t);
+            memcpy(&node, image + offset, sizeof(node));
+
+            /* nothing to change */
+            if ((how == CLEAR_LEFT && node.left == NO_INDEX) || (how == CLEAR_RIGHT && node.right == NO_INDEX)
+                    || (how == SWAP_OPERANDS && node.left == node.right)
+                    || (how == FEWER_CHILDREN && node.children_num == 0))
+                continue;
+
+            damage(&node, how);
+
+            memcpy(copy, image, size);
+            memcpy(copy + offset, &node, sizeof(node));
+
+            if (write_variant(argv[2], num_variants++, copy, size) != 0)
+            {
+                fprintf(stderr, "corrupt_image: can't write to `%s`\n", argv[2]);
+                return 1;
+            }
+        }
+
+    printf("%u\n", num_variants);
+
+    free(copy);
+    free(image);
+    return 0;
+}
@@ -0,0 +1,40 @@
+# Writes an image of a script, damages it node by node with corrupt_image and loads every damaged copy.
+#
+#   cmake -DTSI=<tsi> -DCORRUPT_IMAGE=<corrupt_image> -DSCRIPT=<script> -DWORK_DIR=<dir> -P corrupt_image.cmake
+#
+# A damaged image may be rejected (tsi then reads the file as a script, which fails to parse) or may still
+# describe a tree the interpreter can run (possibly forever, so runs are cut short), but it must never take tsi
+# down: tsi is built with AddressSanitizer, so a bad node reaching the interpreter, type inference or the
+# compilers shows up as a sanitizer report.
+
+get_filename_component(name ${SCRIPT} NAME)
+set(dir ${WORK_DIR}/corrupt-image)
+
+file(REMOVE_RECURSE ${dir})
+file(MAKE_DIRECTORY ${dir})
+configure_file(${SCRIPT} ${dir}/${name} COPYONLY)
+
+execute_process(COMMAND ${TSI} --write-image=${dir}/script.img ${dir}/${name} WORKING_DIRECTORY ${dir}
+  RESULT_VARIABLE rc ERROR_VARIABLE err)
+
+if (NOT rc EQUAL 0)
+  message(FATAL_ERROR "writing the image failed (${rc}):\n${err}")
+endif()
+
+execute_process(COMMAND ${CORRUPT_IMAGE} ${dir}/script.img ${dir}
+  RESULT_VARIABLE rc OUTPUT_VARIABLE count ERROR_VARIABLE err OUTPUT_STRIP_TRAILING_WHITESPACE)
+
+if (NOT rc EQUAL 0 OR count EQUAL 0)
+  message(FATAL_ERROR "corrupt_image failed (${rc}):\n${err}")
+endif()
+
+math(EXPR last "${count} - 1")
+
+foreach(i RANGE ${last})
+  execute_process(COMMAND ${TSI} ${i}.img WORKING_DIRECTORY ${dir} TIMEOUT 2
+    RESULT_VARIABLE rc OUTPUT_QUIET ERROR_VARIABLE err)
+
+  if (err MATCHES "AddressSanitizer" OR NOT rc MATCHES "^[0-9]+$|^Subprocess aborted$|timeout")
+    message(FATAL_ERROR "damaged image ${i}.img crashed tsi (${rc}):\n${err}")
+  endif()
+endforeach()
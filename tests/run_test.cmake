@@ -0,0 +1,124 @@
+# Runs one regression script in one mode and compares its output with the expected output.
+#
+#   cmake -DTSI=<tsi> -DMODE=<mode> -DSCRIPT=<script> -DEXPECTED=<output> -DWORK_DIR=<dir> -P run_test.cmake
+#
+# The stdin mode pipes the script into tsi, behind enough comment lines that it straddles the end of the first 64
+# KiB chunk tsi reads. The cache mode runs the script a second time from its AST cache, and the image mode writes an
+# image of the script and runs the image instead. The snapshot mode stops after the script, saving its state, and
+# prints the globals from a run that resumes that state. The tsc mode also needs -DTSC=<tsc>, -DCC=<c compiler> and
+# -DINCLUDE_DIR=<include>: the script is translated, built as a module (which must compile -Wall clean) and run
+# through load_module, or through the script given by -DLOADER=<script> if there is one. The options mode runs the
+# script by its file name with -DOPTIONS=<tsi options>, after the script given by -DBEFORE=<script> if there is one,
+# and doesn't check the exit status, so the script may end in an error.
+#
+# The output has to match exactly, except that addresses of natives are masked. The script is copied to WORK_DIR
+# first, so that nothing it or tsi writes ends up in the source tree.
+
+get_filename_component(name ${SCRIPT} NAME)
+set(dir ${WORK_DIR}/${MODE})
+set(script ${dir}/${name})
+
+file(REMOVE_RECURSE ${dir})
+file(MAKE_DIRECTORY ${dir})
+configure_file(${SCRIPT} ${script} COPYONLY)
+
+function(run_tsi)
+  execute_process(COMMAND ${TSI} ${ARGN} WORKING_DIRECTORY ${dir} ${input}
+    RESULT_VARIABLE rc OUTPUT_VARIABLE out ERROR_VARIABLE err)
+
+  if (NOT rc EQUAL 0 AND NOT MODE STREQUAL "options")
+    message(FATAL_ERROR "tsi ${ARGN} failed (${rc}):\n${out}\n${err}")
+  endif()
+
+  set(out ${out} PARENT_SCOPE)
+endfunction()
+
+if (MODE STREQUAL "plain")
+  run_tsi(${script})
+elseif (MODE STREQUAL "stdin")
+  set(line "# a line of padding, 100 bytes long, to move the script past the first chunk tsi reads ------------\n")
+  set(padding "")
+
+  foreach(i RANGE 654)
+    string(APPEND padding "${line}")
+  endforeach()
+
+  file(READ ${script} text)
+  file(WRITE ${dir}/stdin.txt "${padding}${text}")
+
+  set(input INPUT_FILE ${dir}/stdin.txt)
+  run_tsi(-)
+elseif (MODE STREQUAL "no-jit")
+  run_tsi(--no-jit ${script})
+elseif (MODE STREQUAL "lazy")
+  run_tsi(--lazy ${script})
+elseif (MODE STREQUAL "cache")
+  # the first run writes the cache, the second one runs from it
+  run_tsi(--cache ${script})
+
+  if (NOT EXISTS ${script}.ast)
+    message(FATAL_ERROR "tsi --cache didn't write ${name}.ast")
+  endif()
+
+  run_tsi(--cache ${script})
+elseif (MODE STREQUAL "image")
+  run_tsi(--write-image=${dir}/script.img ${script})
+  run_tsi(script.img)
+elseif (MODE STREQUAL "snapshot")
+  # the script runs into a snapshot, which an empty script then resumes to print the globals
+  run_tsi(--snapshot=${dir}/script.snapshot ${script})
+  set(first "${out}")
+
+  file(WRITE ${dir}/empty.txt "")
+  run_tsi(--from-snapshot=${dir}/script.snapshot empty.txt)
+  set(out "${first}${out}")
+elseif (MODE STREQUAL "tsc")
+  get_filename_component(module ${SCRIPT} NAME_WE)
+
+  execute_process(COMMAND ${TSC} ${script} -o ${dir}/module_${module}.c RESULT_VARIABLE rc ERROR_VARIABLE err)
+
+  if (NOT rc EQUAL 0)
+    message(FATAL_ERROR "tsc failed (${rc}):\n${err}")
+  endif()
+
+  execute_process(COMMAND ${CC} -shared -fPIC -Wall -Werror -I${INCLUDE_DIR} module_${module}.c -o module_${module}.so
+    WORKING_DIRECTORY ${dir} RESULT_VARIABLE rc OUTPUT_VARIABLE out ERROR_VARIABLE err)
+
+  if (NOT rc EQUAL 0)
+    message(FATAL_ERROR "module_${module}.c doesn't compile:\n${out}\n${err}")
+  endif()
+
+  if (DEFINED LOADER)
+    configure_file(${LOADER} ${dir}/load.txt COPYONLY)
+  else()
+    file(WRITE ${dir}/load.txt "load_module('${module}')\n")
+  endif()
+
+  run_tsi(load.txt)
+elseif (MODE STREQUAL "options")
+  if (DEFINED BEFORE)
+    # a script to run first, in the same tsi
+    get_filename_component(before ${BEFORE} NAME)
+    configure_file(${BEFORE} ${dir}/${before} COPYONLY)
+  endif()
+
+  list(FIND OPTIONS --cache cache)
+
+  if (NOT cache EQUAL -1)
+    # the first run writes the caches, the second one runs from them
+    run_tsi(${OPTIONS} ${before} ${name})
+  endif()
+
+  run_tsi(${OPTIONS} ${before} ${name})
+else()
+  message(FATAL_ERROR "unknown mode `${MODE}`")
+endif()
+
+file(READ ${EXPECTED} expected)
+
+string(REGEX REPLACE "@ 0x[0-9a-f]+" "@ X" out "${out}")
+string(REGEX REPLACE "@ 0x[0-9a-f]+" "@ X" expected "${expected}")
+
+if (NOT out STREQUAL expected)
+  message(FATAL_ERROR "output of ${name} (${MODE}) differs\n--- expected\n${expected}\n--- got\n${out}")
+endif()
@@ -0,0 +1,117 @@
+/* Checks the lookahead ring of the token buffer:
+ *
+ *   token_ring
+ *
+ * reads a run of words and numbers through a token buffer, peeking up to far more tokens ahead than the ring
+ * starts out with (so that it wraps and grows while tokens are buffered), and checks that every token comes out
+ * of tb_current and tb_peek in input order with its text intact. Prints the number of tokens read. */
+
+#include "tokenfactory.h"
+
+#define NUM_TOKENS      1000
+
+enum { T_WORD, T_NUMBER };
+
+static const uint32_t word_ranges[] = { 'a', 'z' };
+
+static Tokenclass_t classes[] =
+{
+    TOKEN_CLASS_NUMBER(CLASS_TOKEN, T_NUMBER, -1, -1, -1, 10),
+    TOKEN_CLASS_SEQUENCE(CLASS_TOKEN, T_WORD, (uint32_t*) word_ranges, 1)
+};
+
+/* token i is a number for even i, otherwise a word of i % 23 + 1 letters */
+static void expected_text(size_t i, char* text)
+{
+    size_t length;
+
+    if (i % 2 == 0)
+        sprintf(text, "%u", (unsigned) i);
+    else
+    {
+        for (length = 0; length < i % 23 + 1; length++)
+            text[length] = (char) ('a' + (i + length) % 26);
+
+        text[length] = 0;
+    }
+}
+
+static int check_token(const Token_t* token, size_t i)
+{
+    char text[32];
+
+    expected_text(i, text);
+
+    if (token == NULL)
+    {
+        fprintf(stderr, "token_ring: token %u is missing\n", (unsigned) i);
+        return -1;
+    }
+
+    if (token->name != (i % 2 == 0 ? T_NUMBER : T_WORD)
+            || (token->name == T_NUMBER && token->number != (int32_t) i)
+            || (token->name == T_WORD && strcmp((const char*) token->text, text) != 0))
+    {
+        fprintf(stderr, "token_ring: token %u is `%s`, expected `%s`\n", (unsigned) i,
+                token->text != NULL ? (const char*) token->text : "", text);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(void)
+{
+    static const uint32_t chars[] = {' ', '\n'};
+
+    Tokenfactory_t* tf;
+    Tokenbuffer_t* tbuf;
+    char* input;
+    size_t i, length, ahead, read;
+
+    input = (char*) malloc(NUM_TOKENS * 32);
+    length = 0;
+
+    for (i = 0; i < NUM_TOKENS; i++)
+    {
+        expected_text(i, input + length);
+        length += strlen(input + length);
+        input[length++] = (i % 10 == 9) ? '\n' : ' ';
+    }
+
+    input[length] = 0;
+
+    tf = tokenfactory();
+    tokenclass_add(tf, classes, sizeof(classes) / sizeof(classes[0]));
+    tf_whitespace_add(tf, chars, 2);
+    tf_input_string(tf, (uint8_t*) input, -1, 0);
+
+    tbuf = tokenbuffer(tf);
+
+    /* look ahead by a different distance before each drop: 0, 1, ... up to 40 tokens, then back down */
+    for (read = 0; read < NUM_TOKENS; read++)
+    {
+        ahead = read % 81 < 41 ? read % 81 : 81 - read % 81;
+
+        if (read + ahead < NUM_TOKENS && check_token(tb_peek(tbuf, ahead), read + ahead) != 0)
+            return 1;
+
+        if (check_token(tb_current(tbuf), read) != 0)
+            return 1;
+
+        tb_drop(tbuf);
+    }
+
+    if (tb_current(tbuf) != NULL || tb_peek(tbuf, 3) != NULL)
+    {
+        fprintf(stderr, "token_ring: tokens after the end of the input\n");
+        return 1;
+    }
+
+    printf("%u\n", (unsigned) read);
+
+    tokenbuffer_del(&tbuf);
+    tokenfactory_del(&tf);
+    free(input);
+    return 0;
+}